@@ -0,0 +1,475 @@
+#include "collections.hpp"
+#include "rational_circle.hpp"
+#include "transforms.hpp"
+#include "version.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+Benchmarks for the geometry kernel, to track regressions across releases:
+
+    bench_kernel [-s scalar] [-r repetitions] [-f filter] [-o output.json]
+
+Microbenchmarks time single kernel operations (lineIntersection,
+planeIntersection, Triangle::containsPoint, Transform::compute_inverse,
+find_rational_angle and UnitCylinder::inside) on fixed pseudo-random
+inputs. Each sample runs the operation in a loop for at least 50 ms, and
+reports nanoseconds per call. Macrobenchmarks time sliceTriangles and
+Intersection on cube/cylinder scenes, first at increasing tessellation and
+then with increasing numbers of primitives. Each sample builds its scene
+again, untimed, from new solids, and clears the evaluation cache. So every
+sample evaluates from scratch, down to the transforms, planes and trees
+that solids memoize.
+
+The scalar is one of the ScalarTraits names, and defaults to rational;
+"all" runs every one. Only benchmarks whose names contain the filter are
+run. Results go to the output as JSON (stdout without -o), with the best
+and median of the samples; progress goes to stderr. A scene that fails,
+as boost_rational does when it overflows, is reported with its error.
+*/
+
+using namespace theocad;
+
+using Clock = std::chrono::steady_clock;
+
+static double nanosecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+// Keep the compiler from discarding a result
+template <typename T>
+static void keep(const T& x) {
+    asm volatile("" : : "g"(&x) : "memory");
+}
+
+namespace {
+
+struct Result {
+    std::string name, kind;
+    // What the benchmark was run on, as JSON members
+    std::string parameters;
+    std::vector<double> samples;
+    // Operations per sample for micro, triangles produced for macro
+    long count = 0;
+    std::string error;
+};
+
+struct Options {
+    int repetitions = 5;
+    std::string filter;
+};
+
+// Pseudo-random inputs with small denominators, the same on every run
+template <typename S>
+class Inputs {
+    std::mt19937 rng{12345};
+
+public:
+    S number(int range = 16, int den = 8) {
+        return ScalarTraits<S>::fraction(std::uniform_int_distribution<int>(-range, range)(rng), den);
+    }
+
+    Vector4<S> point() { return PointT<S>(number(), number(), number()); }
+
+    TriangleT<S> triangle() {
+        for (;;) {
+            TriangleT<S> t(point(), point(), point());
+            if (t.isValid()) return t;
+        }
+    }
+
+    int integer(int n) { return std::uniform_int_distribution<int>(0, n - 1)(rng); }
+};
+
+} // namespace
+
+// Inputs are cycled through in this many variations
+static const int VARIATIONS = 256;
+
+/*
+Run op(i) on i = 0, 1, 2... in blocks until a sample has taken at least
+50 ms, and record the time per call for each sample.
+*/
+template <typename F>
+static void micro(std::vector<Result>& results, const Options& options, const std::string& name, F op) {
+    if (name.find(options.filter) == std::string::npos) return;
+    Result r;
+    r.name = name;
+    r.kind = "micro";
+    long block = 64;
+    // Warm up and size the block
+    for (;;) {
+        auto start = Clock::now();
+        for (long i = 0; i < block; i++) op(i);
+        if (nanosecondsSince(start) > 5e6) break;
+        block *= 2;
+    }
+    block *= 10;
+    for (int rep = 0; rep < options.repetitions; rep++) {
+        auto start = Clock::now();
+        for (long i = 0; i < block; i++) op(i);
+        r.samples.push_back(nanosecondsSince(start) / block);
+    }
+    r.count = block;
+    std::cerr << name << ": " << *std::min_element(r.samples.begin(), r.samples.end()) << " ns\n";
+    results.push_back(r);
+}
+
+template <typename S>
+static void microbenchmarks(std::vector<Result>& results, const Options& options) {
+    Inputs<S> in;
+
+    // Lines in the plane z = 1/2, which mostly cross, and skew lines
+    std::vector<LineT<S>> lines;
+    for (int i = 0; i < VARIATIONS; i++) {
+        Vector4<S> a = in.point(), b = in.point();
+        if (i % 4 != 3) {
+            a[2] = b[2] = ScalarTraits<S>::fraction(1, 2);
+        }
+        if (a == b) b[0] += S(1);
+        lines.emplace_back(a, b);
+    }
+    micro(results, options, "lineIntersection", [&](long i) {
+        keep(lineIntersection(lines[i % VARIATIONS], lines[(i * 7 + 1) % VARIATIONS]));
+    });
+
+    std::vector<PlaneT<S>> planes;
+    for (int i = 0; i < VARIATIONS; i++) planes.push_back(in.triangle().getPlane());
+    micro(results, options, "planeIntersection", [&](long i) {
+        keep(planeIntersection(planes[i % VARIATIONS], planes[(i * 7 + 1) % VARIATIONS]));
+    });
+
+    // Points in each triangle's plane: its corners, its edge midpoints,
+    // and combinations of the corners that may fall inside or outside
+    std::vector<TriangleT<S>> triangles;
+    std::vector<Vector4<S>> points;
+    for (int i = 0; i < VARIATIONS; i++) {
+        TriangleT<S> t = in.triangle();
+        Vector4<S> p;
+        switch (i % 4) {
+        case 0:
+            p = t[i % 3];
+            break;
+        case 1:
+            p = t[0] + ScalarTraits<S>::fraction(1, 2) * (t[1] - t[0]);
+            break;
+        default: {
+            S u = in.number(4, 4), v = in.number(4, 4);
+            p = t[0] + u * (t[1] - t[0]) + v * (t[2] - t[0]);
+        }
+        }
+        triangles.push_back(t);
+        points.push_back(p);
+    }
+    micro(results, options, "Triangle::containsPoint", [&](long i) {
+        bool inside = triangles[i % VARIATIONS].containsPoint(points[i % VARIATIONS]);
+        keep(inside);
+    });
+
+    // Rotations by a rational angle about z, then scaled and shifted, so
+    // the inverse has all the parts a real one does
+    std::vector<Matrix4<S>> matrices;
+    for (int i = 0; i < VARIATIONS; i++) {
+        FIII r = find_rational_angle(in.integer(360 * 4) / 4.0f);
+        S c = ScalarTraits<S>::fraction(r.c, r.d), s = ScalarTraits<S>::fraction(r.b, r.d);
+        S k = ScalarTraits<S>::fraction(in.integer(8) + 1, 4);
+        Matrix4<S> m;
+        m.setIdentity();
+        m(0, 0) = k * c;
+        m(0, 1) = -k * s;
+        m(1, 0) = k * s;
+        m(1, 1) = k * c;
+        m(2, 2) = k;
+        for (int j = 0; j < 3; j++) m(j, 3) = in.number();
+        matrices.push_back(m);
+    }
+    TransformT<S> transform;
+    micro(results, options, "Transform::compute_inverse", [&](long i) {
+        // Setting the matrix invalidates the inverse
+        transform.modifyAffine() = matrices[i % VARIATIONS];
+        keep(transform.getInverse());
+    });
+
+    micro(results, options, "find_rational_angle", [&](long i) {
+        keep(find_rational_angle(((i * 37) % (360 * 4)) / 4.0f));
+    });
+
+    // Points around the cylinder, some on its surfaces
+    std::vector<Vector4<S>> around;
+    for (int i = 0; i < VARIATIONS; i++) {
+        around.push_back(PointT<S>(in.number(10, 8), in.number(10, 8), in.number(6, 4)));
+    }
+    const SolidPtrT<S>& cylinder = globalUnitCylinder<S>();
+    micro(results, options, "UnitCylinder::inside", [&](long i) {
+        bool inside = cylinder->inside(around[i % VARIATIONS]);
+        keep(inside);
+    });
+}
+
+// A unit cube with each face cut into an n by n grid
+template <typename S>
+static SolidPtrT<S> tessellatedCube(int n) {
+    static const int corners[6][4] = {
+        {0, 3, 2, 1}, {4, 5, 6, 7}, {0, 1, 5, 4}, {2, 3, 7, 6}, {0, 4, 7, 3}, {1, 2, 6, 5}
+    };
+    auto corner = [](int c) { return PointT<S>(c == 1 || c == 2 || c == 5 || c == 6, c == 2 || c == 3 || c == 6 || c == 7, c >= 4); };
+    std::vector<SurfaceT<S>> surfaces(6);
+    for (int f = 0; f < 6; f++) {
+        Vector4<S> o = corner(corners[f][0]);
+        Vector4<S> u = corner(corners[f][1]) - o, v = corner(corners[f][3]) - o;
+        auto at = [&](int i, int j) {
+            return Vector4<S>(o + ScalarTraits<S>::fraction(i, n) * u + ScalarTraits<S>::fraction(j, n) * v);
+        };
+        std::vector<TriangleT<S>> ts;
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n; j++) {
+                ts.emplace_back(at(i, j), at(i+1, j), at(i+1, j+1));
+                ts.emplace_back(at(i, j), at(i+1, j+1), at(i, j+1));
+            }
+        }
+        surfaces[f].appendTriangles(ts);
+    }
+    return std::make_shared<MeshSolidT<S>>(std::move(surfaces));
+}
+
+// A unit cylinder, like UnitCylinder, with a side every step degrees
+template <typename S>
+static SolidPtrT<S> tessellatedCylinder(float step) {
+    auto at = [](float angle, int z) {
+        FIII r = find_rational_angle(angle);
+        return PointT<S>(ScalarTraits<S>::fraction(r.c, r.d), ScalarTraits<S>::fraction(r.b, r.d), z);
+    };
+    std::vector<TriangleT<S>> top, bot, outer;
+    int sides = std::lround(360 / step);
+    for (int i = 0; i < sides; i++) {
+        float a = i * step, b = (i + 1) * step;
+        top.emplace_back(at(a, 1), at(b, 1), PointT<S>(0, 0, 1));
+        bot.emplace_back(at(b, 0), at(a, 0), PointT<S>(0, 0, 0));
+        outer.emplace_back(at(b, 1), at(a, 1), at(a, 0));
+        outer.emplace_back(at(a, 0), at(b, 0), at(b, 1));
+    }
+    std::vector<SurfaceT<S>> surfaces(3);
+    surfaces[0].appendTriangles(top);
+    surfaces[1].appendTriangles(bot);
+    surfaces[2].appendTriangles(outer);
+    return std::make_shared<MeshSolidT<S>>(std::move(surfaces));
+}
+
+template <typename S>
+static SolidPtrT<S> translated(SolidPtrT<S> child, const Vector4<S>& shift) {
+    auto t = std::make_shared<TranslateT<S>>(shift);
+    t->setChild(child);
+    return t;
+}
+
+template <typename S>
+static SolidPtrT<S> scaled(SolidPtrT<S> child, const Vector4<S>& factors) {
+    auto t = std::make_shared<ScaleT<S>>(factors);
+    t->setChild(child);
+    return t;
+}
+
+template <typename S>
+static std::vector<TriangleT<S>> allTriangles(const SolidT<S>& solid) {
+    std::vector<TriangleT<S>> ts;
+    for (int i = 0; i < solid.size(); i++) {
+        std::vector<TriangleT<S>> more = solid[i].getTriangles();
+        ts.insert(ts.end(), more.begin(), more.end());
+    }
+    return ts;
+}
+
+// Time run(), which returns the number of triangles it made. Before each
+// sample, setup() builds everything run() works on afresh, untimed.
+static void macro(std::vector<Result>& results, const Options& options, const std::string& name, const std::string& parameters,
+                  const std::function<void()>& setup, const std::function<long()>& run) {
+    if (name.find(options.filter) == std::string::npos) return;
+    Result r;
+    r.name = name;
+    r.kind = "macro";
+    r.parameters = parameters;
+    try {
+        for (int rep = 0; rep < options.repetitions; rep++) {
+            setup();
+            auto start = Clock::now();
+            r.count = run();
+            r.samples.push_back(nanosecondsSince(start));
+        }
+        std::cerr << name << " {" << parameters << "}: " << *std::min_element(r.samples.begin(), r.samples.end()) / 1e6 << " ms, "
+                  << r.count << " triangles\n";
+    } catch (const std::exception& e) {
+        r.error = e.what();
+        std::cerr << name << " {" << parameters << "}: failed (" << e.what() << ")\n";
+    }
+    results.push_back(r);
+}
+
+template <typename S>
+static void macrobenchmarks(std::vector<Result>& results, const Options& options) {
+    // The cube is shifted off the cylinder's axis so that nothing lines up
+    Vector4<S> shift = VectorT<S>(ScalarTraits<S>::fraction(1, 3), ScalarTraits<S>::fraction(1, 5), ScalarTraits<S>::fraction(1, 7));
+
+    static const struct {
+        int cube;
+        float cylinder;
+    } levels[] = {{1, 30}, {2, 15}, {4, 10}, {8, 5}, {16, 2.5}};
+    for (const auto& level : levels) {
+        std::ostringstream parameters;
+        parameters << "\"cube_divisions\": " << level.cube << ", \"cylinder_step\": " << level.cylinder;
+        SolidPtrT<S> cube, cylinder;
+        auto build = [&] {
+            EvaluationCacheT<S>::global().clear();
+            cube = translated(tessellatedCube<S>(level.cube), shift);
+            cylinder = tessellatedCylinder<S>(level.cylinder);
+        };
+
+        std::vector<TriangleT<S>> a, b;
+        macro(results, options, "sliceTriangles", parameters.str(), [&] {
+            build();
+            a = allTriangles(*cylinder);
+            b = allTriangles(*cube);
+        }, [&] {
+            std::vector<TriangleT<S>> pieces;
+            sliceTriangles(a, b, pieces);
+            return long(pieces.size());
+        });
+
+        macro(results, options, "Intersection", parameters.str(), build, [&] {
+            auto col = std::make_shared<IntersectionT<S>>();
+            col->setChildA() = cylinder;
+            col->setChildB() = cube;
+            return long(allTriangles(*col).size());
+        });
+    }
+
+    // A row of thin cubes across the unit cylinder. The primitives are new
+    // ones rather than the global ones, whose surfaces keep their memos.
+    for (int count : {1, 2, 4, 8, 16}) {
+        std::ostringstream parameters;
+        parameters << "\"primitives\": " << count;
+        SolidPtrT<S> cylinder, row;
+        auto build = [&] {
+            EvaluationCacheT<S>::global().clear();
+            cylinder = std::make_shared<UnitCylinderT<S>>();
+            auto cubes = std::make_shared<CollectionT<S>>();
+            SolidPtrT<S> cube = std::make_shared<UnitCubeT<S>>();
+            Vector4<S> factors = VectorT<S>(ScalarTraits<S>::fraction(1, 2 * count), 1, ScalarTraits<S>::fraction(1, 2));
+            for (int i = 0; i < count; i++) {
+                Vector4<S> at = VectorT<S>(ScalarTraits<S>::fraction(2 * i - count, count) + ScalarTraits<S>::fraction(1, 7 * count),
+                                           ScalarTraits<S>::fraction(-1, 3), ScalarTraits<S>::fraction(1, 5));
+                cubes->addChild(translated(scaled(cube, factors), at));
+            }
+            row = cubes;
+        };
+        macro(results, options, "Intersection", parameters.str(), build, [&] {
+            auto col = std::make_shared<IntersectionT<S>>();
+            col->setChildA() = cylinder;
+            col->setChildB() = row;
+            return long(allTriangles(*col).size());
+        });
+    }
+}
+
+static void writeJSON(std::ostream& os, const std::string& scalar, const std::vector<Result>& results) {
+    os << "{\n  \"version\": \"" << THEOCAD_VERSION << "\",\n  \"scalar\": \"" << scalar << "\",\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        std::vector<double> sorted = r.samples;
+        std::sort(sorted.begin(), sorted.end());
+        os << (i ? ",\n" : "\n") << "    {\"name\": \"" << r.name << "\", \"kind\": \"" << r.kind << "\"";
+        if (!r.parameters.empty()) os << ", " << r.parameters;
+        if (!r.error.empty()) {
+            // Messages are plain text, but keep them from breaking the string
+            std::string message = r.error;
+            std::replace(message.begin(), message.end(), '"', '\'');
+            std::replace(message.begin(), message.end(), '\\', '/');
+            os << ", \"error\": \"" << message << "\"}";
+            continue;
+        }
+        const char *unit = r.kind == "micro" ? "ns" : "ms";
+        double scale = r.kind == "micro" ? 1 : 1e-6;
+        os << ", \"" << (r.kind == "micro" ? "iterations" : "triangles") << "\": " << r.count
+           << ", \"unit\": \"" << unit << "\", \"best\": " << sorted.front() * scale
+           << ", \"median\": " << sorted[sorted.size() / 2] * scale << ", \"samples\": [";
+        for (size_t j = 0; j < r.samples.size(); j++) os << (j ? ", " : "") << r.samples[j] * scale;
+        os << "]}";
+    }
+    os << "\n  ]\n}\n";
+}
+
+template <typename S>
+static void run(const Options& options, std::vector<std::pair<std::string, std::vector<Result>>>& runs) {
+    std::cerr << "scalar " << ScalarTraits<S>::name() << "\n";
+    std::vector<Result> results;
+    microbenchmarks<S>(results, options);
+    macrobenchmarks<S>(results, options);
+    runs.emplace_back(ScalarTraits<S>::name(), std::move(results));
+}
+
+static int usage() {
+    std::cerr << "usage: bench_kernel [-s scalar] [-r repetitions] [-f filter] [-o output.json]\n";
+    return 2;
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    std::string scalar = "rational", output;
+    for (int i = 1; i < argc; i++) {
+        if (!std::strcmp(argv[i], "-s") && i+1 < argc) {
+            scalar = argv[++i];
+        } else if (!std::strcmp(argv[i], "-r") && i+1 < argc) {
+            options.repetitions = std::max(1, std::atoi(argv[++i]));
+        } else if (!std::strcmp(argv[i], "-f") && i+1 < argc) {
+            options.filter = argv[++i];
+        } else if (!std::strcmp(argv[i], "-o") && i+1 < argc) {
+            output = argv[++i];
+        } else {
+            return usage();
+        }
+    }
+
+    std::vector<std::pair<std::string, std::vector<Result>>> runs;
+    bool known = false;
+#define THEOCAD_RUN(S) \
+    if (scalar == "all" || scalar == ScalarTraits<S>::name()) { \
+        run<S>(options, runs); \
+        known = true; \
+    }
+    THEOCAD_FOR_EACH_SCALAR(THEOCAD_RUN)
+#undef THEOCAD_RUN
+    if (!known) {
+        std::cerr << "bench_kernel: unknown scalar " << scalar << "\n";
+        return 2;
+    }
+
+    std::ostringstream json;
+    if (runs.size() == 1) {
+        writeJSON(json, runs[0].first, runs[0].second);
+    } else {
+        json << "[\n";
+        for (size_t i = 0; i < runs.size(); i++) {
+            if (i) json << ",\n";
+            writeJSON(json, runs[i].first, runs[i].second);
+        }
+        json << "]\n";
+    }
+    if (output.empty()) {
+        std::cout << json.str();
+    } else {
+        std::ofstream os(output);
+        os << json.str();
+        if (!os) {
+            std::cerr << "bench_kernel: can't write " << output << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include "geometry.hpp"
+#include "transforms.hpp"
+#include "collections.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+/*
+Compare the scalar instantiations of the kernel on the cube/cylinder
+Intersection scene from test.cpp. Usage:
+
+    bench_scalar [repetitions [scalar...]]
+
+where each scalar is one of the ScalarTraits names (boost_rational,
+rational, fixed, double). With no scalars listed, all of them are run.
+*/
+
+using namespace theocad;
+
+template <typename S>
+static int evaluateScene() {
+    auto trans = std::make_shared<TranslateT<S>>();
+    trans->setShift(VectorT<S>(0, 0, 0));
+    trans->setChild(globalUnitCube<S>());
+
+    auto col = std::make_shared<IntersectionT<S>>();
+    col->setChildA() = globalUnitCylinder<S>();
+    col->setChildB() = trans;
+
+    int triangles = 0;
+    for (int i=0; i<col->size(); i++) triangles += (*col)[i].size();
+    return triangles;
+}
+
+template <typename S>
+static void benchmark(int repetitions, int argc, char *argv[]) {
+    if (argc > 2) {
+        bool selected = false;
+        for (int i=2; i<argc; i++) {
+            if (ScalarTraits<S>::name() == std::string(argv[i])) selected = true;
+        }
+        if (!selected) return;
+    }
+
+    using clock = std::chrono::steady_clock;
+    double best = 0;
+    int triangles = 0;
+    try {
+        for (int r=0; r<repetitions; r++) {
+            auto start = clock::now();
+            triangles = evaluateScene<S>();
+            double ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+            if (r == 0 || ms < best) best = ms;
+        }
+    } catch (const std::exception& e) {
+        // boost::rational<int64_t> overflows on this scene
+        std::cout << ScalarTraits<S>::name() << ": failed (" << e.what() << ")\n";
+        return;
+    }
+    std::cout << ScalarTraits<S>::name() << ": " << best << " ms, " << triangles << " triangles\n";
+}
+
+int main(int argc, char *argv[]) {
+    int repetitions = argc > 1 ? std::atoi(argv[1]) : 3;
+    if (repetitions < 1) repetitions = 1;
+
+#define THEOCAD_BENCHMARK(S) benchmark<S>(repetitions, argc, argv);
+    THEOCAD_FOR_EACH_SCALAR(THEOCAD_BENCHMARK)
+#undef THEOCAD_BENCHMARK
+
+    return 0;
+}
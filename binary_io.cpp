@@ -0,0 +1,504 @@
+#include "binary_io.hpp"
+#include "version.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace theocad {
+
+namespace {
+
+const char MAGIC[8] = {'t', 'h', 'e', 'o', 'c', 'a', 'd', 'b'};
+const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+enum SectionIndex {
+    VERTICES,
+    TRIANGLES,
+    SURFACES,
+    NODES,
+    CHILDREN,
+    PARAMETERS,
+    WORDS,
+    SECTIONS
+};
+
+// Bytes per element of each section
+const size_t ELEMENT_SIZE[SECTIONS] = {
+    3 * sizeof(BinaryFile::Scalar),
+    3 * sizeof(uint32_t),
+    sizeof(BinaryFile::Surface),
+    sizeof(BinaryFile::Node),
+    sizeof(uint32_t),
+    sizeof(BinaryFile::Scalar),
+    sizeof(uint64_t)
+};
+
+struct SectionRecord {
+    uint64_t offset, count;
+};
+
+struct Header {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t byte_order;
+    char scalar[16];
+    char library[16];
+    Hash128 key;
+    SectionRecord sections[SECTIONS];
+};
+
+static_assert(sizeof(Header) % 8 == 0, "sections have to stay aligned");
+static_assert(sizeof(BinaryFile::Node) == 24, "nodes have to be packed");
+
+std::string fixedText(const char *s, size_t n) {
+    return std::string(s, strnlen(s, n));
+}
+
+void setFixedText(char *out, size_t n, const std::string& s) {
+    std::memset(out, 0, n);
+    std::memcpy(out, s.data(), std::min(n - 1, s.size()));
+}
+
+// Big rationals go in the word table as whether they're negative, the
+// numbers of words of their numerator and denominator, and those words
+template <typename S>
+struct ScalarCodec;
+
+template <>
+struct ScalarCodec<double> {
+    static BinaryFile::Scalar encode(double x, std::vector<uint64_t>&) {
+        BinaryFile::Scalar r = {0, 0};
+        std::memcpy(&r.a, &x, sizeof x);
+        return r;
+    }
+    static double decode(const BinaryFile::Scalar& r, const uint64_t *, size_t) {
+        double x;
+        std::memcpy(&x, &r.a, sizeof x);
+        return x;
+    }
+};
+
+template <>
+struct ScalarCodec<Fixed> {
+    static BinaryFile::Scalar encode(Fixed x, std::vector<uint64_t>&) { return {x.raw(), 0}; }
+    static Fixed decode(const BinaryFile::Scalar& r, const uint64_t *, size_t) { return Fixed::fromRaw(r.a); }
+};
+
+template <>
+struct ScalarCodec<ExactRational> {
+    static BinaryFile::Scalar encode(const ExactRational& x, std::vector<uint64_t>&) {
+        return {x.numerator().value(), x.denominator().value()};
+    }
+    static ExactRational decode(const BinaryFile::Scalar& r, const uint64_t *, size_t) {
+        if (r.b <= 0) throw std::runtime_error("bad denominator");
+        return ExactRational(r.a, r.b);
+    }
+};
+
+template <>
+struct ScalarCodec<Rational> {
+    static BinaryFile::Scalar encode(const Rational& x, std::vector<uint64_t>& words) {
+        if (x.isInline()) return {x.numerator(), x.denominator()};
+        bool negative;
+        std::vector<uint64_t> num, den;
+        x.toWords(negative, num, den);
+        BinaryFile::Scalar r = {int64_t(words.size()), 0};
+        words.push_back(negative);
+        words.push_back(num.size());
+        words.push_back(den.size());
+        words.insert(words.end(), num.begin(), num.end());
+        words.insert(words.end(), den.begin(), den.end());
+        return r;
+    }
+    static Rational decode(const BinaryFile::Scalar& r, const uint64_t *words, size_t count) {
+        if (r.b > 0) {
+            if (r.a == INT64_MIN || (r.a == 0 && r.b != 1)) throw std::runtime_error("bad scalar");
+            return Rational::fromCanonical(r.a, r.b);
+        }
+        if (r.b < 0 || r.a < 0 || uint64_t(r.a) > count || count - r.a < 3) throw std::runtime_error("bad scalar");
+        const uint64_t *w = words + r.a;
+        uint64_t nn = w[1], dn = w[2], left = count - r.a - 3;
+        if (nn > left || dn > left - nn) throw std::runtime_error("bad scalar");
+        return Rational::fromWords(w[0] != 0, w + 3, nn, w + 3 + nn, dn);
+    }
+};
+
+uint32_t checkedCount(size_t n) {
+    if (n > UINT32_MAX) throw std::runtime_error("too big for the binary format");
+    return uint32_t(n);
+}
+
+// Gathers the tables, then writes them out in one go
+template <typename S>
+class BinaryWriter {
+    std::vector<BinaryFile::Scalar> vertices, parameters;
+    std::vector<uint32_t> triangles, children;
+    std::vector<BinaryFile::Surface> surfaces;
+    std::vector<BinaryFile::Node> nodes;
+    std::vector<uint64_t> words;
+    std::unordered_map<const SolidT<S> *, uint32_t> written;
+
+    BinaryFile::Scalar encode(const S& x) { return ScalarCodec<S>::encode(x, words); }
+
+    void addParameters(BinaryFile::Node& node, const Vector4<S>& v) {
+        node.param_count = 3;
+        for (int c = 0; c < 3; c++) parameters.push_back(encode(v[c]));
+    }
+
+public:
+    // The surface's vertices and triangles go in as they are, so that they
+    // can be read back without renumbering
+    void addSurface(const SurfaceT<S>& surface) {
+        BinaryFile::Surface s = {
+            checkedCount(triangles.size() / 3), checkedCount(surface.size()),
+            checkedCount(vertices.size() / 3), checkedCount(surface.vertexCount())
+        };
+        for (int vi = 0; vi < surface.vertexCount(); vi++) {
+            for (int c = 0; c < 3; c++) vertices.push_back(encode(surface.getVertex(vi)[c]));
+        }
+        for (int ix = 0; ix < surface.size(); ix++) {
+            const TriangleIndices& t = surface.getIndices(ix);
+            for (int k = 0; k < 3; k++) triangles.push_back(t[k]);
+        }
+        surfaces.push_back(s);
+    }
+
+    // Children go first, and a node already written is just referred to
+    uint32_t addNode(const SolidT<S>& solid) {
+        auto found = written.find(&solid);
+        if (found != written.end()) return found->second;
+
+        BinaryFile::Node node = {0, 0, 0, checkedCount(parameters.size()), 0, 0};
+        std::vector<SolidPtrT<S>> kids;
+        if (auto r = dynamic_cast<const RotateT<S> *>(&solid)) {
+            node.kind = BinaryFile::ROTATE;
+            node.angle = r->getAngle();
+            addParameters(node, r->getAxis());
+        } else if (auto t = dynamic_cast<const TranslateT<S> *>(&solid)) {
+            node.kind = BinaryFile::TRANSLATE;
+            addParameters(node, t->getShift());
+        } else if (auto s = dynamic_cast<const ScaleT<S> *>(&solid)) {
+            node.kind = BinaryFile::SCALE;
+            addParameters(node, s->getFactors());
+        } else if (auto m = dynamic_cast<const TransformT<S> *>(&solid)) {
+            node.kind = BinaryFile::TRANSFORM;
+            node.param_count = 16;
+            for (int i = 0; i < 4; i++) {
+                for (int j = 0; j < 4; j++) parameters.push_back(encode(m->getAffine()(i, j)));
+            }
+        } else if (auto b = dynamic_cast<const IntersectionT<S> *>(&solid)) {
+            node.kind = BinaryFile::INTERSECTION;
+            kids = {b->getChildA(), b->getChildB()};
+        } else if (auto c = dynamic_cast<const CollectionT<S> *>(&solid)) {
+            node.kind = BinaryFile::COLLECTION;
+            kids = c->getChildren();
+        } else if (dynamic_cast<const UnitCubeT<S> *>(&solid)) {
+            node.kind = BinaryFile::CUBE;
+        } else if (dynamic_cast<const UnitCylinderT<S> *>(&solid)) {
+            node.kind = BinaryFile::CYLINDER;
+        } else {
+            throw std::runtime_error("can't store this kind of solid in a tree");
+        }
+        if (auto t = dynamic_cast<const TransformT<S> *>(&solid)) kids = {t->getChild()};
+
+        std::vector<uint32_t> indices;
+        for (const SolidPtrT<S>& kid : kids) {
+            if (!kid) throw std::runtime_error("can't store a tree with missing children");
+            indices.push_back(addNode(*kid));
+        }
+        node.first_child = checkedCount(children.size());
+        node.child_count = checkedCount(indices.size());
+        children.insert(children.end(), indices.begin(), indices.end());
+
+        uint32_t ix = checkedCount(nodes.size());
+        nodes.push_back(node);
+        written.emplace(&solid, ix);
+        return ix;
+    }
+
+    void write(const std::string& filename, const Hash128& key) {
+        Header header = Header();
+        std::memcpy(header.magic, MAGIC, sizeof MAGIC);
+        header.format_version = BinaryFile::FORMAT_VERSION;
+        header.byte_order = BYTE_ORDER_MARK;
+        setFixedText(header.scalar, sizeof header.scalar, ScalarTraits<S>::name());
+        setFixedText(header.library, sizeof header.library, THEOCAD_VERSION);
+        header.key = key;
+
+        const void *data[SECTIONS] = {
+            vertices.data(), triangles.data(), surfaces.data(), nodes.data(),
+            children.data(), parameters.data(), words.data()
+        };
+        const size_t counts[SECTIONS] = {
+            vertices.size() / 3, triangles.size() / 3, surfaces.size(), nodes.size(),
+            children.size(), parameters.size(), words.size()
+        };
+        uint64_t offset = sizeof header;
+        for (int ix = 0; ix < SECTIONS; ix++) {
+            header.sections[ix] = {offset, counts[ix]};
+            offset += (counts[ix] * ELEMENT_SIZE[ix] + 7) & ~uint64_t(7);
+        }
+
+        FILE *f = std::fopen(filename.c_str(), "wb");
+        if (!f) throw std::runtime_error("can't write " + filename + ": " + std::strerror(errno));
+        std::vector<char> buffer(size_t(1) << 20);
+        std::setvbuf(f, buffer.data(), _IOFBF, buffer.size());
+        static const char padding[8] = {};
+        bool ok = std::fwrite(&header, sizeof header, 1, f) == 1;
+        for (int ix = 0; ix < SECTIONS && ok; ix++) {
+            size_t n = counts[ix] * ELEMENT_SIZE[ix];
+            if (n) ok = std::fwrite(data[ix], 1, n, f) == n;
+            size_t pad = (8 - n % 8) % 8;
+            if (ok && pad) ok = std::fwrite(padding, 1, pad, f) == pad;
+        }
+        if (std::fclose(f) != 0) ok = false;
+        if (!ok) throw std::runtime_error("error writing " + filename);
+    }
+};
+
+} // namespace
+
+BinaryFile::BinaryFile(const std::string& filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("can't read " + filename + ": " + std::strerror(errno));
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(Header)) {
+        void *p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            data_ = p;
+            size_ = st.st_size;
+        }
+    }
+    ::close(fd);
+    if (!data_) throw std::runtime_error("can't map " + filename);
+
+    const Header *h = static_cast<const Header *>(data_);
+    header_ = h;
+    const char *problem = nullptr;
+    if (std::memcmp(h->magic, MAGIC, sizeof MAGIC) != 0) {
+        problem = "not a binary geometry file";
+    } else if (h->byte_order != BYTE_ORDER_MARK) {
+        problem = "written with the other byte order";
+    } else if (h->format_version != FORMAT_VERSION) {
+        problem = "written in another version of the format";
+    }
+    for (int ix = 0; ix < SECTIONS && !problem; ix++) {
+        const SectionRecord& s = h->sections[ix];
+        if (s.offset % 8 || s.offset > size_ || s.count > (size_ - s.offset) / ELEMENT_SIZE[ix]) problem = "truncated";
+    }
+    if (problem) {
+        ::munmap(data_, size_);
+        throw std::runtime_error(filename + ": " + problem);
+    }
+}
+
+BinaryFile::~BinaryFile() {
+    ::munmap(data_, size_);
+}
+
+std::string BinaryFile::scalarName() const {
+    const Header *h = static_cast<const Header *>(header_);
+    return fixedText(h->scalar, sizeof h->scalar);
+}
+
+std::string BinaryFile::libraryVersion() const {
+    const Header *h = static_cast<const Header *>(header_);
+    return fixedText(h->library, sizeof h->library);
+}
+
+Hash128 BinaryFile::key() const {
+    return static_cast<const Header *>(header_)->key;
+}
+
+template <typename T>
+const T *BinaryFile::section(int ix, size_t& count) const {
+    const SectionRecord& s = static_cast<const Header *>(header_)->sections[ix];
+    count = s.count;
+    return reinterpret_cast<const T *>(static_cast<const char *>(data_) + s.offset);
+}
+
+const BinaryFile::Scalar *BinaryFile::vertices(size_t& count) const { return section<Scalar>(VERTICES, count); }
+const uint32_t *BinaryFile::triangles(size_t& count) const { return section<uint32_t>(TRIANGLES, count); }
+const BinaryFile::Surface *BinaryFile::surfaces(size_t& count) const { return section<Surface>(SURFACES, count); }
+const BinaryFile::Node *BinaryFile::nodes(size_t& count) const { return section<Node>(NODES, count); }
+const uint32_t *BinaryFile::children(size_t& count) const { return section<uint32_t>(CHILDREN, count); }
+const BinaryFile::Scalar *BinaryFile::parameters(size_t& count) const { return section<Scalar>(PARAMETERS, count); }
+const uint64_t *BinaryFile::words(size_t& count) const { return section<uint64_t>(WORDS, count); }
+
+template <typename S>
+static void checkScalar(const BinaryFile& file) {
+    if (file.scalarName() != ScalarTraits<S>::name()) {
+        throw std::runtime_error("stored with " + file.scalarName() + ", not " + ScalarTraits<S>::name());
+    }
+}
+
+template <typename S>
+void writeBinary(const std::string& filename, const SolidT<S>& solid, int contents) {
+    BinaryWriter<S> writer;
+    if (contents & BINARY_TREE) writer.addNode(solid);
+    if (contents & BINARY_SURFACES) {
+        for (int si = 0; si < solid.size(); si++) writer.addSurface(solid[si]);
+    }
+    writer.write(filename, solid.getStructuralHash());
+}
+
+template <typename S>
+void writeBinary(const std::string& filename, const std::vector<SurfaceT<S>>& surfaces, const Hash128& key) {
+    BinaryWriter<S> writer;
+    for (const SurfaceT<S>& surface : surfaces) writer.addSurface(surface);
+    writer.write(filename, key);
+}
+
+template <typename S>
+std::vector<SurfaceT<S>> readSurfaces(const BinaryFile& file) {
+    checkScalar<S>(file);
+    size_t nv, nt, ns, nw;
+    const BinaryFile::Scalar *vertices = file.vertices(nv);
+    const uint32_t *triangles = file.triangles(nt);
+    const BinaryFile::Surface *surfaces = file.surfaces(ns);
+    const uint64_t *words = file.words(nw);
+
+    // Each surface's triangles are copied in one go, then their indices
+    // checked, and its vertices decoded in the order they're stored
+    static_assert(sizeof(TriangleIndices) == 3 * sizeof(uint32_t), "triangles have to match the file's");
+    std::vector<SurfaceT<S>> result(ns);
+    for (size_t si = 0; si < ns; si++) {
+        const BinaryFile::Surface& s = surfaces[si];
+        if (s.first > nt || s.count > nt - s.first ||
+            s.first_vertex > nv || s.vertex_count > nv - s.first_vertex || s.vertex_count > INT32_MAX) {
+            throw std::runtime_error("surface out of range");
+        }
+        std::vector<TriangleIndices> t(s.count);
+        if (s.count) std::memcpy(t.data(), triangles + 3 * size_t(s.first), s.count * sizeof(TriangleIndices));
+        for (const TriangleIndices& ti : t) {
+            for (int k = 0; k < 3; k++) {
+                if (uint32_t(ti[k]) >= s.vertex_count) throw std::runtime_error("vertex index out of range");
+            }
+        }
+        std::vector<Vector3<S>> v;
+        v.reserve(s.vertex_count);
+        for (uint32_t vi = 0; vi < s.vertex_count; vi++) {
+            const BinaryFile::Scalar *c = &vertices[3 * (size_t(s.first_vertex) + vi)];
+            v.emplace_back(ScalarCodec<S>::decode(c[0], words, nw),
+                           ScalarCodec<S>::decode(c[1], words, nw),
+                           ScalarCodec<S>::decode(c[2], words, nw));
+        }
+        result[si].setContents(std::move(v), std::move(t));
+    }
+    return result;
+}
+
+template <typename S>
+SolidPtrT<S> readTree(const BinaryFile& file) {
+    checkScalar<S>(file);
+    size_t nn, nc, np, nw;
+    const BinaryFile::Node *nodes = file.nodes(nn);
+    const uint32_t *children = file.children(nc);
+    const BinaryFile::Scalar *parameters = file.parameters(np);
+    const uint64_t *words = file.words(nw);
+    if (!nn) throw std::runtime_error("no tree stored");
+
+    std::vector<SolidPtrT<S>> built;
+    built.reserve(nn);
+    for (size_t ix = 0; ix < nn; ix++) {
+        const BinaryFile::Node& node = nodes[ix];
+        if (node.first_child > nc || node.child_count > nc - node.first_child ||
+            node.first_param > np || node.param_count > np - node.first_param) {
+            throw std::runtime_error("node out of range");
+        }
+        auto expect = [&](uint32_t kids, uint32_t params) {
+            if (node.child_count != kids || node.param_count != params) throw std::runtime_error("malformed node");
+        };
+        // Children come first, which also rules out cycles
+        auto child = [&](uint32_t k) {
+            uint32_t ci = children[node.first_child + k];
+            if (ci >= ix) throw std::runtime_error("child out of order");
+            return built[ci];
+        };
+        auto parameter = [&](uint32_t k) {
+            return ScalarCodec<S>::decode(parameters[node.first_param + k], words, nw);
+        };
+        auto triple = [&]() {
+            return Vector4<S>(VectorT<S>(parameter(0), parameter(1), parameter(2)));
+        };
+
+        SolidPtrT<S> solid;
+        switch (node.kind) {
+        case BinaryFile::CUBE:
+            expect(0, 0);
+            solid = globalUnitCube<S>();
+            break;
+        case BinaryFile::CYLINDER:
+            expect(0, 0);
+            solid = globalUnitCylinder<S>();
+            break;
+        case BinaryFile::TRANSFORM: {
+            expect(1, 16);
+            auto t = std::make_shared<TransformT<S>>();
+            Matrix4<S>& m = t->modifyAffine();
+            for (int i = 0; i < 4; i++) {
+                for (int j = 0; j < 4; j++) m(i, j) = parameter(4*i + j);
+            }
+            t->setChild(child(0));
+            solid = t;
+            break;
+        }
+        case BinaryFile::TRANSLATE: {
+            expect(1, 3);
+            auto t = std::make_shared<TranslateT<S>>(PointT<S>(parameter(0), parameter(1), parameter(2)));
+            t->setChild(child(0));
+            solid = t;
+            break;
+        }
+        case BinaryFile::SCALE: {
+            expect(1, 3);
+            auto t = std::make_shared<ScaleT<S>>(triple());
+            t->setChild(child(0));
+            solid = t;
+            break;
+        }
+        case BinaryFile::ROTATE: {
+            expect(1, 3);
+            auto t = std::make_shared<RotateT<S>>();
+            t->setAngle(node.angle);
+            t->modifyAxis() = triple();
+            t->setChild(child(0));
+            solid = t;
+            break;
+        }
+        case BinaryFile::COLLECTION: {
+            auto c = std::make_shared<CollectionT<S>>();
+            for (uint32_t k = 0; k < node.child_count; k++) c->addChild(child(k));
+            solid = c;
+            break;
+        }
+        case BinaryFile::INTERSECTION: {
+            expect(2, 0);
+            auto b = std::make_shared<IntersectionT<S>>();
+            b->setChildA() = child(0);
+            b->setChildB() = child(1);
+            solid = b;
+            break;
+        }
+        default:
+            throw std::runtime_error("unknown kind of node");
+        }
+        built.push_back(solid);
+    }
+    return built.back();
+}
+
+#define THEOCAD_INSTANTIATE_BINARY_IO(S) \
+    template void writeBinary<S>(const std::string&, const SolidT<S>&, int); \
+    template void writeBinary<S>(const std::string&, const std::vector<SurfaceT<S>>&, const Hash128&); \
+    template std::vector<SurfaceT<S>> readSurfaces<S>(const BinaryFile&); \
+    template SolidPtrT<S> readTree<S>(const BinaryFile&);
+THEOCAD_FOR_EACH_SCALAR(THEOCAD_INSTANTIATE_BINARY_IO)
+
+} // namespace theocad
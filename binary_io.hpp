@@ -0,0 +1,133 @@
+#ifndef INCLUDED_BINARY_IO_HPP
+#define INCLUDED_BINARY_IO_HPP
+
+#include "collections.hpp"
+#include "transforms.hpp"
+#include <string>
+
+/*
+Exact geometry in a binary file, for loading without parsing.
+
+A file holds surfaces, a CSG tree, or both. Everything is in fixed-size
+records, in sections aligned to 8 bytes, so that once the file is mapped
+into memory its tables can be read where they are:
+
+- Vertices, three scalars each.
+- Triangles, as three uint32 indices into their surface's vertices.
+- Surfaces, each a run of consecutive triangles and a run of consecutive
+  vertices, laid out just as SurfaceT holds them. Reading one back is a
+  copy of its triangles, a check of their indices, and a decode of its
+  vertices, with no renumbering. Points that several surfaces share are
+  stored once for each.
+- Nodes of the tree, in post-order, so children come before their parents
+  and the root comes last. A subtree shared in memory is shared in the
+  file. Their children and parameters are in tables of their own.
+
+Scalars are stored exactly, as a numerator and denominator for the
+rationals, the raw value for Fixed, and the bits of a double. Rationals too
+big for 64 bits have their words in one more table. Rationals are written
+reduced, and Rational takes them back without reducing them again;
+boost::rational has no way to skip that, so ExactRational still does.
+
+Files are in the byte order of the machine that wrote them, which is
+checked, along with the scalar type, when they're opened. The header
+carries the format version, the library version that wrote it, and a
+128-bit key, which by default is the structural hash of the tree.
+*/
+
+namespace theocad {
+
+class BinaryFile {
+public:
+    static const uint32_t FORMAT_VERSION = 2;
+
+    struct Scalar {
+        int64_t a, b;
+    };
+
+    struct Surface {
+        uint32_t first, count;               // Triangles
+        uint32_t first_vertex, vertex_count;
+    };
+
+    enum NodeKind : uint32_t {
+        CUBE = 1,
+        CYLINDER,
+        TRANSFORM,    // Parameters: the 16 entries of the matrix, by row
+        TRANSLATE,    // The shift
+        SCALE,        // The factors
+        ROTATE,       // The axis, and the angle in the node
+        COLLECTION,
+        INTERSECTION  // Two children
+    };
+
+    struct Node {
+        uint32_t kind;
+        uint32_t first_child, child_count;
+        uint32_t first_param, param_count;
+        float angle;
+    };
+
+private:
+    void *data_ = nullptr;
+    size_t size_ = 0;
+    const void *header_ = nullptr;
+
+    template <typename T>
+    const T *section(int ix, size_t& count) const;
+
+public:
+    // Map a file and check its header. Throws std::runtime_error if it
+    // can't be read or isn't a binary geometry file for this machine.
+    explicit BinaryFile(const std::string& filename);
+    ~BinaryFile();
+    BinaryFile(const BinaryFile&) = delete;
+    BinaryFile& operator=(const BinaryFile&) = delete;
+
+    std::string scalarName() const;
+    std::string libraryVersion() const;
+    Hash128 key() const;
+
+    // The tables, in place. Indices aren't checked against the table
+    // they index until the contents are read.
+    const Scalar *vertices(size_t& count) const;       // Three per vertex
+    const uint32_t *triangles(size_t& count) const;    // Three per triangle
+    const Surface *surfaces(size_t& count) const;
+    const Node *nodes(size_t& count) const;            // Empty without a tree
+    const uint32_t *children(size_t& count) const;
+    const Scalar *parameters(size_t& count) const;
+    const uint64_t *words(size_t& count) const;
+
+    bool hasTree() const {
+        size_t n;
+        nodes(n);
+        return n > 0;
+    }
+};
+
+enum BinaryContents {
+    BINARY_TREE = 1,
+    BINARY_SURFACES = 2
+};
+
+// Write a solid's tree, its evaluated surfaces, or both. The tree can only
+// be made of the primitives, transforms, collections and intersections.
+template <typename S>
+void writeBinary(const std::string& filename, const SolidT<S>& solid, int contents = BINARY_TREE | BINARY_SURFACES);
+
+// Write just surfaces, under a key of the caller's choosing
+template <typename S>
+void writeBinary(const std::string& filename, const std::vector<SurfaceT<S>>& surfaces, const Hash128& key);
+
+// Build the surfaces from a file's tables. Throws std::runtime_error if they were
+// stored with another scalar type, or don't hold together.
+template <typename S>
+std::vector<SurfaceT<S>> readSurfaces(const BinaryFile& file);
+
+// Rebuild the tree, sharing what was shared when it was written
+template <typename S>
+SolidPtrT<S> readTree(const BinaryFile& file);
+
+} // namespace theocad
+
+#endif
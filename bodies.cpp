@@ -2,54 +2,231 @@
 #include "transforms.hpp"
 #include <iostream>
 #include "rational_circle.hpp"
+#include <atomic>
+#include <cmath>
 #include <stdexcept>
+#include <unordered_map>
 
 namespace theocad {
 
+uint64_t nextSurfaceVersion() {
+    static std::atomic<uint64_t> counter{0};
+    return ++counter;
+}
+
+static std::atomic<uint64_t> solid_versions{0};
+
+uint64_t nextSolidVersion() {
+    return ++solid_versions;
+}
 
-Vector4r sumNormals(const std::vector<Triangle>& triangles) {
-    Vector4r sumNormal(0, 0, 0, 0);
+uint64_t solidVersionEpoch() {
+    return solid_versions;
+}
 
-    for (const Triangle& triangle : triangles) {
-        // Vector4r edge1 = triangle[1] - triangle[0];
-        // Vector4r edge2 = triangle[2] - triangle[0];
-        // Vector4r normal = cross(edge1, edge2);
-        // sumNormal += normal;
-        sumNormal += triangle.getNormal();
+template <typename S>
+void SurfaceT<S>::computePlanes() {
+    planes.resize(size());
+    for (int ix = 0; ix < size(); ix++) {
+        Vector4<S> points[3] = {getPoint(ix, 0), getPoint(ix, 1), getPoint(ix, 2)};
+        planes[ix].compute(points);
     }
+    planes_valid = true;
+}
 
-    return sumNormal;
+template <typename S>
+void SurfaceT<S>::computeTree() {
+    // Bound each vertex once, then each triangle by its vertices
+    std::vector<Box> vertex_boxes;
+    vertex_boxes.reserve(vertices.size());
+    for (const Vector3<S>& v : vertices) vertex_boxes.push_back(boundingBox(v));
+    
+    std::vector<Box> boxes(size(), Box::empty());
+    for (int ix = 0; ix < size(); ix++) {
+        for (int k = 0; k < 3; k++) boxes[ix].expand(vertex_boxes[getIndices(ix)[k]]);
+    }
+    tree.build(boxes);
+    tree_valid = true;
 }
 
-void Surface::computeAveragePlane() {
-    Vector4r sumNormal = sumNormals(mesh);
+template <typename S>
+void SurfaceT<S>::computeDoubleMirror() {
+    static_assert(sizeof(Vector3<S>) == 3 * sizeof(S), "vertices have to be packed");
+    const std::vector<PlaneT<S>>& p = getPlanes();
+    
+    // Convert a coordinate at a time, then interleave
+    size_t n = vertices.size();
+    std::vector<double> coordinate(n);
+    doubleMirror.positions.resize(3 * n);
+    for (int c = 0; c < 3; c++) {
+        if (n) toDoubles(&vertices[0][c], 3, n, coordinate.data());
+        for (size_t vi = 0; vi < n; vi++) doubleMirror.positions[3*vi + c] = coordinate[vi];
+    }
+    
+    // The normals the same way, striding over the planes, then normalize
+    static_assert(sizeof(PlaneT<S>) == 4 * sizeof(S), "planes have to be packed");
+    size_t m = size();
+    coordinate.resize(m);
+    doubleMirror.normals.resize(3 * m);
+    for (int c = 0; c < 3; c++) {
+        if (m) toDoubles(&p[0].c[c], 4, m, coordinate.data());
+        for (size_t ix = 0; ix < m; ix++) doubleMirror.normals[3*ix + c] = coordinate[ix];
+    }
+    for (size_t ix = 0; ix < m; ix++) {
+        double *normal = &doubleMirror.normals[3*ix];
+        double length = std::sqrt(normal[0]*normal[0] + normal[1]*normal[1] + normal[2]*normal[2]);
+        if (length > 0) {
+            for (int c = 0; c < 3; c++) normal[c] /= length;
+        }
+    }
+    doubleMirror_valid = true;
+}
+
+template <typename S>
+void SurfaceT<S>::computeFloatMirror() {
+    const MeshMirror<double>& d = getDoubleMirror();
+    floatMirror.positions.assign(d.positions.begin(), d.positions.end());
+    floatMirror.normals.assign(d.normals.begin(), d.normals.end());
+    floatMirror_valid = true;
+}
+
+template <typename S>
+size_t SurfaceT<S>::memoryBytes() const {
+    size_t n = sizeof(SurfaceT) + vertices.capacity() * sizeof(Vector3<S>) + planes.capacity() * sizeof(PlaneT<S>);
+    if (triangles) n += triangles->capacity() * sizeof(TriangleIndices);
+    n += tree.memoryBytes();
+    n += (doubleMirror.positions.capacity() + doubleMirror.normals.capacity()) * sizeof(double);
+    n += (floatMirror.positions.capacity() + floatMirror.normals.capacity()) * sizeof(float);
+    for (const Vector3<S>& v : vertices) {
+        for (int c = 0; c < 3; c++) n += ScalarTraits<S>::heapBytes(v[c]);
+    }
+    for (const PlaneT<S>& p : planes) {
+        for (int c = 0; c < 4; c++) n += ScalarTraits<S>::heapBytes(p.c[c]);
+    }
+    return n;
+}
+
+template <typename S>
+void SurfaceT<S>::computeAveragePlane() {
+    Vector4<S> sumNormal(0, 0, 0, 0);
+    for (const PlaneT<S>& plane : getPlanes()) {
+        sumNormal += plane.getNormal();
+    }
     
     // Compute centroid
-    Vector4r centroid(0, 0, 0, 0);
+    Vector4<S> centroid(0, 0, 0, 0);
     int totalVertices = 0;
-    for (const Triangle& triangle : mesh) {
+    for (int ix = 0; ix < size(); ix++) {
         for (int i = 0; i < 3; ++i) {
-            centroid += triangle[i];
+            centroid += getPoint(ix, i);
         }
         totalVertices += 3;
     }
-    centroid /= totalVertices;
+    centroid /= S(totalVertices);
 
     // Define plane
-    real A = sumNormal[0];
-    real B = sumNormal[1];
-    real C = sumNormal[2];
-    real D = -(A * centroid[0] + B * centroid[1] + C * centroid[2]);
+    S A = sumNormal[0];
+    S B = sumNormal[1];
+    S C = sumNormal[2];
+    S D = -(A * centroid[0] + B * centroid[1] + C * centroid[2]);
 
-    averagePlane = Plane(A, B, C, D);
+    averagePlane = PlaneT<S>(A, B, C, D);
     averagePlane_valid = true;
 }
 
-UnitCube::UnitCube() {
+template <typename S>
+std::vector<TriangleT<S>> SurfaceT<S>::getTriangles() const {
+    const std::vector<PlaneT<S>>& p = getPlanes();
+    std::vector<TriangleT<S>> result;
+    result.reserve(size());
+    for (int ix = 0; ix < size(); ix++) {
+        result.emplace_back(getPoint(ix, 0), getPoint(ix, 1), getPoint(ix, 2), p[ix]);
+    }
+    return result;
+}
+
+template <typename S>
+void SurfaceT<S>::hashContents(StructuralHasher& h) const {
+    h.add(int(vertices.size()));
+    for (const Vector3<S>& v : vertices) h.add(v[0]).add(v[1]).add(v[2]);
+    h.add(size());
+    for (int ix = 0; ix < size(); ix++) {
+        const TriangleIndices& t = getIndices(ix);
+        h.add(t[0]).add(t[1]).add(t[2]);
+    }
+}
+
+template <typename S>
+struct VertexHash {
+    size_t operator()(const Vector3<S>& v) const {
+        return hashPair(hashPair(hashScalar(v[0]), hashScalar(v[1])), hashScalar(v[2]));
+    }
+};
+
+template <typename S>
+struct VertexEqual {
+    bool operator()(const Vector3<S>& a, const Vector3<S>& b) const {
+        return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+    }
+};
+
+template <typename S>
+void SurfaceT<S>::appendTriangles(const std::vector<TriangleT<S>>& ts) {
+    if (ts.empty()) return;
+    std::vector<TriangleIndices>& indices = modifyTriangles();
+    
+    std::unordered_map<Vector3<S>, int, VertexHash<S>, VertexEqual<S>> lookup;
+    lookup.reserve(vertices.size() + ts.size());
+    for (size_t vi = 0; vi < vertices.size(); vi++) lookup.emplace(vertices[vi], vi);
+    
+    indices.reserve(indices.size() + ts.size());
+    for (const TriangleT<S>& t : ts) {
+        TriangleIndices ti;
+        for (int k = 0; k < 3; k++) {
+            Vector3<S> v = t[k].template head<3>();
+            auto found = lookup.emplace(v, vertices.size());
+            if (found.second) vertices.push_back(v);
+            ti[k] = found.first->second;
+        }
+        indices.push_back(ti);
+    }
+}
+
+template <typename S>
+void SurfaceT<S>::setTransformed(const SurfaceT& that, const AffineT<S>& m) {
+    name = that.name;
+    triangles = that.triangles;
+    vertices.resize(that.vertices.size());
+    m.transformPoints(that.vertices.data(), vertices.size(), vertices.data());
+    invalidate();
+}
+
+template <typename S>
+void SurfaceT<S>::setTransformed(const SurfaceT& that, const Matrix4<S>& m) {
+    if (isAffine(m)) {
+        setTransformed(that, AffineT<S>(m));
+        return;
+    }
+    name = that.name;
+    triangles = that.triangles;
+    vertices.resize(that.vertices.size());
+    // Each shared vertex is transformed just once
+    for (size_t vi = 0; vi < vertices.size(); vi++) {
+        const Vector3<S>& v = that.vertices[vi];
+        Vector4<S> point = PointT<S>(v[0], v[1], v[2]);
+        Vector4<S> transformed = m * point;
+        THEOCAD_TRACE(TRANSFORM, VERBOSE, "Transformed " << point << " to " << transformed);
+        vertices[vi] = transformed.template head<3>();
+    }
+    invalidate();
+}
+
+template <typename S>
+UnitCubeT<S>::UnitCubeT() {
     // Define the vertices of the cube
-    static Vector4r vertices[8] = {
-        Point(0, 0, 0), Point(1, 0, 0), Point(1, 1, 0), Point(0, 1, 0),
-        Point(0, 0, 1), Point(1, 0, 1), Point(1, 1, 1), Point(0, 1, 1)
+    static Vector4<S> vertices[8] = {
+        PointT<S>(0, 0, 0), PointT<S>(1, 0, 0), PointT<S>(1, 1, 0), PointT<S>(0, 1, 0),
+        PointT<S>(0, 0, 1), PointT<S>(1, 0, 1), PointT<S>(1, 1, 1), PointT<S>(0, 1, 1)
     };
 
     // Define the faces of the cube
@@ -70,82 +247,72 @@ UnitCube::UnitCube() {
 
     // Create surfaces and triangles for each face
     for (int i = 0; i < 6; ++i) {
-        Surface& surface = allocateSurface();
+        SurfaceT<S>& surface = this->allocateSurface();
         
         // Create two triangles for each face
-        Triangle& t1 = surface.allocateTriangle();
-        t1.modifyPoint(0) = vertices[faces[i][0]];
-        t1.modifyPoint(1) = vertices[faces[i][1]];
-        t1.modifyPoint(2) = vertices[faces[i][2]];
-        if (!t1.isValid()) {
-            std::cout << "i=" << i << std::endl;
-            std::cout << t1 << std::endl;
-            throw std::runtime_error("bad triangle");
-        }
-
-        Triangle& t2 = surface.allocateTriangle();
-        t2.modifyPoint(0) = vertices[faces[i][0]];
-        t2.modifyPoint(1) = vertices[faces[i][2]];
-        t2.modifyPoint(2) = vertices[faces[i][3]];
-        if (!t2.isValid()) {
-            std::cout << "i=" << i << std::endl;
-            std::cout << t2 << std::endl;
-            throw std::runtime_error("bad triangle");
+        std::vector<TriangleT<S>> ts;
+        ts.emplace_back(vertices[faces[i][0]], vertices[faces[i][1]], vertices[faces[i][2]]);
+        ts.emplace_back(vertices[faces[i][0]], vertices[faces[i][2]], vertices[faces[i][3]]);
+        for (const TriangleT<S>& t : ts) {
+            if (!t.isValid()) {
+                THEOCAD_TRACE(BODIES, ERROR, "Bad triangle " << t << " in face " << i);
+                throw std::runtime_error("bad triangle");
+            }
         }
+        surface.appendTriangles(ts);
     }
 }
 
-bool UnitCube::inside(const Vector4r& p) {
+template <typename S>
+void UnitCubeT<S>::hashStructure(StructuralHasher& h) const {
+    h.add("cube");
+}
+
+template <typename S>
+bool UnitCubeT<S>::inside(const Vector4<S>& p) {
     for (int i=0; i<3; i++) {
         if (p[i] < 0 || p[i] > 1) return false;
     }
     return true;
 }
 
-UnitCylinder::UnitCylinder() {
+template <typename S>
+static Vector4<S> circlePoint(int angle, int z) {
+    FIII fiii = find_rational_angle(angle);
+    return PointT<S>(ScalarTraits<S>::fraction(fiii.c, fiii.d), ScalarTraits<S>::fraction(fiii.b, fiii.d), z);
+}
+
+template <typename S>
+static void checkedAppend(SurfaceT<S>& surface, const std::vector<TriangleT<S>>& ts, const char *what) {
+    for (const TriangleT<S>& t : ts) {
+        if (!t.isValid()) throw std::runtime_error(what);
+    }
+    surface.appendTriangles(ts);
+}
+
+template <typename S>
+UnitCylinderT<S>::UnitCylinderT() {
     int step = 5;
     
-    Surface& top_surface = allocateSurface();
+    std::vector<TriangleT<S>> top, bot, outer;
     for (int a=0; a<360; a+=step) {
-        int b = a+step;
-        FIII a_fiii = find_rational_angle(a);
-        FIII b_fiii = find_rational_angle(b);
-        Triangle& t = top_surface.allocateTriangle();
-        t.modifyPoint(0) = Point(real(a_fiii.c, a_fiii.d), real(a_fiii.b, a_fiii.d), 1);
-        t.modifyPoint(1) = Point(real(b_fiii.c, b_fiii.d), real(b_fiii.b, b_fiii.d), 1);
-        t.modifyPoint(2) = Point(0, 0, 1);
-        if (!t.isValid()) throw std::runtime_error("top surface");
-    }
-    Surface& bot_surface = allocateSurface();
-    for (int a=0; a<360; a+=step) {
-        int b = a-step;
-        FIII a_fiii = find_rational_angle(a);
-        FIII b_fiii = find_rational_angle(b);
-        Triangle& t = bot_surface.allocateTriangle();
-        t.modifyPoint(0) = Point(real(a_fiii.c, a_fiii.d), real(a_fiii.b, a_fiii.d), 0);
-        t.modifyPoint(1) = Point(real(b_fiii.c, b_fiii.d), real(b_fiii.b, b_fiii.d), 0);
-        t.modifyPoint(2) = Point(0, 0, 0);
-        if (!t.isValid()) throw std::runtime_error("bot surface");
-    }
-    Surface& outer_surface = allocateSurface();
-    for (int a=0; a<360; a+=step) {
-        int b = a+step;
-        FIII a_fiii = find_rational_angle(a);
-        FIII b_fiii = find_rational_angle(b);
-        Triangle& t1 = outer_surface.allocateTriangle();
-        t1.modifyPoint(0) = Point(real(b_fiii.c, b_fiii.d), real(b_fiii.b, b_fiii.d), 1);
-        t1.modifyPoint(1) = Point(real(a_fiii.c, a_fiii.d), real(a_fiii.b, a_fiii.d), 1);
-        t1.modifyPoint(2) = Point(real(a_fiii.c, a_fiii.d), real(a_fiii.b, a_fiii.d), 0);
-        if (!t1.isValid()) throw std::runtime_error("side surface");
-        Triangle& t2 = outer_surface.allocateTriangle();
-        t2.modifyPoint(0) = Point(real(a_fiii.c, a_fiii.d), real(a_fiii.b, a_fiii.d), 0);
-        t2.modifyPoint(1) = Point(real(b_fiii.c, b_fiii.d), real(b_fiii.b, b_fiii.d), 0);
-        t2.modifyPoint(2) = Point(real(b_fiii.c, b_fiii.d), real(b_fiii.b, b_fiii.d), 1);
-        if (!t2.isValid()) throw std::runtime_error("side surface");
-    }
-}
-
-bool UnitCylinder::inside(const Vector4r& p) {
+        top.emplace_back(circlePoint<S>(a, 1), circlePoint<S>(a+step, 1), PointT<S>(0, 0, 1));
+        bot.emplace_back(circlePoint<S>(a, 0), circlePoint<S>(a-step, 0), PointT<S>(0, 0, 0));
+        outer.emplace_back(circlePoint<S>(a+step, 1), circlePoint<S>(a, 1), circlePoint<S>(a, 0));
+        outer.emplace_back(circlePoint<S>(a, 0), circlePoint<S>(a+step, 0), circlePoint<S>(a+step, 1));
+    }
+    checkedAppend(this->allocateSurface(), top, "top surface");
+    checkedAppend(this->allocateSurface(), bot, "bot surface");
+    checkedAppend(this->allocateSurface(), outer, "side surface");
+}
+
+template <typename S>
+void UnitCylinderT<S>::hashStructure(StructuralHasher& h) const {
+    h.add("cylinder");
+}
+
+template <typename S>
+bool UnitCylinderT<S>::inside(const Vector4<S>& p) {
     // Check the vertical dimension
     if (p[2] < 0 || p[2] > 1) return false;
     
@@ -153,23 +320,23 @@ bool UnitCylinder::inside(const Vector4r& p) {
     // The vertices of the outer curve lie on an idea circle, which means
     // that the edges lie slightly inside. We can therefore accurately exclude points
     // that lie outside of the idea circle.
-    real sqd = p[0]*p[0] + p[1]*p[1];
+    S sqd = p[0]*p[0] + p[1]*p[1];
     if (sqd > 1) return false;
     
     // Ray from center out to point
-    Line ray(Point(0, 0, 0), Point(p[0], p[1], 0));
+    LineT<S> ray(PointT<S>(0, 0, 0), PointT<S>(p[0], p[1], 0));
     
     // Iterate all the edges of the bottom triangle looking to see if a
     // line from the center intersects an outer edge
-    const Surface& bot(surfaces[0]);
+    const SurfaceT<S>& bot(this->surfaces[0]);
     for (int i=0; i<bot.size(); i++) {
-        const Triangle& tri(bot[i]);
-        Line tri_edge = tri.getEdge(0);
-        LineIntersection li = lineIntersection(ray, tri_edge);
+        const TriangleT<S>& tri(bot[i]);
+        LineT<S> tri_edge = tri.getEdge(0);
+        LineIntersectionT<S> li = lineIntersection(ray, tri_edge);
         
         // Sanity check
         if (!li.exists) continue;
-        if (!li.coplanar) std::cout << "Cylinder inclusion bug\n";
+        if (!li.coplanar) THEOCAD_TRACE(BODIES, WARN, "Cylinder inclusion bug");
         
         // Skip this line if the triangle edge is not intersected
         if (!li.inside_line[1]) continue;
@@ -181,14 +348,160 @@ bool UnitCylinder::inside(const Vector4r& p) {
     return false;
 }
 
-bool Transform::inside(const Vector4r& p) {
-    return child->inside(getInverse() * p);
+template <typename S>
+MeshSolidT<S>::MeshSolidT(std::vector<SurfaceT<S>> surfaces) {
+    this->surfaces = std::move(surfaces);
+}
+
+// -1, 0 or 1
+template <typename S>
+static int signOf(const S& x) {
+    if (isZero(x)) return 0;
+    return x < S(0) ? -1 : 1;
+}
+
+template <typename S>
+bool MeshSolidT<S>::castRay(const Vector4<S>& p, const Vector4<S>& d, const Box& bounds, int& crossings, bool& on_surface) const {
+    // The ray runs along x, and leaves the bounds before it has strayed
+    // further than this in y or z
+    double start[3], slope[3];
+    toDoubles(&p[0], 1, 3, start);
+    toDoubles(&d[0], 1, 3, slope);
+    double length = bounds.hi[0] - start[0];
+    Box reach;
+    reach.lo[0] = start[0];
+    reach.hi[0] = bounds.hi[0];
+    for (int i = 1; i < 3; i++) {
+        double stray = slope[i] * length;
+        reach.lo[i] = start[i] + std::min(stray, 0.0);
+        reach.hi[i] = start[i] + std::max(stray, 0.0);
+    }
+    // The boxes are conservative, but p and d were rounded
+    for (int i = 0; i < 3; i++) {
+        double pad = 1e-9 * (1 + std::abs(reach.lo[i]) + std::abs(reach.hi[i]));
+        reach.lo[i] -= pad;
+        reach.hi[i] += pad;
+    }
+    
+    crossings = 0;
+    on_surface = false;
+    std::vector<int> candidates;
+    for (const SurfaceT<S>& surface : this->surfaces) {
+        if (!surface.size()) continue;
+        candidates.clear();
+        surface.getTree().query(reach, candidates);
+        for (int ix : candidates) {
+            const PlaneT<S>& plane = surface.getPlane(ix);
+            Vector4<S> n = plane.getNormal();
+            int side = signOf(plane.signedDistanceNumerator(p));
+            int toward = signOf(dot(n, d));
+            // The corners, relative to p
+            Vector4<S> u[3] = {surface.getPoint(ix, 0) - p, surface.getPoint(ix, 1) - p, surface.getPoint(ix, 2) - p};
+            
+            if (side == 0) {
+                // On the plane: on the triangle if it's on the inner side of every edge
+                bool within = true;
+                for (int k = 0; k < 3 && within; k++) {
+                    Vector4<S> edge = u[(k+1)%3] - u[k];
+                    Vector4<S> back = -u[k];
+                    within = signOf(dot(n, cross(edge, back))) >= 0;
+                }
+                if (within) {
+                    on_surface = true;
+                    return true;
+                }
+                // Leaving the plane, or running along it
+                if (toward == 0) return false;
+                continue;
+            }
+            // Parallel, or heading away
+            if (toward == 0 || toward == side) continue;
+            
+            // The line through p meets the triangle inside if it passes every
+            // edge on the same side, and on an edge or a vertex if it's level
+            // with some of them
+            int signs[3];
+            for (int k = 0; k < 3; k++) {
+                signs[k] = signOf(dot(d, cross(u[k], u[(k+1)%3])));
+            }
+            bool positive = signs[0] >= 0 && signs[1] >= 0 && signs[2] >= 0;
+            bool negative = signs[0] <= 0 && signs[1] <= 0 && signs[2] <= 0;
+            if (!positive && !negative) continue;
+            if (signs[0] == 0 || signs[1] == 0 || signs[2] == 0) return false;
+            crossings++;
+        }
+    }
+    return true;
+}
+
+template <typename S>
+bool MeshSolidT<S>::inside(const Vector4<S>& p) {
+    Box bounds = Box::empty();
+    for (const SurfaceT<S>& surface : this->surfaces) {
+        if (surface.size()) bounds.expand(surface.getTree().bounds());
+    }
+    double point[3];
+    toDoubles(&p[0], 1, 3, point);
+    for (int i = 0; i < 3; i++) {
+        double pad = 1e-9 * (1 + std::abs(point[i]));
+        if (point[i] + pad < bounds.lo[i] || point[i] - pad > bounds.hi[i]) return false;
+    }
+    
+    // Rays along x, tilted a little differently each time, since meshes
+    // tend to have edges and faces along the axes
+    uint32_t seed = 12345;
+    for (int attempt = 0; attempt < 64; attempt++) {
+        int tilt[2];
+        for (int i = 0; i < 2; i++) {
+            seed = seed * 1103515245 + 12345;
+            tilt[i] = int(seed >> 16) % 1024 + 1;
+            if (seed & 0x8000) tilt[i] = -tilt[i];
+        }
+        Vector4<S> d = VectorT<S>(1, ScalarTraits<S>::fraction(tilt[0], 65536), ScalarTraits<S>::fraction(tilt[1], 65536));
+        int crossings;
+        bool on_surface;
+        if (!castRay(p, d, bounds, crossings, on_surface)) {
+            THEOCAD_TRACE(BODIES, VERBOSE, "Ray from " << p << " along " << d << " grazes the mesh");
+            continue;
+        }
+        return on_surface || (crossings & 1);
+    }
+    throw std::runtime_error("no clear ray through mesh");
+}
+
+template <typename S>
+bool TransformT<S>::inside(const Vector4<S>& p) {
+    const Matrix4<S>& inverse = this->getInverse();
+    if (inverse_affine) return this->child->inside(*inverse_affine * p);
+    return this->child->inside(inverse * p);
+}
+
+
+template <typename S>
+const SolidPtrT<S>& globalUnitCube() {
+    static SolidPtrT<S> cube = std::make_shared<UnitCubeT<S>>();
+    return cube;
+}
+
+template <typename S>
+const SolidPtrT<S>& globalUnitCylinder() {
+    static SolidPtrT<S> cylinder = std::make_shared<UnitCylinderT<S>>();
+    return cylinder;
 }
 
+#define THEOCAD_INSTANTIATE_BODIES(S) \
+    template class SurfaceT<S>; \
+    template class UnitCubeT<S>; \
+    template class UnitCylinderT<S>; \
+    template class MeshSolidT<S>; \
+    template bool TransformT<S>::inside(const Vector4<S>&); \
+    template const SolidPtrT<S>& globalUnitCube<S>(); \
+    template const SolidPtrT<S>& globalUnitCylinder<S>();
+THEOCAD_FOR_EACH_SCALAR(THEOCAD_INSTANTIATE_BODIES)
 
 // In the cpp file, define the global instances
-SolidPtr globalUnitCubePtr = std::make_shared<UnitCube>();
-SolidPtr globalUnitCylinderPtr = std::make_shared<UnitCylinder>();
+SolidPtr globalUnitCubePtr = globalUnitCube<real>();
+SolidPtr globalUnitCylinderPtr = globalUnitCylinder<real>();
 
 
 } // namespace theocad
\ No newline at end of file
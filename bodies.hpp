@@ -2,105 +2,325 @@
 #define INCLUDED_BODIES_HPP
 
 #include "geometry.hpp"
+#include "bvh.hpp"
+#include "structural_hash.hpp"
+#include <algorithm>
+#include <cstdint>
 #include <memory>
 #include <iostream>
+#include <string>
 
 namespace theocad {
+
+// A fresh version stamp, unique across the process
+uint64_t nextSurfaceVersion();
+
+// Solids are stamped from a counter of their own. The newest stamp also
+// serves as an epoch: nothing in any solid has changed while it stays the
+// same.
+uint64_t nextSolidVersion();
+uint64_t solidVersionEpoch();
     
-class Surface {
+// Indices of a triangle's vertices in its surface's vertex pool
+struct TriangleIndices {
+    int v[3];
+
+    int& operator[](int ix) { return v[ix]; }
+    int operator[](int ix) const { return v[ix]; }
+};
+
+/*
+Floating point mirror of a surface, for drawing. Vertex positions and
+triangle normals are kept in separate flat arrays, with the x, y and z of
+each packed together, so either can go straight into a GPU buffer as a
+three-float attribute. The mesh writers don't use it: they convert a chunk
+at a time, so that no whole copy of the mesh is held.
+*/
+template <typename F>
+struct MeshMirror {
+    std::vector<F> positions; // Per vertex
+    std::vector<F> normals;   // Per triangle, of unit length
+};
+
+/*
+A surface is an indexed mesh: a pool of vertices, shared by the triangles
+that meet at them, and three indices per triangle. Each triangle's plane is
+memoized in a separate array. Points are stored without their w, which is
+always 1.
+
+Triangles are handed out by value, as TriangleT objects carrying their
+memoized planes. Floating point mirrors are also memoized, for consumers
+that don't need exact values.
+
+Every change to a surface gives it a new version stamp, and copies keep the
+stamp of what they were copied from. Equal stamps therefore mean equal
+contents, which lets a consumer like the visualizer skip surfaces that it
+already has.
+*/
+template <typename S>
+class SurfaceT {
 protected:
     std::string name;
-    std::vector<Triangle> mesh;
-    Plane averagePlane;
+    std::vector<Vector3<S>> vertices;
+    // Shared with copies of the surface, including transformed ones, until
+    // one of them changes it. Null when there are no triangles.
+    std::shared_ptr<std::vector<TriangleIndices>> triangles;
+    std::vector<PlaneT<S>> planes;
+    bool planes_valid = false;
+    PlaneT<S> averagePlane;
     bool averagePlane_valid = false;
+    AABBTreeT<S> tree;
+    bool tree_valid = false;
+    MeshMirror<double> doubleMirror;
+    bool doubleMirror_valid = false;
+    MeshMirror<float> floatMirror;
+    bool floatMirror_valid = false;
+    uint64_t version = nextSurfaceVersion();
     // XXX bool planar
     
     void computeAveragePlane();
+    void computePlanes();
+    void computeTree();
+    void computeDoubleMirror();
+    void computeFloatMirror();
+    
+    std::vector<TriangleIndices>& modifyTriangles() {
+        invalidate();
+        if (!triangles) {
+            triangles = std::make_shared<std::vector<TriangleIndices>>();
+        } else if (triangles.use_count() > 1) {
+            triangles = std::make_shared<std::vector<TriangleIndices>>(*triangles);
+        }
+        return *triangles;
+    }
     
 public:
     
     void invalidate() {
         averagePlane_valid = false;
+        planes_valid = false;
+        tree_valid = false;
+        doubleMirror_valid = false;
+        floatMirror_valid = false;
+        version = nextSurfaceVersion();
     }
     
-    Triangle& allocateTriangle() {
-        averagePlane_valid = false;
-        int ix = mesh.size();
-        mesh.resize(ix+1);
-        return mesh[ix];
+    uint64_t getVersion() const { return version; }
+
+    // Memory held by the surface, roughly: its vertices and triangles,
+    // whatever it has memoized, and any scalars spilled to the heap
+    size_t memoryBytes() const;
+    
+    void clear() {
+        vertices.clear();
+        triangles.reset();
+        invalidate();
     }
     
-    const std::vector<Triangle>& getMesh() const { return mesh; }
-    std::vector<Triangle>& setMesh() {
-        averagePlane_valid = false;
-        return mesh;
+    int vertexCount() const { return vertices.size(); }
+    const Vector3<S>& getVertex(int vi) const { return vertices[vi]; }
+    Vector3<S>& modifyVertex(int vi) {
+        invalidate();
+        return vertices[vi];
     }
     
-    const Triangle& operator[](int ix) const {
-        return mesh[ix];
+    int addVertex(const Vector4<S>& p) {
+        invalidate();
+        vertices.push_back(p.template head<3>());
+        return vertices.size() - 1;
     }
     
-    Triangle& modifyTriangle(int ix) {
-        averagePlane_valid = false;
-        return mesh[ix];
+    // Replace the vertices and triangles wholesale, as when loading them
+    void setContents(std::vector<Vector3<S>> v, std::vector<TriangleIndices> t) {
+        vertices = std::move(v);
+        if (t.empty()) {
+            triangles.reset();
+        } else {
+            triangles = std::make_shared<std::vector<TriangleIndices>>(std::move(t));
+        }
+        invalidate();
+    }
+    
+    int addTriangle(int a, int b, int c) {
+        std::vector<TriangleIndices>& t = modifyTriangles();
+        t.push_back({{a, b, c}});
+        return t.size() - 1;
+    }
+    
+    // Append triangles, sharing vertices with each other and with the
+    // existing triangles wherever they're exactly equal
+    void appendTriangles(const std::vector<TriangleT<S>>& ts);
+    
+    // Replace the contents with a copy of that, with every vertex transformed
+    // by m. The triangles are shared with that, not copied.
+    void setTransformed(const SurfaceT& that, const Matrix4<S>& m);
+    void setTransformed(const SurfaceT& that, const AffineT<S>& m);
+    
+    int size() const { return triangles ? triangles->size() : 0; }
+    
+    const TriangleIndices& getIndices(int ix) const { return (*triangles)[ix]; }
+    
+    Vector4<S> getPoint(int ix, int k) const {
+        const Vector3<S>& v = vertices[getIndices(ix)[k]];
+        return PointT<S>(v[0], v[1], v[2]);
+    }
+    
+    TriangleT<S> operator[](int ix) const {
+        if (planes_valid) return TriangleT<S>(getPoint(ix, 0), getPoint(ix, 1), getPoint(ix, 2), planes[ix]);
+        return TriangleT<S>(getPoint(ix, 0), getPoint(ix, 1), getPoint(ix, 2));
     }
     
-    int size() const { return mesh.size(); }
+    // All the triangles, with their planes
+    std::vector<TriangleT<S>> getTriangles() const;
+    
+    // Feed the exact vertices and the triangles' indices to a hasher
+    void hashContents(StructuralHasher& h) const;
     
     void deleteTriangle(int ix) {
-        int last = mesh.size() - 1;
+        std::vector<TriangleIndices>& t = modifyTriangles();
+        int last = t.size() - 1;
         if (ix < last) {
-            mesh[ix] = mesh[last];
+            t[ix] = t[last];
         }
-        mesh.resize(last);
-        averagePlane_valid = false;
+        t.resize(last);
+    }
+    
+    const std::vector<PlaneT<S>>& getPlanes() const {
+        if (!planes_valid) {
+            SurfaceT& self(const_cast<SurfaceT&>(*this));
+            self.computePlanes();
+        }
+        return planes;
+    }
+    
+    const PlaneT<S>& getPlane(int ix) const {
+        return getPlanes()[ix];
     }
     
-    const Plane& getAveragePlane() const {
+    const PlaneT<S>& getAveragePlane() const {
         if (!averagePlane_valid) {
-            Surface& self(const_cast<Surface&>(*this));
+            SurfaceT& self(const_cast<SurfaceT&>(*this));
             self.computeAveragePlane();
         }
         return averagePlane;
     }
     
-    const Plane& getFace() const {
+    const PlaneT<S>& getFace() const {
         return getAveragePlane();
     }
+    
+    const AABBTreeT<S>& getTree() const {
+        if (!tree_valid) {
+            SurfaceT& self(const_cast<SurfaceT&>(*this));
+            self.computeTree();
+        }
+        return tree;
+    }
+    
+    const MeshMirror<double>& getDoubleMirror() const {
+        if (!doubleMirror_valid) {
+            SurfaceT& self(const_cast<SurfaceT&>(*this));
+            self.computeDoubleMirror();
+        }
+        return doubleMirror;
+    }
+    
+    const MeshMirror<float>& getFloatMirror() const {
+        if (!floatMirror_valid) {
+            SurfaceT& self(const_cast<SurfaceT&>(*this));
+            self.computeFloatMirror();
+        }
+        return floatMirror;
+    }
 };
 
-class Solid;
-using SolidPtr = std::shared_ptr<Solid>;
+template <typename S> class SolidT;
+template <typename S> using SolidPtrT = std::shared_ptr<SolidT<S>>;
 
-class Solid {
+/*
+Solids form a DAG, with evaluated surfaces cached at every node. Each solid
+has a stamp that changes with its own parameters, and a version: the newest
+stamp in it and everything below it. A node's cache is good for as long as
+its version stays the one it was computed at, so after an edit, only the
+nodes on the path from the edit up to the root are evaluated again.
+
+Versions are pulled rather than pushed, since children don't know their
+parents. Each node remembers its version for the epoch it was worked out
+in, so between edits asking costs nothing.
+*/
+template <typename S>
+class SolidT {
 protected:
     std::string name;
-    std::vector<Surface> surfaces;
+    std::vector<SurfaceT<S>> surfaces;
+    uint64_t stamp = nextSolidVersion();
+    uint64_t version = 0;
+    uint64_t version_epoch = 0;
+    Hash128 structural_hash;
+    uint64_t hash_version = 0;
+    
+    // The newest version among the children
+    virtual uint64_t childrenVersion() const { return 0; }
+    
+    // Feed a hasher what this solid is. By default that's its surfaces;
+    // solids defined by parameters hash those instead.
+    virtual void hashStructure(StructuralHasher& h) const {
+        h.add("surfaces").add(int(surfaces.size()));
+        for (const SurfaceT<S>& s : surfaces) s.hashContents(h);
+    }
+    
+    // Note a change to this solid's own parameters
+    void touch() { stamp = nextSolidVersion(); }
     
 public:
-    virtual ~Solid() {}
+    virtual ~SolidT() {}
+    
+    uint64_t getVersion() const {
+        uint64_t epoch = solidVersionEpoch();
+        if (version_epoch != epoch) {
+            SolidT& self(const_cast<SolidT&>(*this));
+            self.version = std::max(stamp, childrenVersion());
+            self.version_epoch = epoch;
+        }
+        return version;
+    }
+    
+    // Solids with equal structural hashes evaluate to equal surfaces
+    const Hash128& getStructuralHash() const {
+        uint64_t current = getVersion();
+        if (hash_version != current) {
+            SolidT& self(const_cast<SolidT&>(*this));
+            StructuralHasher h;
+            hashStructure(h);
+            self.structural_hash = h.finish();
+            self.hash_version = current;
+        }
+        return structural_hash;
+    }
     
     void clearSurfaces() { surfaces.clear(); }
     
-    Surface& allocateSurface() {
-        std::cout << "Allocating surface\n";
+    SurfaceT<S>& allocateSurface() {
+        THEOCAD_TRACE(BODIES, VERBOSE, "Allocating surface");
         int ix = surfaces.size();
         surfaces.resize(ix+1);
         return surfaces[ix];
     }
     
-    virtual const Surface& operator[](int ix) const {
-        std::cout << "Solid getting surface\n";
+    virtual const SurfaceT<S>& operator[](int ix) const {
+        THEOCAD_TRACE(BODIES, VERBOSE, "Solid getting surface");
         return surfaces[ix];
     }
     
-    Surface& modifySurface(int ix) {
+    SurfaceT<S>& modifySurface(int ix) {
+        touch();
         return surfaces[ix];
     }
     
     virtual int size() const { return surfaces.size(); }
     
     void deleteSurface(int ix) {
+        touch();
         int last = surfaces.size() - 1;
         if (ix < last) {
             surfaces[ix] = surfaces[last];
@@ -108,22 +328,58 @@ public:
         surfaces.resize(last);        
     }
     
-    virtual bool inside(const Vector4r& p) = 0;
+    virtual bool inside(const Vector4<S>& p) = 0;
 };
 
 // A unit cube with opposing corners at <0,0,0> and <1,1,1>
-class UnitCube : public Solid {
+template <typename S>
+class UnitCubeT : public SolidT<S> {
+protected:
+    virtual void hashStructure(StructuralHasher& h) const;
+    
+public:
+    UnitCubeT();
+    virtual bool inside(const Vector4<S>& p);
+};
+
+template <typename S>
+class UnitCylinderT : public SolidT<S> {
+protected:
+    virtual void hashStructure(StructuralHasher& h) const;
+    
 public:
-    UnitCube();
-    virtual bool inside(const Vector4r& p);
+    UnitCylinderT();
+    virtual bool inside(const Vector4<S>& p);
 };
 
-class UnitCylinder : public Solid {
+/*
+A solid given by nothing but its surfaces, as when it's imported from a
+mesh. They have to close up, but can be any shape. A point is inside if
+it's on them, or if a ray from it crosses them an odd number of times. The
+crossings are counted exactly; a ray that grazes an edge or a vertex, or
+runs along a face, is abandoned for another.
+*/
+template <typename S>
+class MeshSolidT : public SolidT<S> {
+    // Cast a ray from p along d, counting the crossings. Returns false if
+    // the ray has to be abandoned, and sets on_surface if p is on a triangle.
+    bool castRay(const Vector4<S>& p, const Vector4<S>& d, const Box& bounds, int& crossings, bool& on_surface) const;
+    
 public:
-    UnitCylinder();
-    virtual bool inside(const Vector4r& p);
+    explicit MeshSolidT(std::vector<SurfaceT<S>> surfaces);
+    virtual bool inside(const Vector4<S>& p);
 };
 
+// Shared primitive instances, one per scalar type
+template <typename S> const SolidPtrT<S>& globalUnitCube();
+template <typename S> const SolidPtrT<S>& globalUnitCylinder();
+
+using Surface = SurfaceT<real>;
+using Solid = SolidT<real>;
+using SolidPtr = SolidPtrT<real>;
+using UnitCube = UnitCubeT<real>;
+using UnitCylinder = UnitCylinderT<real>;
+using MeshSolid = MeshSolidT<real>;
 
 // class Collection : public Solid {
 
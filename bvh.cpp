@@ -0,0 +1,148 @@
+#include "bvh.hpp"
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+namespace theocad {
+
+Box Box::empty() {
+    Box b;
+    for (int i=0; i<3; i++) {
+        b.lo[i] = std::numeric_limits<double>::infinity();
+        b.hi[i] = -std::numeric_limits<double>::infinity();
+    }
+    return b;
+}
+
+void Box::expand(const Box& that) {
+    for (int i=0; i<3; i++) {
+        lo[i] = std::min(lo[i], that.lo[i]);
+        hi[i] = std::max(hi[i], that.hi[i]);
+    }
+}
+
+void Box::expand(const IntervalVector& point) {
+    for (int i=0; i<3; i++) {
+        lo[i] = std::min(lo[i], point[i].lo);
+        hi[i] = std::max(hi[i], point[i].hi);
+    }
+}
+
+int Box::longestAxis() const {
+    int axis = 0;
+    for (int i=1; i<3; i++) {
+        if (hi[i] - lo[i] > hi[axis] - lo[axis]) axis = i;
+    }
+    return axis;
+}
+
+// Inexact scalars treat nearby points as coincident, so pad their boxes to match
+template <typename S>
+static void pad(Box& b) {
+    if constexpr (!ScalarTraits<S>::exact) {
+        for (int i=0; i<3; i++) {
+            b.lo[i] -= 1e-6 * (1 + std::abs(b.lo[i]));
+            b.hi[i] += 1e-6 * (1 + std::abs(b.hi[i]));
+        }
+    }
+}
+
+template <typename S>
+Box boundingBox(const Vector3<S>& p) {
+    Box b = Box::empty();
+    b.expand(toInterval(p));
+    pad<S>(b);
+    return b;
+}
+
+template <typename S>
+Box boundingBox(const TriangleT<S>& t) {
+    Box b = Box::empty();
+    for (int i=0; i<3; i++) b.expand(toInterval(t[i]));
+    pad<S>(b);
+    return b;
+}
+
+template <typename S>
+void AABBTreeT<S>::build(const std::vector<TriangleT<S>>& triangles) {
+    std::vector<Box> boxes;
+    boxes.reserve(triangles.size());
+    for (const TriangleT<S>& t : triangles) boxes.push_back(boundingBox(t));
+    build(boxes);
+}
+
+template <typename S>
+void AABBTreeT<S>::build(const std::vector<Box>& boxes) {
+    clear();
+    int n = boxes.size();
+    if (!n) return;
+
+    index.resize(n);
+    std::iota(index.begin(), index.end(), 0);
+
+    // A binary tree with n leaves has at most 2n-1 nodes
+    nodes.reserve(2*n);
+    nodes.emplace_back();
+    buildNode(boxes, 0, 0, n);
+}
+
+template <typename S>
+void AABBTreeT<S>::buildNode(const std::vector<Box>& boxes, int node, int first, int count) {
+    Box box = Box::empty();
+    Box centers = Box::empty();
+    for (int i=first; i<first+count; i++) {
+        const Box& b = boxes[index[i]];
+        box.expand(b);
+        for (int k=0; k<3; k++) {
+            centers.lo[k] = std::min(centers.lo[k], b.center(k));
+            centers.hi[k] = std::max(centers.hi[k], b.center(k));
+        }
+    }
+    nodes[node].box = box;
+
+    if (count <= LEAF_SIZE) {
+        nodes[node].first = first;
+        nodes[node].count = count;
+        return;
+    }
+
+    // Split at the median along the axis in which the centers are most spread out
+    int axis = centers.longestAxis();
+    int half = count / 2;
+    std::nth_element(index.begin() + first, index.begin() + first + half, index.begin() + first + count,
+        [&boxes, axis](int a, int b) { return boxes[a].center(axis) < boxes[b].center(axis); });
+
+    int child = nodes.size();
+    nodes.emplace_back();
+    nodes.emplace_back();
+    nodes[node].first = child;
+    nodes[node].count = 0;
+    buildNode(boxes, child, first, half);
+    buildNode(boxes, child+1, first+half, count-half);
+}
+
+template <typename S>
+void AABBTreeT<S>::query(const Box& box, std::vector<int>& result) const {
+    if (nodes.empty()) return;
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top) {
+        const Node& node = nodes[stack[--top]];
+        if (!node.box.overlaps(box)) continue;
+        if (node.count) {
+            result.insert(result.end(), index.begin() + node.first, index.begin() + node.first + node.count);
+        } else {
+            stack[top++] = node.first;
+            stack[top++] = node.first + 1;
+        }
+    }
+}
+
+#define THEOCAD_INSTANTIATE_BVH(S) \
+    template Box boundingBox<S>(const Vector3<S>&); \
+    template Box boundingBox<S>(const TriangleT<S>&); \
+    template class AABBTreeT<S>;
+THEOCAD_FOR_EACH_SCALAR(THEOCAD_INSTANTIATE_BVH)
+
+} // namespace theocad
@@ -0,0 +1,84 @@
+#ifndef INCLUDED_BVH_HPP
+#define INCLUDED_BVH_HPP
+
+#include "geometry.hpp"
+#include <vector>
+
+/*
+Axis-aligned bounding boxes and a bounding volume hierarchy over triangles,
+used to avoid slicing triangles that can't possibly touch.
+
+Boxes are closed and computed in floating point from the conservative
+enclosures of the exact coordinates, so two triangles whose boxes don't
+overlap certainly don't touch. Triangles that merely share an edge or a
+vertex do overlap.
+*/
+
+namespace theocad {
+
+struct Box {
+    double lo[3], hi[3];
+
+    Box() : lo{0, 0, 0}, hi{0, 0, 0} {}
+
+    static Box empty();
+
+    void expand(const Box& that);
+    void expand(const IntervalVector& point);
+
+    bool overlaps(const Box& that) const {
+        for (int i=0; i<3; i++) {
+            if (lo[i] > that.hi[i] || that.lo[i] > hi[i]) return false;
+        }
+        return true;
+    }
+
+    double center(int axis) const { return (lo[axis] + hi[axis]) * 0.5; }
+    int longestAxis() const;
+};
+
+template <typename S>
+Box boundingBox(const Vector3<S>& p);
+
+template <typename S>
+Box boundingBox(const TriangleT<S>& t);
+
+template <typename S>
+class AABBTreeT {
+    struct Node {
+        Box box;
+        // Leaves have count > 0 and cover index[first, first+count).
+        // Interior nodes have count == 0 and children first and first+1.
+        int first = 0;
+        int count = 0;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<int> index; // Triangle indices, grouped by leaf
+
+    static const int LEAF_SIZE = 4;
+
+    void buildNode(const std::vector<Box>& boxes, int node, int first, int count);
+
+public:
+    void build(const std::vector<TriangleT<S>>& triangles);
+    // Build over the given triangle boxes
+    void build(const std::vector<Box>& boxes);
+    void clear() {
+        nodes.clear();
+        index.clear();
+    }
+
+    bool isEmpty() const { return nodes.empty(); }
+    size_t memoryBytes() const { return nodes.capacity() * sizeof(Node) + index.capacity() * sizeof(int); }
+    const Box& bounds() const { return nodes[0].box; }
+
+    // Append the indices of all triangles whose boxes overlap box, in no particular order
+    void query(const Box& box, std::vector<int>& result) const;
+};
+
+using AABBTree = AABBTreeT<real>;
+
+} // namespace theocad
+
+#endif
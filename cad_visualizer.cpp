@@ -1,10 +1,14 @@
 #include "cad_visualizer.hpp"
+#include "collections.hpp"
+#include "threadpool.hpp"
+#include "transforms.hpp"
 #include <Qt3DExtras/QPhongMaterial>
 #include <Qt3DExtras/QPerVertexColorMaterial>
 #include <Qt3DRender/QMesh>
 #include <Qt3DCore/QTransform>
 #include <QVBoxLayout>
 #include <QWidget>
+#include <QStatusBar>
 #include <QPointLight>
 #include <QWheelEvent>
 #include <QRenderState>
@@ -16,8 +20,15 @@
 #include <Qt3DRender/QRenderPass>
 #include <Qt3DRender/QShaderProgram>
 #include <Qt3DRender/QNoDepthMask>
-#include <boost/rational.hpp>
 #include <Qt3DExtras/QCuboidMesh>
+#include <Qt3DCore/QBuffer>
+#include <Qt3DCore/QAttribute>
+#include <Qt3DCore/QGeometry>
+#include <Qt3DRender/QGeometryRenderer>
+#include <cstddef>
+#include <map>
+#include <set>
+#include <tuple>
 
 namespace theocad {
     
@@ -32,7 +43,173 @@ CADVisualizer::CADVisualizer(SolidPtr solid)
     view->setRootEntity(rootEntity);
 
     setupScene();
-    addSolid(solid);
+    setSolid(solid);
+}
+
+CADVisualizer::~CADVisualizer()
+{
+    stopEvaluation();
+}
+
+void CADVisualizer::stopEvaluation()
+{
+    cancelRequested = true;
+    if (worker.joinable()) worker.join();
+    cancelRequested = false;
+}
+
+static QMatrix4x4 toQMatrix(const Matrix4<real>& m)
+{
+    QMatrix4x4 q;
+    for (int r = 0; r < 4; ++r) {
+        for (int c = 0; c < 4; ++c) q(r, c) = float(ScalarTraits<real>::toDouble(m(r, c)));
+    }
+    return q;
+}
+
+// Copy out a solid's surfaces, which evaluates it, with their float mirrors
+// ready for drawing. A surface that's already in the scene is only placed
+// again.
+static void collectSurfaces(const Solid& solid, const QMatrix4x4& matrix, RenderScene& out)
+{
+    for (int i = 0; i < solid.size(); ++i) {
+        checkCancelled();
+        const Surface& surface = solid[i];
+        auto found = out.byVersion.find(surface.getVersion());
+        int index;
+        if (found == out.byVersion.end()) {
+            surface.getFloatMirror();
+            index = out.surfaces.size();
+            out.surfaces.push_back(surface);
+            out.byVersion.emplace(surface.getVersion(), index);
+        } else {
+            index = found->second;
+        }
+        out.instances.push_back({index, matrix});
+    }
+}
+
+// Transforms aren't evaluated, but drawn as instances of their children
+// under their matrices. A preview, shown while a solid is evaluated, also
+// stops short of Booleans and draws their operands instead, which are much
+// cheaper than the Booleans themselves.
+static void collectScene(const SolidPtr& solid, const QMatrix4x4& matrix, bool preview, RenderScene& out)
+{
+    if (auto transform = std::dynamic_pointer_cast<Transform>(solid)) {
+        if (transform->getChild()) collectScene(transform->getChild(), matrix * toQMatrix(transform->getAffine()), preview, out);
+    } else if (auto collection = std::dynamic_pointer_cast<Collection>(solid)) {
+        for (const SolidPtr& child : collection->getChildren()) collectScene(child, matrix, preview, out);
+    } else if (auto boolean = std::dynamic_pointer_cast<Boolean>(solid); boolean && preview) {
+        collectScene(boolean->getChildA(), matrix, preview, out);
+        collectScene(boolean->getChildB(), matrix, preview, out);
+    } else {
+        collectSurfaces(*solid, matrix, out);
+    }
+}
+
+void CADVisualizer::setSolid(SolidPtr solid)
+{
+    stopEvaluation();
+    currentSolid = solid;
+    startEvaluation();
+}
+
+void CADVisualizer::editSolid(const std::function<void()>& edit)
+{
+    stopEvaluation();
+    try {
+        edit();
+    } catch (...) {
+        // Whatever the edit got done is still to be shown
+        startEvaluation();
+        throw;
+    }
+    startEvaluation();
+}
+
+void CADVisualizer::startEvaluation()
+{
+    SolidPtr solid = currentSolid;
+    int current = ++generation;
+    statusBar()->showMessage(tr("Evaluating..."));
+
+    // The tree is only touched from the worker from here on. What it hands
+    // back are copies, so the GUI thread never sees the lazy caches.
+    worker = std::thread([this, solid, current] {
+        CancelScope scope(&cancelRequested);
+        try {
+            RenderScene preview;
+            collectScene(solid, QMatrix4x4(), true, preview);
+            publish(current, std::move(preview), false);
+
+            RenderScene result;
+            collectScene(solid, QMatrix4x4(), false, result);
+            publish(current, std::move(result), true);
+        } catch (const Cancelled&) {
+            THEOCAD_TRACE(VISUALIZER, DEBUG, "Evaluation " << current << " cancelled");
+        } catch (const std::exception& e) {
+            THEOCAD_TRACE(VISUALIZER, ERROR, "Evaluation " << current << " failed: " << e.what());
+            QString message = tr("Evaluation failed: %1").arg(e.what());
+            QMetaObject::invokeMethod(this, [this, current, message] {
+                if (current == generation) statusBar()->showMessage(message);
+            }, Qt::QueuedConnection);
+        }
+    });
+}
+
+// Called on the worker thread, to hand results to the GUI thread
+void CADVisualizer::publish(int gen, RenderScene scene, bool done)
+{
+    auto shared = std::make_shared<const RenderScene>(std::move(scene));
+    QMetaObject::invokeMethod(this, [this, gen, shared, done] {
+        // Superseded by a newer solid
+        if (gen != generation) return;
+        THEOCAD_TRACE(VISUALIZER, INFO, (done ? "Showing " : "Previewing ") << shared->surfaces.size() << " surfaces in " << shared->instances.size() << " places");
+        showScene(*shared);
+        statusBar()->showMessage(done ? tr("Ready") : tr("Preview, evaluating..."));
+    }, Qt::QueuedConnection);
+}
+
+// Surfaces that were already shown keep their meshes, and only the new
+// ones are uploaded. After an edit, that's usually just the surfaces below
+// the node that changed and the Booleans above it. Instances are reused
+// where they can be, and only moved.
+void CADVisualizer::showScene(const RenderScene& scene)
+{
+    std::unordered_map<uint64_t, SurfaceMesh> meshes;
+    for (const Surface& surface : scene.surfaces) {
+        if (!surface.size()) continue;
+        auto found = surfaceMeshes.find(surface.getVersion());
+        if (found != surfaceMeshes.end()) {
+            meshes.insert(*found);
+            surfaceMeshes.erase(found);
+        } else {
+            meshes.emplace(surface.getVersion(), addSurfaceMesh(surface));
+        }
+    }
+
+    std::unordered_multimap<uint64_t, InstanceEntity> shown;
+    for (const RenderScene::Instance& instance : scene.instances) {
+        uint64_t version = scene.surfaces[instance.surface].getVersion();
+        auto mesh = meshes.find(version);
+        if (mesh == meshes.end()) continue;
+        InstanceEntity entity;
+        auto found = instanceEntities.find(version);
+        if (found != instanceEntities.end()) {
+            entity = found->second;
+            instanceEntities.erase(found);
+        } else {
+            entity = addInstance(mesh->second);
+        }
+        entity.transform->setMatrix(instance.matrix);
+        shown.emplace(version, entity);
+    }
+
+    THEOCAD_TRACE(VISUALIZER, DEBUG, "Removed " << surfaceMeshes.size() << " meshes and " << instanceEntities.size() << " instances");
+    for (const auto& stale : instanceEntities) delete stale.second.entity;
+    for (const auto& stale : surfaceMeshes) delete stale.second.owner;
+    instanceEntities.swap(shown);
+    surfaceMeshes.swap(meshes);
 }
 
 #if 0
@@ -126,7 +303,25 @@ void CADVisualizer::setupScene()
                               camera->viewVector().normalized() * -lightOffset.z();
 
     lightTransform->setTranslation(lightPosition);
-    
+
+    // Materials shared by every surface
+    sceneEntity = new Qt3DCore::QEntity(rootEntity);
+
+    Qt3DExtras::QPhongMaterial *material = new Qt3DExtras::QPhongMaterial(sceneEntity);
+    material->setAmbient(QColor(120, 120, 120));
+    material->setDiffuse(QColor(200, 200, 200));
+    material->setSpecular(QColor(255, 255, 255));
+    material->setShininess(150.0f);
+    faceMaterial = material;
+
+    Qt3DExtras::QPhongMaterial *wire = new Qt3DExtras::QPhongMaterial(sceneEntity);
+    wire->setAmbient(QColor(0, 0, 0));
+    wire->setDiffuse(QColor(0, 0, 0));
+    wireMaterial = wire;
+
+    Qt3DExtras::QPhongMaterial *normal = new Qt3DExtras::QPhongMaterial(sceneEntity);
+    normal->setAmbient(QColor(255, 0, 0));  // Red for visibility
+    normalMaterial = normal;
 
     // ... (rest of the setup code)
 }
@@ -157,9 +352,9 @@ void CADVisualizer::addSolid(SolidPtr solid)
             
             // Fill vertex buffer
             for (int k = 0; k < 3; ++k) {
-                positions[k*3] = boost::rational_cast<float>(triangle[k][0]);
-                positions[k*3 + 1] = boost::rational_cast<float>(triangle[k][1]);
-                positions[k*3 + 2] = boost::rational_cast<float>(triangle[k][2]);
+                positions[k*3] = rational_cast<float>(triangle[k][0]);
+                positions[k*3 + 1] = rational_cast<float>(triangle[k][1]);
+                positions[k*3 + 2] = rational_cast<float>(triangle[k][2]);
             }
             
             Qt3DCore::QBuffer *vertexBuffer = new Qt3DCore::QBuffer(geometry);
@@ -178,9 +373,9 @@ void CADVisualizer::addSolid(SolidPtr solid)
             
             // Create normal attribute
             Vector4r normalVec = surface.getFace().getNormal();
-            QVector3D normal(boost::rational_cast<float>(normalVec[0]),
-                             boost::rational_cast<float>(normalVec[1]),
-                             boost::rational_cast<float>(normalVec[2]));
+            QVector3D normal(rational_cast<float>(normalVec[0]),
+                             rational_cast<float>(normalVec[1]),
+                             rational_cast<float>(normalVec[2]));
             normal.normalize();
             
             QByteArray normalBufferBytes;
@@ -223,181 +418,164 @@ void CADVisualizer::addSolid(SolidPtr solid)
 }
 #endif
 
-void CADVisualizer::addSolid(SolidPtr solid)
-{
-    // Create a single material to be shared by all triangles
-    Qt3DExtras::QPhongMaterial *material = new Qt3DExtras::QPhongMaterial(rootEntity);
-    material->setAmbient(QColor(120, 120, 120));
-    material->setDiffuse(QColor(200, 200, 200));
-    material->setSpecular(QColor(255, 255, 255));
-    material->setShininess(150.0f);
-
-
-    // Create a wireframe material
-    Qt3DExtras::QPhongMaterial *wireMaterial = new Qt3DExtras::QPhongMaterial(rootEntity);
-    wireMaterial->setAmbient(QColor(0, 0, 0));
-    wireMaterial->setDiffuse(QColor(0, 0, 0));
-
-    for (int i = 0; i < solid->size(); ++i) {
-        const Surface& surface = (*solid)[i];
-        
-        for (int j = 0; j < surface.size(); ++j) {
-            const Triangle& triangle = surface[j];
-            
-            // Create entity for this triangle
-            Qt3DCore::QEntity *triangleEntity = new Qt3DCore::QEntity(rootEntity);
-            
-            // Create geometry
-            Qt3DCore::QGeometry *geometry = new Qt3DCore::QGeometry(triangleEntity);
-            
-            // Create vertex buffer
-            QByteArray bufferBytes;
-            bufferBytes.resize(3 * 3 * sizeof(float)); // 3 vertices * (3 floats per vertex)
-            float* positions = reinterpret_cast<float*>(bufferBytes.data());
-            
-            // Fill vertex buffer
-            for (int k = 0; k < 3; ++k) {
-                positions[k*3] = boost::rational_cast<float>(triangle[k][0]);
-                positions[k*3 + 1] = boost::rational_cast<float>(triangle[k][1]);
-                positions[k*3 + 2] = boost::rational_cast<float>(triangle[k][2]);
-            }
-            
-            Qt3DCore::QBuffer *vertexBuffer = new Qt3DCore::QBuffer(geometry);
-            vertexBuffer->setData(bufferBytes);
-            
-            // Create position attribute
-            Qt3DCore::QAttribute *positionAttribute = new Qt3DCore::QAttribute(geometry);
-            positionAttribute->setName(Qt3DCore::QAttribute::defaultPositionAttributeName());
-            positionAttribute->setVertexBaseType(Qt3DCore::QAttribute::Float);
-            positionAttribute->setVertexSize(3);
-            positionAttribute->setAttributeType(Qt3DCore::QAttribute::VertexAttribute);
-            positionAttribute->setBuffer(vertexBuffer);
-            positionAttribute->setByteStride(3 * sizeof(float));
-            positionAttribute->setCount(3);
-            geometry->addAttribute(positionAttribute);
-            
-            // Create normal attribute
-            Vector4r normalVec = triangle.getNormal();
-            QVector3D normal(boost::rational_cast<float>(normalVec[0]),
-                             boost::rational_cast<float>(normalVec[1]),
-                             boost::rational_cast<float>(normalVec[2]));
-            normal.normalize();
-            // std::cout << "Orig: " << normalVec[0] << ',' << normalVec[1] << ',' << normalVec[2] << std::endl;
-            // std::cout << "Normal: " << normal.x() << ',' << normal.y() << ',' << normal.z() << std::endl;
-            
-            QByteArray normalBufferBytes;
-            normalBufferBytes.resize(3 * 3 * sizeof(float)); // 3 vertices * (3 floats per normal)
-            float* normals = reinterpret_cast<float*>(normalBufferBytes.data());
-            for (int k = 0; k < 3; ++k) {
-                normals[k*3] = normal.x();
-                normals[k*3 + 1] = normal.y();
-                normals[k*3 + 2] = normal.z();
-            }
-            
-            Qt3DCore::QBuffer *normalBuffer = new Qt3DCore::QBuffer(geometry);
-            normalBuffer->setData(normalBufferBytes);
-            
-            Qt3DCore::QAttribute *normalAttribute = new Qt3DCore::QAttribute(geometry);
-            normalAttribute->setName(Qt3DCore::QAttribute::defaultNormalAttributeName());
-            normalAttribute->setVertexBaseType(Qt3DCore::QAttribute::Float);
-            normalAttribute->setVertexSize(3);
-            normalAttribute->setAttributeType(Qt3DCore::QAttribute::VertexAttribute);
-            normalAttribute->setBuffer(normalBuffer);
-            normalAttribute->setByteStride(3 * sizeof(float));
-            normalAttribute->setCount(3);
-            geometry->addAttribute(normalAttribute);
-
-            // Create solid mesh
-            Qt3DRender::QGeometryRenderer *mesh = new Qt3DRender::QGeometryRenderer(triangleEntity);
-            mesh->setGeometry(geometry);
-            mesh->setPrimitiveType(Qt3DRender::QGeometryRenderer::Triangles);
-            
-            // Create wireframe mesh
-            Qt3DRender::QGeometryRenderer *wireMesh = new Qt3DRender::QGeometryRenderer(triangleEntity);
-            wireMesh->setGeometry(geometry);
-            wireMesh->setPrimitiveType(Qt3DRender::QGeometryRenderer::LineLoop);
-
-            // Add components to the entity
-            triangleEntity->addComponent(mesh);
-            triangleEntity->addComponent(material);
-
-            // // Create a separate entity for the wireframe
-            Qt3DCore::QEntity *wireframeEntity = new Qt3DCore::QEntity(triangleEntity);
-            wireframeEntity->addComponent(wireMesh);
-            wireframeEntity->addComponent(wireMaterial);
-
-            // Calculate the center of the triangle
-            QVector3D center(0, 0, 0);
-            for (int k = 0; k < 3; ++k) {
-                center += QVector3D(boost::rational_cast<float>(triangle[k][0]),
-                                    boost::rational_cast<float>(triangle[k][1]),
-                                    boost::rational_cast<float>(triangle[k][2]));
-            }
-            center /= 3;
-
-            createNormalVisualization(center, normal);
-        }
-    }
-}
-
-void CADVisualizer::createNormalVisualization(const QVector3D& start, const QVector3D& normal)
+// Add interleaved position/normal attributes, reading from buffer
+static void addVertexAttributes(Qt3DCore::QGeometry *geometry, Qt3DCore::QBuffer *buffer, int count)
 {
-    QVector3D end = start + normal * 0.1f; // Scale factor for visibility
-
-    Qt3DCore::QEntity *lineEntity = new Qt3DCore::QEntity(rootEntity);
-    Qt3DRender::QGeometryRenderer *lineRenderer = new Qt3DRender::QGeometryRenderer(lineEntity);
-    Qt3DCore::QGeometry *lineGeometry = new Qt3DCore::QGeometry(lineRenderer);
-
-    // Position buffer
-    QByteArray positionBufferBytes;
-    positionBufferBytes.resize(2 * 3 * sizeof(float));
-    float* positions = reinterpret_cast<float*>(positionBufferBytes.data());
-    positions[0] = start.x(); positions[1] = start.y(); positions[2] = start.z();
-    positions[3] = end.x(); positions[4] = end.y(); positions[5] = end.z();
-
-    Qt3DCore::QBuffer *positionBuffer = new Qt3DCore::QBuffer(lineGeometry);
-    positionBuffer->setData(positionBufferBytes);
-
-    // Normal buffer (use the line direction as the normal for both vertices)
-    QByteArray normalBufferBytes;
-    normalBufferBytes.resize(2 * 3 * sizeof(float));
-    float* normals = reinterpret_cast<float*>(normalBufferBytes.data());
-    normals[0] = normal.x(); normals[1] = normal.y(); normals[2] = normal.z();
-    normals[3] = normal.x(); normals[4] = normal.y(); normals[5] = normal.z();
-
-    Qt3DCore::QBuffer *normalBuffer = new Qt3DCore::QBuffer(lineGeometry);
-    normalBuffer->setData(normalBufferBytes);
-
-    // Position attribute
-    Qt3DCore::QAttribute *positionAttribute = new Qt3DCore::QAttribute(lineGeometry);
+    Qt3DCore::QAttribute *positionAttribute = new Qt3DCore::QAttribute(geometry);
     positionAttribute->setName(Qt3DCore::QAttribute::defaultPositionAttributeName());
     positionAttribute->setVertexBaseType(Qt3DCore::QAttribute::Float);
     positionAttribute->setVertexSize(3);
     positionAttribute->setAttributeType(Qt3DCore::QAttribute::VertexAttribute);
-    positionAttribute->setBuffer(positionBuffer);
-    positionAttribute->setByteStride(3 * sizeof(float));
-    positionAttribute->setCount(2);
-    lineGeometry->addAttribute(positionAttribute);
+    positionAttribute->setBuffer(buffer);
+    positionAttribute->setByteOffset(offsetof(RenderVertex, position));
+    positionAttribute->setByteStride(sizeof(RenderVertex));
+    positionAttribute->setCount(count);
+    geometry->addAttribute(positionAttribute);
 
-    // Normal attribute
-    Qt3DCore::QAttribute *normalAttribute = new Qt3DCore::QAttribute(lineGeometry);
+    Qt3DCore::QAttribute *normalAttribute = new Qt3DCore::QAttribute(geometry);
     normalAttribute->setName(Qt3DCore::QAttribute::defaultNormalAttributeName());
     normalAttribute->setVertexBaseType(Qt3DCore::QAttribute::Float);
     normalAttribute->setVertexSize(3);
     normalAttribute->setAttributeType(Qt3DCore::QAttribute::VertexAttribute);
-    normalAttribute->setBuffer(normalBuffer);
-    normalAttribute->setByteStride(3 * sizeof(float));
-    normalAttribute->setCount(2);
-    lineGeometry->addAttribute(normalAttribute);
+    normalAttribute->setBuffer(buffer);
+    normalAttribute->setByteOffset(offsetof(RenderVertex, normal));
+    normalAttribute->setByteStride(sizeof(RenderVertex));
+    normalAttribute->setCount(count);
+    geometry->addAttribute(normalAttribute);
+}
 
-    lineRenderer->setGeometry(lineGeometry);
-    lineRenderer->setPrimitiveType(Qt3DRender::QGeometryRenderer::Lines);
+static Qt3DCore::QBuffer *vertexBuffer(Qt3DCore::QNode *parent, const std::vector<RenderVertex>& vertices)
+{
+    QByteArray bytes(reinterpret_cast<const char*>(vertices.data()), vertices.size() * sizeof(RenderVertex));
+    Qt3DCore::QBuffer *buffer = new Qt3DCore::QBuffer(parent);
+    buffer->setData(bytes);
+    return buffer;
+}
+
+static void addIndexAttribute(Qt3DCore::QGeometry *geometry, const std::vector<uint32_t>& indices)
+{
+    QByteArray bytes(reinterpret_cast<const char*>(indices.data()), indices.size() * sizeof(uint32_t));
+    Qt3DCore::QBuffer *buffer = new Qt3DCore::QBuffer(geometry);
+    buffer->setData(bytes);
+
+    Qt3DCore::QAttribute *indexAttribute = new Qt3DCore::QAttribute(geometry);
+    indexAttribute->setVertexBaseType(Qt3DCore::QAttribute::UnsignedInt);
+    indexAttribute->setAttributeType(Qt3DCore::QAttribute::IndexAttribute);
+    indexAttribute->setBuffer(buffer);
+    indexAttribute->setCount(indices.size());
+    geometry->addAttribute(indexAttribute);
+}
 
-    Qt3DExtras::QPhongMaterial *lineMaterial = new Qt3DExtras::QPhongMaterial(lineEntity);
-    lineMaterial->setAmbient(QColor(255, 0, 0));  // Red for visibility
+static Qt3DRender::QGeometryRenderer *renderer(Qt3DCore::QNode *parent, Qt3DCore::QGeometry *geometry, int count, Qt3DRender::QGeometryRenderer::PrimitiveType type)
+{
+    Qt3DRender::QGeometryRenderer *mesh = new Qt3DRender::QGeometryRenderer(parent);
+    mesh->setGeometry(geometry);
+    mesh->setVertexCount(count);
+    mesh->setPrimitiveType(type);
+    return mesh;
+}
 
-    lineEntity->addComponent(lineRenderer);
-    lineEntity->addComponent(lineMaterial);
+// Each Surface becomes a renderer for its faces and one for its edges,
+// sharing a single vertex buffer. The cost of building and drawing the
+// scene then goes with the number of surfaces, not triangles.
+CADVisualizer::SurfaceMesh CADVisualizer::addSurfaceMesh(const Surface& surface)
+{
+    // A line per triangle from its center along its normal
+    std::vector<RenderVertex> normalLines;
+
+    const MeshMirror<float>& mirror = surface.getFloatMirror();
+
+    // Flat shading needs a vertex per corner and normal, so a vertex of
+    // the surface is shared by the triangles around it that face the same way
+    std::vector<RenderVertex> vertices;
+    std::vector<uint32_t> faceIndices;
+    std::map<std::tuple<int, float, float, float>, uint32_t> shared;
+    // Edges go between the surface's vertices, each edge once
+    std::vector<uint32_t> edgeIndices;
+    std::set<std::pair<int, int>> edges;
+    std::vector<uint32_t> corner(surface.vertexCount());
+
+    for (int j = 0; j < surface.size(); ++j) {
+        const TriangleIndices& triangle = surface.getIndices(j);
+        const float *n = &mirror.normals[3*j];
+        QVector3D normal(n[0], n[1], n[2]);
+
+        QVector3D center(0, 0, 0);
+        for (int k = 0; k < 3; ++k) {
+            int vi = triangle[k];
+            const float *p = &mirror.positions[3*vi];
+            QVector3D position(p[0], p[1], p[2]);
+            center += position;
+
+            auto key = std::make_tuple(vi, normal.x(), normal.y(), normal.z());
+            auto found = shared.find(key);
+            uint32_t index;
+            if (found == shared.end()) {
+                index = vertices.size();
+                vertices.push_back({{position.x(), position.y(), position.z()}, {normal.x(), normal.y(), normal.z()}});
+                shared.emplace(key, index);
+            } else {
+                index = found->second;
+            }
+            faceIndices.push_back(index);
+            corner[vi] = index;
+        }
+
+        for (int k = 0; k < 3; ++k) {
+            int a = triangle[k], b = triangle[(k+1) % 3];
+            if (edges.insert(std::make_pair(std::min(a, b), std::max(a, b))).second) {
+                edgeIndices.push_back(corner[a]);
+                edgeIndices.push_back(corner[b]);
+            }
+        }
+
+        center /= 3;
+        QVector3D end = center + normal * 0.1f; // Scale factor for visibility
+        normalLines.push_back({{center.x(), center.y(), center.z()}, {normal.x(), normal.y(), normal.z()}});
+        normalLines.push_back({{end.x(), end.y(), end.z()}, {normal.x(), normal.y(), normal.z()}});
+    }
+
+    // Everything for the surface hangs off one node, which isn't drawn itself
+    SurfaceMesh mesh;
+    mesh.owner = new Qt3DCore::QNode(sceneEntity);
+    Qt3DCore::QBuffer *buffer = vertexBuffer(mesh.owner, vertices);
+
+    Qt3DCore::QGeometry *geometry = new Qt3DCore::QGeometry(mesh.owner);
+    addVertexAttributes(geometry, buffer, vertices.size());
+    addIndexAttribute(geometry, faceIndices);
+    mesh.faces = renderer(mesh.owner, geometry, faceIndices.size(), Qt3DRender::QGeometryRenderer::Triangles);
+
+    // The edges draw from the same vertices
+    Qt3DCore::QGeometry *wireGeometry = new Qt3DCore::QGeometry(mesh.owner);
+    addVertexAttributes(wireGeometry, buffer, vertices.size());
+    addIndexAttribute(wireGeometry, edgeIndices);
+    mesh.edges = renderer(mesh.owner, wireGeometry, edgeIndices.size(), Qt3DRender::QGeometryRenderer::Lines);
+
+    Qt3DCore::QGeometry *lineGeometry = new Qt3DCore::QGeometry(mesh.owner);
+    addVertexAttributes(lineGeometry, vertexBuffer(mesh.owner, normalLines), normalLines.size());
+    mesh.normals = renderer(mesh.owner, lineGeometry, normalLines.size(), Qt3DRender::QGeometryRenderer::Lines);
+    return mesh;
+}
+
+// An instance draws a mesh's faces, with child entities for its edges and
+// normals, which inherit its transform
+CADVisualizer::InstanceEntity CADVisualizer::addInstance(const SurfaceMesh& mesh)
+{
+    InstanceEntity instance;
+    instance.entity = new Qt3DCore::QEntity(sceneEntity);
+    instance.transform = new Qt3DCore::QTransform(instance.entity);
+    instance.entity->addComponent(mesh.faces);
+    instance.entity->addComponent(faceMaterial);
+    instance.entity->addComponent(instance.transform);
+
+    Qt3DCore::QEntity *wireframeEntity = new Qt3DCore::QEntity(instance.entity);
+    wireframeEntity->addComponent(mesh.edges);
+    wireframeEntity->addComponent(wireMaterial);
+
+    Qt3DCore::QEntity *normalEntity = new Qt3DCore::QEntity(instance.entity);
+    normalEntity->addComponent(mesh.normals);
+    normalEntity->addComponent(normalMaterial);
+    return instance;
 }
 
 void CADVisualizer::setRenderMode(int mode) {
@@ -405,7 +583,7 @@ void CADVisualizer::setRenderMode(int mode) {
 }
 
 void CADVisualizer::wheelEvent(QWheelEvent *event) {
-    std::cout << "wheelEvent\n";
+    THEOCAD_TRACE(VISUALIZER, VERBOSE, "wheelEvent");
     QPoint numDegrees = event->angleDelta() / 8;
 
     if (!numDegrees.isNull()) {
@@ -417,7 +595,7 @@ void CADVisualizer::wheelEvent(QWheelEvent *event) {
         zoomVector *= zoomFactor;
         cameraPosition = cameraViewCenter + zoomVector;
 
-        std::cout << "Camera position, zoom=" << zoomFactor << std::endl;
+        THEOCAD_TRACE(VISUALIZER, DEBUG, "Camera position, zoom=" << zoomFactor);
         //std::cout << cameraPosition << std::endl;
         camera->setPosition(cameraPosition);
     }
@@ -426,19 +604,19 @@ void CADVisualizer::wheelEvent(QWheelEvent *event) {
 }
 
 void CADVisualizer::mousePressEvent(QMouseEvent *event) {
-    std::cout << "Press\n";
+    THEOCAD_TRACE(VISUALIZER, VERBOSE, "Press");
     lastMousePosition = event->pos();
     event->accept();
 }
 
 void CADVisualizer::mouseMoveEvent(QMouseEvent *event) {
-    std::cout << "Move\n";
+    THEOCAD_TRACE(VISUALIZER, VERBOSE, "Move");
     QPoint delta = event->pos() - lastMousePosition;
     lastMousePosition = event->pos();
 
     if (event->buttons() & Qt::LeftButton) {
         if (event->modifiers() & Qt::ShiftModifier) {
-            std::cout << "Shift\n";
+            THEOCAD_TRACE(VISUALIZER, VERBOSE, "Shift");
             // Pan
             float distance = (cameraPosition - cameraViewCenter).length();
             QVector3D right = QVector3D::crossProduct(camera->upVector(), camera->viewVector()).normalized();
@@ -453,7 +631,7 @@ void CADVisualizer::mouseMoveEvent(QMouseEvent *event) {
             camera->setViewCenter(cameraViewCenter);
         }
         else if (event->modifiers() & Qt::AltModifier) {
-            std::cout << "Alt\n";
+            THEOCAD_TRACE(VISUALIZER, VERBOSE, "Alt");
             // Rotate
             float angleX = delta.x() * 0.3f;
             float angleY = delta.y() * 0.3f;
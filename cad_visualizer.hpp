@@ -6,15 +6,64 @@
 #include <Qt3DCore/QEntity>
 #include <Qt3DRender/QCamera>
 #include <Qt3DExtras/QOrbitCameraController>
+#include <Qt3DRender/QMaterial>
+#include <Qt3DRender/QGeometryRenderer>
+#include <Qt3DCore/QTransform>
+#include <QMatrix4x4>
 #include "bodies.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 namespace theocad {
 
+// A vertex as uploaded to the GPU, with its position and normal interleaved
+struct RenderVertex {
+    float position[3];
+    float normal[3];
+};
+
+// What's drawn for a solid: each distinct surface once, and every place it's
+// drawn. A transformed copy of a solid shares its surfaces, and only adds
+// instances with their own matrices.
+struct RenderScene {
+    struct Instance {
+        int surface;
+        QMatrix4x4 matrix;
+    };
+
+    std::vector<Surface> surfaces;
+    std::vector<Instance> instances;
+    std::unordered_map<uint64_t, int> byVersion; // Index into surfaces
+};
+
 class CADVisualizer : public QMainWindow {
     Q_OBJECT
 
 public:
     CADVisualizer(SolidPtr solid);
+    ~CADVisualizer();
+
+    // Show a new solid. It's evaluated on a worker thread, showing a preview
+    // until it's done, and any evaluation still running for the previous
+    // solid is cancelled.
+    //
+    // From then on, the worker owns the tree. Evaluating it fills in lazy
+    // state without locks: versions, transforms' cached results, and
+    // surfaces' planes, trees and mirrors. So until the next setSolid() or
+    // editSolid(), nothing else may read or change the solids in it, on any
+    // thread. To change the solid being shown, use editSolid().
+    void setSolid(SolidPtr solid);
+
+    // Change the solid being shown: cancel and wait for the worker, run edit
+    // on the calling thread, then evaluate again. Only the nodes the edit
+    // changed, and those above them, are evaluated again, and only the
+    // surfaces that come out new are uploaded.
+    void editSolid(const std::function<void()>& edit);
 
 private:
     Qt3DExtras::Qt3DWindow *view;
@@ -27,9 +76,45 @@ private:
     float cameraZoom;
     QPoint lastMousePosition;
 
+    // The GPU side of a surface, shared by all its instances
+    struct SurfaceMesh {
+        Qt3DCore::QNode *owner;
+        Qt3DRender::QGeometryRenderer *faces;
+        Qt3DRender::QGeometryRenderer *edges;
+        Qt3DRender::QGeometryRenderer *normals;
+    };
+
+    struct InstanceEntity {
+        Qt3DCore::QEntity *entity;
+        Qt3DCore::QTransform *transform;
+    };
+
+    // Everything that's drawn for the current solid, with meshes and
+    // instances keyed on their Surface's version. As results come in,
+    // meshes are only built for versions that aren't already shown, and
+    // instances that are already shown are moved into place.
+    Qt3DCore::QEntity *sceneEntity = nullptr;
+    std::unordered_map<uint64_t, SurfaceMesh> surfaceMeshes;
+    std::unordered_multimap<uint64_t, InstanceEntity> instanceEntities;
+    Qt3DRender::QMaterial *faceMaterial = nullptr;
+    Qt3DRender::QMaterial *wireMaterial = nullptr;
+    Qt3DRender::QMaterial *normalMaterial = nullptr;
+
+    // Background evaluation. Only the GUI thread touches generation, and
+    // results from an older generation are dropped.
+    std::thread worker;
+    std::atomic<bool> cancelRequested{false};
+    int generation = 0;
+    SolidPtr currentSolid;
+
+    void stopEvaluation();
+    void startEvaluation();
+    void publish(int gen, RenderScene scene, bool done);
+    void showScene(const RenderScene& scene);
+
     void setupScene();
-    void addSolid(SolidPtr solid);
-    void createNormalVisualization(const QVector3D& start, const QVector3D& normal);
+    SurfaceMesh addSurfaceMesh(const Surface& surface);
+    InstanceEntity addInstance(const SurfaceMesh& mesh);
     void setRenderMode(int mode);  // 0: Wireframe, 1: Faces, 2: Both
 
 protected:
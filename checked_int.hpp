@@ -0,0 +1,100 @@
+#ifndef INCLUDED_CHECKED_INT_HPP
+#define INCLUDED_CHECKED_INT_HPP
+
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+
+/*
+A 64-bit integer that throws std::overflow_error instead of wrapping. It's
+the integer under ExactRational, so that boost::rational reports overflow
+as an exception rather than going on with garbage (or tripping one of its
+asserts when a denominator wraps negative).
+*/
+
+namespace theocad {
+
+class CheckedInt64 {
+    int64_t v_;
+
+    [[noreturn]] static void overflow() { throw std::overflow_error("boost_rational: 64-bit overflow"); }
+
+public:
+    constexpr CheckedInt64() : v_(0) {}
+    template <typename I, typename = std::enable_if_t<std::is_integral<I>::value>>
+    constexpr CheckedInt64(I n) : v_(n) {}
+
+    constexpr int64_t value() const { return v_; }
+    explicit operator int64_t() const { return v_; }
+    explicit operator double() const { return double(v_); }
+    explicit operator float() const { return float(v_); }
+
+    friend CheckedInt64 operator+(CheckedInt64 a, CheckedInt64 b) {
+        int64_t r;
+        if (__builtin_add_overflow(a.v_, b.v_, &r)) overflow();
+        return r;
+    }
+    friend CheckedInt64 operator-(CheckedInt64 a, CheckedInt64 b) {
+        int64_t r;
+        if (__builtin_sub_overflow(a.v_, b.v_, &r)) overflow();
+        return r;
+    }
+    friend CheckedInt64 operator*(CheckedInt64 a, CheckedInt64 b) {
+        int64_t r;
+        if (__builtin_mul_overflow(a.v_, b.v_, &r)) overflow();
+        return r;
+    }
+    friend CheckedInt64 operator/(CheckedInt64 a, CheckedInt64 b) {
+        if (b.v_ == 0) throw std::domain_error("boost_rational: division by zero");
+        if (b.v_ == -1 && a.v_ == INT64_MIN) overflow();
+        return a.v_ / b.v_;
+    }
+    friend CheckedInt64 operator%(CheckedInt64 a, CheckedInt64 b) {
+        if (b.v_ == 0) throw std::domain_error("boost_rational: division by zero");
+        if (b.v_ == -1) return 0;
+        return a.v_ % b.v_;
+    }
+    friend CheckedInt64 operator-(CheckedInt64 a) {
+        if (a.v_ == INT64_MIN) overflow();
+        return -a.v_;
+    }
+    CheckedInt64 operator+() const { return *this; }
+
+    CheckedInt64& operator+=(CheckedInt64 b) { return *this = *this + b; }
+    CheckedInt64& operator-=(CheckedInt64 b) { return *this = *this - b; }
+    CheckedInt64& operator*=(CheckedInt64 b) { return *this = *this * b; }
+    CheckedInt64& operator/=(CheckedInt64 b) { return *this = *this / b; }
+    CheckedInt64& operator%=(CheckedInt64 b) { return *this = *this % b; }
+    CheckedInt64& operator++() { return *this += 1; }
+    CheckedInt64& operator--() { return *this -= 1; }
+
+    friend bool operator==(CheckedInt64 a, CheckedInt64 b) { return a.v_ == b.v_; }
+    friend bool operator!=(CheckedInt64 a, CheckedInt64 b) { return a.v_ != b.v_; }
+    friend bool operator<(CheckedInt64 a, CheckedInt64 b) { return a.v_ < b.v_; }
+    friend bool operator>(CheckedInt64 a, CheckedInt64 b) { return a.v_ > b.v_; }
+    friend bool operator<=(CheckedInt64 a, CheckedInt64 b) { return a.v_ <= b.v_; }
+    friend bool operator>=(CheckedInt64 a, CheckedInt64 b) { return a.v_ >= b.v_; }
+
+    friend std::ostream& operator<<(std::ostream& os, CheckedInt64 a) { return os << a.v_; }
+};
+
+inline CheckedInt64 abs(CheckedInt64 a) { return a < 0 ? -a : a; }
+
+} // namespace theocad
+
+namespace std {
+
+template <>
+class numeric_limits<theocad::CheckedInt64> : public numeric_limits<int64_t> {
+public:
+    static constexpr theocad::CheckedInt64 min() noexcept { return numeric_limits<int64_t>::min(); }
+    static constexpr theocad::CheckedInt64 max() noexcept { return numeric_limits<int64_t>::max(); }
+    static constexpr theocad::CheckedInt64 lowest() noexcept { return numeric_limits<int64_t>::lowest(); }
+    static constexpr bool is_modulo = false;
+};
+
+} // namespace std
+
+#endif
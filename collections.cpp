@@ -1,66 +1,193 @@
 #include "collections.hpp"
+#include "threadpool.hpp"
+#include <algorithm>
+#include <unordered_map>
 
 namespace theocad {
     
-void Boolean::sliceTriangles() {
-    // Cut a by b
-    sliceTriangles(a, b, a_cut_surfaces);
-    // Cut b by a
-    sliceTriangles(b, a, b_cut_surfaces);
+template <typename S>
+void BooleanT<S>::sliceTriangles() {
+    // Evaluating the children and building their trees is lazy, so get it
+    // done here rather than on several threads at once
+    for (const SolidPtrT<S>& s : {a, b}) {
+        for (int i = 0; i < s->size(); i++) {
+            (*s)[i].getTree();
+            (*s)[i].getPlanes();
+        }
+    }
+    
+    parallelFor(2, [this](int side) {
+        if (side == 0) {
+            // Cut a by b
+            sliceTriangles(a, b, a_cut_surfaces);
+        } else {
+            // Cut b by a
+            sliceTriangles(b, a, b_cut_surfaces);
+        }
+    });
 }
 
-void Boolean::sliceTriangles(SolidPtr p, SolidPtr q, std::vector<Surface>& p_cut_surfaces) {    
+template <typename S>
+void BooleanT<S>::sliceTriangles(SolidPtrT<S> p, SolidPtrT<S> q, std::vector<SurfaceT<S>>& p_cut_surfaces) {    
     p_cut_surfaces.clear();
     
+    // Gather q's surfaces once, along with their bounds and triangles
+    std::vector<const SurfaceT<S>*> q_surfaces;
+    std::vector<std::vector<TriangleT<S>>> q_triangles;
+    std::vector<Box> q_bounds;
+    for (int qsi = 0; qsi < q->size(); qsi++) {
+        const SurfaceT<S>& q_surface = (*q)[qsi];
+        if (q_surface.getTree().isEmpty()) continue;
+        q_surfaces.push_back(&q_surface);
+        q_triangles.push_back(q_surface.getTriangles());
+        q_bounds.push_back(q_surface.getTree().bounds());
+    }
+    
+    // One job per triangle of p
+    struct Job {
+        const TriangleT<S> *triangle;
+        int surface;
+    };
+    std::vector<Job> jobs;
+    std::vector<std::vector<TriangleT<S>>> p_triangles(p->size());
+    
     // Iterate surfaces of p
     for (int psi = 0; psi < p->size(); psi++) {
-        const Surface& p_surface = (*p)[psi];
+        const SurfaceT<S>& p_surface = (*p)[psi];
                 
         // Allocate surface
         int ix = p_cut_surfaces.size();
         p_cut_surfaces.resize(ix + 1);
-        Surface& p_new_surface(p_cut_surfaces[ix]);
-        p_new_surface.invalidate();
+        p_cut_surfaces[ix].invalidate();
         
-        // Iterate over q's surfaces
-        for (int qsi = 0; qsi < q->size(); qsi++) {
-            const Surface& q_surface = (*q)[qsi];
-                                                
-            // Cut up p's surfaces according to q
-            theocad::sliceTriangles(p_surface.getMesh(), q_surface.getMesh(), p_new_surface.setMesh());
-        }        
+        p_triangles[psi] = p_surface.getTriangles();
+        for (const TriangleT<S>& p_triangle : p_triangles[psi]) jobs.push_back({&p_triangle, ix});
+    }
+    
+    std::vector<std::vector<TriangleT<S>>> pieces(jobs.size());
+    parallelFor(jobs.size(), [&](int k) {
+        // Cut up each of p's triangles by the triangles of q that can touch it,
+        // skipping whole surfaces of q whose bounds it doesn't overlap
+        const TriangleT<S>& p_triangle = *jobs[k].triangle;
+        Box box = boundingBox(p_triangle);
+        std::vector<int> candidates;
+        std::vector<const TriangleT<S>*> cutters;
+        for (size_t qsi = 0; qsi < q_surfaces.size(); qsi++) {
+            if (!q_bounds[qsi].overlaps(box)) continue;
+            candidates.clear();
+            q_surfaces[qsi]->getTree().query(box, candidates);
+            std::sort(candidates.begin(), candidates.end());
+            for (int j : candidates) cutters.push_back(&q_triangles[qsi][j]);
+        }
+        theocad::sliceTriangleBy(p_triangle, cutters, pieces[k]);
+    });
+    
+    // Merge in the original order, so the result is the same however the jobs ran
+    std::vector<std::vector<TriangleT<S>>> merged(p_cut_surfaces.size());
+    for (size_t k = 0; k < jobs.size(); k++) {
+        std::vector<TriangleT<S>>& mesh(merged[jobs[k].surface]);
+        mesh.insert(mesh.end(), pieces[k].begin(), pieces[k].end());
     }
+    for (size_t ix = 0; ix < merged.size(); ix++) p_cut_surfaces[ix].appendTriangles(merged[ix]);
 }
 
-void Intersection::computeBoolean() {
-    check_slices();
+// Remove coincident triangles across all the surfaces in one pass. Of a set
+// of triangles facing the same way, only the first is kept. If any of them
+// face opposite ways, they bound nothing, so none are kept.
+template <typename S>
+static void removeCoincidentTriangles(std::vector<std::vector<TriangleT<S>>>& surfaces) {
+    struct First {
+        int surface, index;
+        bool reversed;
+    };
+    std::vector<std::vector<char>> keep(surfaces.size());
+    std::unordered_map<TriangleKeyT<S>, First, typename TriangleKeyT<S>::Hash> seen;
+    int duplicates = 0, opposites = 0;
     
-    // Store the result in the base class (Solid)
-    clearSurfaces();
+    for (size_t si = 0; si < surfaces.size(); si++) {
+        keep[si].assign(surfaces[si].size(), 1);
+        for (size_t ti = 0; ti < surfaces[si].size(); ti++) {
+            TriangleKeyT<S> key(surfaces[si][ti]);
+            auto found = seen.emplace(key, First{int(si), int(ti), key.reversed});
+            if (found.second) continue;
+            const First& first = found.first->second;
+            keep[si][ti] = 0;
+            if (first.reversed != key.reversed) {
+                keep[first.surface][first.index] = 0;
+                opposites++;
+            } else {
+                duplicates++;
+            }
+        }
+    }
+    THEOCAD_TRACE(COLLECTION, DEBUG, "Removing " << duplicates << " duplicate and " << opposites << " opposing triangles");
+    
+    for (size_t si = 0; si < surfaces.size(); si++) {
+        size_t n = 0;
+        for (size_t ti = 0; ti < surfaces[si].size(); ti++) {
+            if (keep[si][ti]) surfaces[si][n++] = surfaces[si][ti];
+        }
+        surfaces[si].resize(n);
+    }
+}
+
+template <typename S>
+void CollectionT<S>::hashStructure(StructuralHasher& h) const {
+    h.add("collection").add(int(children.size()));
+    for (const auto& c : children) h.add(c->getStructuralHash());
+}
+
+template <typename S>
+void IntersectionT<S>::hashStructure(StructuralHasher& h) const {
+    h.add("intersection");
+    h.add(this->a ? this->a->getStructuralHash() : Hash128());
+    h.add(this->b ? this->b->getStructuralHash() : Hash128());
+}
+
+template <typename S>
+void IntersectionT<S>::computeBoolean() {
+    this->check_slices();
+    
+    std::vector<std::vector<TriangleT<S>>> kept;
     
     // Iterate a's surfaces
-    for (const Surface& as : a_cut_surfaces) {
-        Surface a_surf(allocateSurface());
+    for (const SurfaceT<S>& as : this->a_cut_surfaces) {
+        checkCancelled();
+        kept.emplace_back();
         // Iterate a's triangles
-        for (const Triangle& a_trian : as.getMesh()) {
+        for (const TriangleT<S>& a_trian : as.getTriangles()) {
             // If center is inside b, include the triangle
-            bool inside = b->inside(a_trian.center());
-            if (inside) a_surf.allocateTriangle() = a_trian;
+            bool inside = this->b->inside(a_trian.center());
+            if (inside) kept.back().push_back(a_trian);
         }
     }
 
     // Iterate b's surfaces
-    for (const Surface& bs : b_cut_surfaces) {
-        Surface b_surf(allocateSurface());
-        // Iterate a's triangles
-        for (const Triangle& b_trian : bs.getMesh()) {
-            // If center is inside b, include the triangle
-            bool inside = a->inside(b_trian.center());
-            if (inside) b_surf.allocateTriangle() = b_trian;
+    for (const SurfaceT<S>& bs : this->b_cut_surfaces) {
+        checkCancelled();
+        kept.emplace_back();
+        // Iterate b's triangles
+        for (const TriangleT<S>& b_trian : bs.getTriangles()) {
+            // If center is inside a, include the triangle
+            bool inside = this->a->inside(b_trian.center());
+            if (inside) kept.back().push_back(b_trian);
         }
     }
     
-    // TODO: Identify and eliminate identical triangles
+    // Faces that a and b share show up on both sides
+    removeCoincidentTriangles(kept);
+    
+    // Store the result in the base class (Solid)
+    this->clearSurfaces();
+    for (const std::vector<TriangleT<S>>& ts : kept) {
+        this->allocateSurface().appendTriangles(ts);
+    }
 }
     
-}
\ No newline at end of file
+#define THEOCAD_INSTANTIATE_COLLECTIONS(S) \
+    template class CollectionT<S>; \
+    template class BooleanT<S>; \
+    template class IntersectionT<S>;
+THEOCAD_FOR_EACH_SCALAR(THEOCAD_INSTANTIATE_COLLECTIONS)
+
+}
@@ -2,19 +2,33 @@
 #define INCLUDED_COLLECTIONS_HPP
 
 #include "bodies.hpp"
+#include "disk_cache.hpp"
+#include "evaluation_cache.hpp"
 
 namespace theocad {
     
-class Collection : public Solid {
+template <typename S>
+class CollectionT : public SolidT<S> {
 protected:
-    std::vector<SolidPtr> children;
+    std::vector<SolidPtrT<S>> children;
+    
+    virtual uint64_t childrenVersion() const {
+        uint64_t v = 0;
+        for (const auto& c : children) v = std::max(v, c->getVersion());
+        return v;
+    }
+    
+    virtual void hashStructure(StructuralHasher& h) const;
     
 public:
-    void addChild(SolidPtr c) {
+    void addChild(SolidPtrT<S> c) {
+        this->touch();
         children.push_back(c);
     }
     
-    virtual const Surface& operator[](int ix) const {
+    const std::vector<SolidPtrT<S>>& getChildren() const { return children; }
+    
+    virtual const SurfaceT<S>& operator[](int ix) const {
         unsigned int n = 0;
         while (n<children.size() && ix >= children[n]->size()) ix -= children[n++]->size();
         return (*children[n])[ix];
@@ -23,13 +37,13 @@ public:
     virtual int size() const { 
         int n = 0;
         for (const auto& c : children) {
-            std::cout << "Child has " << c->size() << " elements\n";
+            THEOCAD_TRACE(COLLECTION, VERBOSE, "Child has " << c->size() << " elements");
             n += c->size();
         }
         return n;
     }
     
-    virtual bool inside(const Vector4r& p) {
+    virtual bool inside(const Vector4<S>& p) {
         for (const auto& c : children) {
             if (c->inside(p)) return true;
         }
@@ -37,68 +51,89 @@ public:
     }
 };
 
-class Boolean : public Solid {
+template <typename S>
+class BooleanT : public SolidT<S> {
 protected:
-    SolidPtr a, b;
-    std::vector<Surface> a_cut_surfaces, b_cut_surfaces;
-    bool cuts_valid = false;
+    SolidPtrT<S> a, b;
+    std::vector<SurfaceT<S>> a_cut_surfaces, b_cut_surfaces;
+    // The version that the cuts were made at
+    uint64_t cuts_version = 0;
     
     void sliceTriangles();    
-    void sliceTriangles(SolidPtr p, SolidPtr q, std::vector<Surface>& p_cut_surfaces);
+    void sliceTriangles(SolidPtrT<S> p, SolidPtrT<S> q, std::vector<SurfaceT<S>>& p_cut_surfaces);
+    
+    virtual uint64_t childrenVersion() const {
+        return std::max(a ? a->getVersion() : 0, b ? b->getVersion() : 0);
+    }
     
     void check_slices() {
-        if (!cuts_valid) {
+        uint64_t current = this->getVersion();
+        if (cuts_version != current) {
             sliceTriangles();
-            cuts_valid = true;
+            cuts_version = current;
         }
     }
     
 public:
-    virtual SolidPtr& setChildA() { cuts_valid = false; return a; }
-    virtual SolidPtr& setChildB() { cuts_valid = false; return b; }
+    const SolidPtrT<S>& getChildA() const { return a; }
+    const SolidPtrT<S>& getChildB() const { return b; }
+    SolidPtrT<S>& setChildA() { this->touch(); return a; }
+    SolidPtrT<S>& setChildB() { this->touch(); return b; }
     
     virtual int size() const { 
-        const_cast<Boolean*>(this)->check_slices();
-        return Solid::size(); 
+        const_cast<BooleanT*>(this)->check_slices();
+        return SolidT<S>::size(); 
     }
 
-    virtual const Surface& operator[](int ix) const {
-        const_cast<Boolean*>(this)->check_slices();
-        return Solid::operator[](ix);
+    virtual const SurfaceT<S>& operator[](int ix) const {
+        const_cast<BooleanT*>(this)->check_slices();
+        return SolidT<S>::operator[](ix);
     }
 };
 
-class Intersection : public Boolean {
-    bool boolean_valid = false;
+template <typename S>
+class IntersectionT : public BooleanT<S> {
+    // The version that the result was computed at
+    uint64_t boolean_version = 0;
     
     void computeBoolean();
+    virtual void hashStructure(StructuralHasher& h) const;
     
     void check_boolean() {
-        if (!boolean_valid) {
-            computeBoolean();
-            boolean_valid = true;
+        uint64_t current = this->getVersion();
+        if (boolean_version != current) {
+            // Through the memory cache, then the disk
+            const Hash128& key = this->getStructuralHash();
+            EvaluationCacheT<S>::global().evaluate(key, this->surfaces, [this, &key] {
+                DiskCacheT<S>::global().evaluate(key, this->surfaces, [this] {
+                    computeBoolean();
+                });
+            });
+            boolean_version = current;
         }
     }
     
 public:
-    SolidPtr& setChildA() { boolean_valid = false; return Boolean::setChildA(); }
-    SolidPtr& setChildB() { boolean_valid = false; return Boolean::setChildB(); }
-    
+
     virtual int size() const { 
-        const_cast<Intersection*>(this)->check_boolean();
-        return Solid::size(); 
+        const_cast<IntersectionT*>(this)->check_boolean();
+        return SolidT<S>::size(); 
     }
 
-    virtual const Surface& operator[](int ix) const {
-        const_cast<Intersection*>(this)->check_boolean();
-        return surfaces[ix];
+    virtual const SurfaceT<S>& operator[](int ix) const {
+        const_cast<IntersectionT*>(this)->check_boolean();
+        return this->surfaces[ix];
     }
     
-    virtual bool inside(const Vector4r& p) {
-        return a->inside(p) && b->inside(p);
+    virtual bool inside(const Vector4<S>& p) {
+        return this->a->inside(p) && this->b->inside(p);
     }
 };
 
+using Collection = CollectionT<real>;
+using Boolean = BooleanT<real>;
+using Intersection = IntersectionT<real>;
+
 }
 
 #endif
\ No newline at end of file
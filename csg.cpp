@@ -0,0 +1,236 @@
+#include "csg.hpp"
+#include "mesh_io.hpp"
+#include <cctype>
+#include <sstream>
+#include <stdexcept>
+
+namespace theocad {
+
+// Recursive descent over the text, one statement at a time
+template <typename S>
+class CSGParser {
+    const std::string& text;
+    size_t pos = 0;
+    int line = 1;
+
+    [[noreturn]] void fail(const std::string& message) const {
+        std::ostringstream os;
+        os << "csg:" << line << ": " << message;
+        throw std::runtime_error(os.str());
+    }
+
+    void skipSpace() {
+        while (pos < text.size()) {
+            char c = text[pos];
+            if (c == '\n') {
+                line++;
+                pos++;
+            } else if (std::isspace((unsigned char)c)) {
+                pos++;
+            } else if (c == '/' && pos+1 < text.size() && text[pos+1] == '/') {
+                while (pos < text.size() && text[pos] != '\n') pos++;
+            } else {
+                break;
+            }
+        }
+    }
+
+    bool accept(char c) {
+        skipSpace();
+        if (pos < text.size() && text[pos] == c) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    void expect(char c) {
+        if (!accept(c)) fail(std::string("expected '") + c + "'");
+    }
+
+    std::string identifier() {
+        skipSpace();
+        size_t start = pos;
+        while (pos < text.size() && (std::isalnum((unsigned char)text[pos]) || text[pos] == '_')) pos++;
+        if (pos == start) fail("expected a name");
+        return text.substr(start, pos - start);
+    }
+
+    std::string quoted() {
+        skipSpace();
+        if (!accept('"')) fail("expected a string");
+        size_t start = pos;
+        while (pos < text.size() && text[pos] != '"' && text[pos] != '\n') pos++;
+        if (pos >= text.size() || text[pos] != '"') fail("unterminated string");
+        return text.substr(start, pos++ - start);
+    }
+
+    int64_t digits(int& count) {
+        int64_t n = 0;
+        count = 0;
+        while (pos < text.size() && std::isdigit((unsigned char)text[pos])) {
+            if (count >= 18) fail("number too long");
+            n = n*10 + (text[pos++] - '0');
+            count++;
+        }
+        return n;
+    }
+
+    // Decimals and fractions are read exactly, as a numerator over a denominator
+    void fraction(int64_t& n, int64_t& d) {
+        skipSpace();
+        bool negative = false;
+        if (pos < text.size() && (text[pos] == '-' || text[pos] == '+')) negative = text[pos++] == '-';
+        int count;
+        n = digits(count);
+        d = 1;
+        if (pos < text.size() && text[pos] == '.') {
+            pos++;
+            int places;
+            int64_t f = digits(places);
+            if (count + places > 18) fail("number too long");
+            for (int i=0; i<places; i++) d *= 10;
+            n = n*d + f;
+            count += places;
+        }
+        if (!count) fail("expected a number");
+        if (negative) n = -n;
+        skipSpace();
+        if (pos < text.size() && text[pos] == '/' && !(pos+1 < text.size() && text[pos+1] == '/')) {
+            pos++;
+            skipSpace();
+            int64_t dn = digits(count);
+            if (!count) fail("expected a denominator");
+            if (!dn) fail("zero denominator");
+            if (d != 1) fail("fractions have to be of integers");
+            d = dn;
+        }
+    }
+
+    S number() {
+        int64_t n, d;
+        fraction(n, d);
+        return ScalarTraits<S>::fraction(n, d);
+    }
+
+    Vector4<S> vector() {
+        expect('[');
+        S x = number();
+        expect(',');
+        S y = number();
+        expect(',');
+        S z = number();
+        expect(']');
+        return VectorT<S>(x, y, z);
+    }
+
+    // Statements up to the closing brace, or to the end of the text at the top level
+    std::vector<SolidPtrT<S>> block(bool top) {
+        std::vector<SolidPtrT<S>> children;
+        for (;;) {
+            skipSpace();
+            if (top ? pos >= text.size() : accept('}')) break;
+            if (pos >= text.size()) fail("expected '}'");
+            if (accept(';')) continue;
+            children.push_back(statement());
+        }
+        return children;
+    }
+
+    // The children of a transform or Boolean: one statement, or a braced block
+    std::vector<SolidPtrT<S>> children() {
+        if (accept('{')) return block(false);
+        return {statement()};
+    }
+
+    static SolidPtrT<S> unite(const std::vector<SolidPtrT<S>>& children) {
+        if (children.size() == 1) return children[0];
+        auto collection = std::make_shared<CollectionT<S>>();
+        for (const auto& c : children) collection->addChild(c);
+        return collection;
+    }
+
+    SolidPtrT<S> transformed(std::shared_ptr<TransformT<S>> transform) {
+        std::vector<SolidPtrT<S>> c = children();
+        if (c.empty()) fail("transform of nothing");
+        transform->setChild(unite(c));
+        return transform;
+    }
+
+    SolidPtrT<S> statement() {
+        std::string name = identifier();
+        expect('(');
+        if (name == "cube" || name == "cylinder") {
+            expect(')');
+            accept(';');
+            return name == "cube" ? globalUnitCube<S>() : globalUnitCylinder<S>();
+        }
+        if (name == "import") {
+            std::string filename = quoted();
+            expect(')');
+            accept(';');
+            try {
+                return readMesh<S>(filename);
+            } catch (const std::runtime_error& e) {
+                fail(e.what());
+            }
+        }
+        if (name == "translate") {
+            Vector4<S> shift = vector();
+            expect(')');
+            return transformed(std::make_shared<TranslateT<S>>(shift));
+        }
+        if (name == "scale") {
+            Vector4<S> factors = vector();
+            expect(')');
+            return transformed(std::make_shared<ScaleT<S>>(factors));
+        }
+        if (name == "rotate") {
+            int64_t n, d;
+            fraction(n, d);
+            expect(',');
+            Vector4<S> axis = vector();
+            expect(')');
+            auto rotate = std::make_shared<RotateT<S>>();
+            rotate->setAngle(float(double(n) / double(d)));
+            rotate->modifyAxis() = axis;
+            return transformed(rotate);
+        }
+        if (name == "intersection") {
+            expect(')');
+            std::vector<SolidPtrT<S>> c = children();
+            if (c.size() != 2) fail("intersection() takes two children");
+            auto intersection = std::make_shared<IntersectionT<S>>();
+            intersection->setChildA() = c[0];
+            intersection->setChildB() = c[1];
+            return intersection;
+        }
+        if (name == "union") {
+            expect(')');
+            std::vector<SolidPtrT<S>> c = children();
+            if (c.empty()) fail("union of nothing");
+            return unite(c);
+        }
+        fail("unknown operation '" + name + "'");
+    }
+
+public:
+    CSGParser(const std::string& t) : text(t) {}
+
+    SolidPtrT<S> parse() {
+        std::vector<SolidPtrT<S>> c = block(true);
+        if (c.empty()) fail("nothing to build");
+        return unite(c);
+    }
+};
+
+template <typename S>
+SolidPtrT<S> parseCSG(const std::string& text) {
+    return CSGParser<S>(text).parse();
+}
+
+#define THEOCAD_INSTANTIATE_CSG(S) \
+    template SolidPtrT<S> parseCSG<S>(const std::string&);
+THEOCAD_FOR_EACH_SCALAR(THEOCAD_INSTANTIATE_CSG)
+
+} // namespace theocad
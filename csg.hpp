@@ -0,0 +1,40 @@
+#ifndef INCLUDED_CSG_HPP
+#define INCLUDED_CSG_HPP
+
+#include "collections.hpp"
+#include "transforms.hpp"
+#include <string>
+
+/*
+Reads a solid from a textual CSG description, written in a small subset of
+the OpenSCAD language:
+
+    // A quarter of a cylinder, cut out by a stretched cube
+    intersection() {
+        cylinder();
+        translate([-1/2, 0, 0]) scale([2, 1, 1]) cube();
+    }
+
+- cube() and cylinder() are the unit primitives.
+- translate(v), scale(v) and rotate(angle, axis) apply to the statement or
+  braced block after them. The angle is in degrees and the axis has to be a
+  unit vector.
+- intersection() takes exactly two children. union() takes any number, and
+  so does the top level.
+- import("part.stl") reads a mesh, as described in mesh_io.hpp.
+
+Numbers are exact: integers, decimals and fractions like 1/3. Comments run
+from // to the end of the line. Errors are thrown as std::runtime_error,
+with the line number.
+*/
+
+namespace theocad {
+
+template <typename S>
+SolidPtrT<S> parseCSG(const std::string& text);
+
+inline SolidPtr parseCSG(const std::string& text) { return parseCSG<real>(text); }
+
+} // namespace theocad
+
+#endif
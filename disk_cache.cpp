@@ -0,0 +1,104 @@
+#include "disk_cache.hpp"
+#include "binary_io.hpp"
+#include "version.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace theocad {
+
+template <typename S>
+DiskCacheT<S>& DiskCacheT<S>::global() {
+    static DiskCacheT cache;
+    return cache;
+}
+
+template <typename S>
+void DiskCacheT<S>::setDirectory(const std::string& path) {
+    if (!path.empty() && ::mkdir(path.c_str(), 0777) != 0 && errno != EEXIST) {
+        throw std::runtime_error("can't create cache directory " + path + ": " + std::strerror(errno));
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    directory = path;
+}
+
+template <typename S>
+std::string DiskCacheT<S>::getDirectory() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return directory;
+}
+
+template <typename S>
+std::string DiskCacheT<S>::pathFor(const Hash128& key) const {
+    StructuralHasher h;
+    h.add(key).add(THEOCAD_VERSION).add(ScalarTraits<S>::name());
+    Hash128 name = h.finish();
+    char hex[33];
+    std::snprintf(hex, sizeof hex, "%016llx%016llx", (unsigned long long)name.hi, (unsigned long long)name.lo);
+    return getDirectory() + "/" + hex + ".tcr";
+}
+
+template <typename S>
+bool DiskCacheT<S>::load(const Hash128& key, Surfaces& surfaces) {
+    std::string path = pathFor(key);
+    if (::access(path.c_str(), R_OK) != 0) {
+        misses++;
+        return false;
+    }
+    try {
+        BinaryFile file(path);
+        if (file.key() != key || file.libraryVersion() != THEOCAD_VERSION) {
+            throw std::runtime_error("stored for something else");
+        }
+        surfaces = readSurfaces<S>(file);
+    } catch (const std::exception& e) {
+        THEOCAD_TRACE(CACHE, WARN, "Ignoring " << path << ": " << e.what());
+        misses++;
+        return false;
+    }
+    THEOCAD_TRACE(CACHE, DEBUG, "Loaded " << surfaces.size() << " surfaces from " << path);
+    hits++;
+    return true;
+}
+
+// Distinguishes the temporary files of stores running at once in this process
+static std::atomic<uint64_t> temporary_serial{0};
+
+// Write under a name of its own, then move it into place. Threads may store
+// the same key at once, so the name has a serial number as well as the pid.
+template <typename S>
+void DiskCacheT<S>::store(const Hash128& key, const Surfaces& surfaces) {
+    std::string path = pathFor(key);
+    std::string temporary = path + "." + std::to_string(::getpid()) + "." + std::to_string(temporary_serial++) + ".tmp";
+    try {
+        writeBinary(temporary, surfaces, key);
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error(std::strerror(errno));
+        }
+    } catch (const std::exception& e) {
+        THEOCAD_TRACE(CACHE, WARN, "Can't store " << path << ": " << e.what());
+        std::remove(temporary.c_str());
+        return;
+    }
+    THEOCAD_TRACE(CACHE, DEBUG, "Stored " << surfaces.size() << " surfaces in " << path);
+    stores++;
+}
+
+template <typename S>
+DiskCacheStats DiskCacheT<S>::getStats() const {
+    DiskCacheStats stats;
+    stats.hits = hits;
+    stats.misses = misses;
+    stats.stores = stores;
+    return stats;
+}
+
+#define THEOCAD_INSTANTIATE_DISK_CACHE(S) \
+    template class DiskCacheT<S>;
+THEOCAD_FOR_EACH_SCALAR(THEOCAD_INSTANTIATE_DISK_CACHE)
+
+} // namespace theocad
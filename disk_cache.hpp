@@ -0,0 +1,77 @@
+#ifndef INCLUDED_DISK_CACHE_HPP
+#define INCLUDED_DISK_CACHE_HPP
+
+#include "bodies.hpp"
+#include <atomic>
+#include <mutex>
+#include <string>
+
+/*
+On-disk cache of evaluated Booleans, so that reopening an unchanged model
+doesn't redo them.
+
+Each result is a file in the cache's directory, named for the structural
+hash of its subtree, the library version (THEOCAD_VERSION) and the scalar
+type, and holding the exact surfaces in the binary format of binary_io.hpp.
+Files are written under a temporary name and renamed into place, so no
+reader, in this process or another, sees half of one. They're memory mapped
+to read them back, and one that doesn't check out, including one written
+on a machine with the other byte order, is treated as a miss.
+
+The cache is off until it's given a directory.
+*/
+
+namespace theocad {
+
+struct DiskCacheStats {
+    uint64_t hits = 0, misses = 0, stores = 0;
+};
+
+template <typename S>
+class DiskCacheT {
+public:
+    using Surfaces = std::vector<SurfaceT<S>>;
+
+private:
+    mutable std::mutex mutex;
+    std::string directory;
+    std::atomic<uint64_t> hits{0}, misses{0}, stores{0};
+
+    std::string pathFor(const Hash128& key) const;
+
+public:
+    // The cache shared by every solid with this scalar type
+    static DiskCacheT& global();
+
+    // Where to keep the files, creating the directory if need be. An empty
+    // path turns the cache off.
+    void setDirectory(const std::string& path);
+    std::string getDirectory() const;
+
+    // Replace surfaces with the stored result for a subtree, if there is one
+    bool load(const Hash128& key, Surfaces& surfaces);
+    // Failing to store something only costs a later evaluation, so it's
+    // traced rather than thrown
+    void store(const Hash128& key, const Surfaces& surfaces);
+
+    // Fill surfaces from the disk if they've been stored. Otherwise run
+    // compute, which fills them, and store what it made.
+    template <typename F>
+    void evaluate(const Hash128& key, Surfaces& surfaces, F compute) {
+        if (getDirectory().empty()) {
+            compute();
+            return;
+        }
+        if (load(key, surfaces)) return;
+        compute();
+        store(key, surfaces);
+    }
+
+    DiskCacheStats getStats() const;
+};
+
+using DiskCache = DiskCacheT<real>;
+
+} // namespace theocad
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef INCLUDED_DYADIC_HPP
+#define INCLUDED_DYADIC_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+
+/*
+Doubles as fractions over powers of two, which is what they are exactly.
+For the exact scalars' fromDouble.
+*/
+
+namespace theocad {
+
+// x as m * 2^e, with m odd unless it's zero. Throws for infinities and NaNs.
+inline void splitDouble(double x, int64_t& m, int& e) {
+    if (!std::isfinite(x)) throw std::runtime_error("not a finite number");
+    m = 0;
+    e = 0;
+    if (x == 0) return;
+    int exponent;
+    m = int64_t(std::ldexp(std::frexp(x, &exponent), 53));
+    int zeros = __builtin_ctzll(uint64_t(m));
+    m >>= zeros;
+    e = exponent - 53 + zeros;
+}
+
+// The fraction m * 2^e, if it fits in 64 bits
+inline bool dyadicFraction(int64_t m, int e, int64_t& n, int64_t& d) {
+    n = m;
+    d = 1;
+    if (e < 0) {
+        if (e < -62) return false;
+        d = int64_t(1) << -e;
+    } else if (e > 0) {
+        uint64_t magnitude = m < 0 ? -uint64_t(m) : uint64_t(m);
+        if (e > 62 || magnitude > (uint64_t(INT64_MAX) >> e)) return false;
+        n = m * (int64_t(1) << e);
+    }
+    return true;
+}
+
+} // namespace theocad
+
+#endif
@@ -0,0 +1,94 @@
+#include "evaluation_cache.hpp"
+
+namespace theocad {
+
+template <typename S>
+size_t surfaceBytes(const std::vector<SurfaceT<S>>& surfaces) {
+    size_t n = 0;
+    for (const SurfaceT<S>& s : surfaces) n += s.memoryBytes();
+    return n;
+}
+
+template <typename S>
+EvaluationCacheT<S>& EvaluationCacheT<S>::global() {
+    static EvaluationCacheT cache;
+    return cache;
+}
+
+template <typename S>
+void EvaluationCacheT<S>::evictTo(size_t limit) {
+    while (bytes > limit && !entries.empty()) {
+        const Entry& e = entries.back();
+        THEOCAD_TRACE(CACHE, DEBUG, "Evicting " << e.surfaces->size() << " surfaces, " << e.bytes << " bytes");
+        bytes -= e.bytes;
+        index.erase(e.key);
+        entries.pop_back();
+        evictions++;
+    }
+}
+
+template <typename S>
+typename EvaluationCacheT<S>::SurfacesPtr EvaluationCacheT<S>::find(const Hash128& key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = index.find(key);
+    if (found == index.end()) {
+        misses++;
+        return nullptr;
+    }
+    hits++;
+    entries.splice(entries.begin(), entries, found->second);
+    return found->second->surfaces;
+}
+
+template <typename S>
+void EvaluationCacheT<S>::insert(const Hash128& key, SurfacesPtr surfaces) {
+    size_t n = surfaceBytes(*surfaces);
+    std::lock_guard<std::mutex> lock(mutex);
+    // Anything bigger than the whole cache would only flush it
+    if (n > capacity) return;
+    auto found = index.find(key);
+    if (found != index.end()) {
+        // Evaluated twice at once, on two threads. Either will do.
+        entries.splice(entries.begin(), entries, found->second);
+        return;
+    }
+    evictTo(capacity - n);
+    entries.push_front({key, std::move(surfaces), n});
+    index.emplace(key, entries.begin());
+    bytes += n;
+}
+
+template <typename S>
+void EvaluationCacheT<S>::setCapacity(size_t c) {
+    std::lock_guard<std::mutex> lock(mutex);
+    capacity = c;
+    evictTo(capacity);
+}
+
+template <typename S>
+void EvaluationCacheT<S>::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    index.clear();
+    bytes = 0;
+}
+
+template <typename S>
+EvaluationCacheStats EvaluationCacheT<S>::getStats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    EvaluationCacheStats stats;
+    stats.hits = hits;
+    stats.misses = misses;
+    stats.evictions = evictions;
+    stats.entries = entries.size();
+    stats.bytes = bytes;
+    stats.capacity = capacity;
+    return stats;
+}
+
+#define THEOCAD_INSTANTIATE_EVALUATION_CACHE(S) \
+    template class EvaluationCacheT<S>; \
+    template size_t surfaceBytes<S>(const std::vector<SurfaceT<S>>&);
+THEOCAD_FOR_EACH_SCALAR(THEOCAD_INSTANTIATE_EVALUATION_CACHE)
+
+} // namespace theocad
@@ -0,0 +1,95 @@
+#ifndef INCLUDED_EVALUATION_CACHE_HPP
+#define INCLUDED_EVALUATION_CACHE_HPP
+
+#include "bodies.hpp"
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+/*
+Process-wide memo of evaluated subtrees, keyed by their structural hashes.
+
+The same subtrees turn up all over a model: one primitive under several
+identical transforms, or one intersection referenced twice. Whichever of
+them is evaluated first stores its surfaces here, and the others copy them
+instead of evaluating their children at all. The copies share the
+surfaces' triangles and keep their version stamps, so the visualizer
+uploads them once.
+
+The cache holds up to a given number of bytes of surfaces, and evicts the
+least recently used beyond that. A surface's bytes count everything it
+holds: vertices and triangles, the planes, tree and mirrors it has
+memoized, and rationals spilled to the heap. The memos are kept, since
+computing them again on every hit would cost more than the memory.
+It's safe to use from several threads at once.
+*/
+
+namespace theocad {
+
+struct EvaluationCacheStats {
+    uint64_t hits = 0, misses = 0, evictions = 0;
+    size_t entries = 0, bytes = 0, capacity = 0;
+};
+
+template <typename S>
+class EvaluationCacheT {
+public:
+    using Surfaces = std::vector<SurfaceT<S>>;
+    using SurfacesPtr = std::shared_ptr<const Surfaces>;
+
+    static constexpr size_t defaultCapacity = size_t(256) << 20;
+
+private:
+    struct Entry {
+        Hash128 key;
+        SurfacesPtr surfaces;
+        size_t bytes;
+    };
+
+    mutable std::mutex mutex;
+    // Most recently used first
+    std::list<Entry> entries;
+    std::unordered_map<Hash128, typename std::list<Entry>::iterator, Hash128Hasher> index;
+    size_t bytes = 0, capacity;
+    uint64_t hits = 0, misses = 0, evictions = 0;
+
+    // With the mutex held
+    void evictTo(size_t limit);
+
+public:
+    explicit EvaluationCacheT(size_t capacity = defaultCapacity) : capacity(capacity) {}
+
+    // The cache shared by every solid with this scalar type
+    static EvaluationCacheT& global();
+
+    // The surfaces of a subtree with this hash, or null
+    SurfacesPtr find(const Hash128& key);
+    void insert(const Hash128& key, SurfacesPtr surfaces);
+
+    // Fill surfaces from the cache if an equal subtree has been evaluated.
+    // Otherwise run compute, which fills them, and remember what it made.
+    template <typename F>
+    void evaluate(const Hash128& key, Surfaces& surfaces, F compute) {
+        if (SurfacesPtr found = find(key)) {
+            surfaces = *found;
+            return;
+        }
+        compute();
+        insert(key, std::make_shared<const Surfaces>(surfaces));
+    }
+
+    // A capacity of zero turns the cache off
+    void setCapacity(size_t capacity);
+    void clear();
+    EvaluationCacheStats getStats() const;
+};
+
+// Memory held by surfaces, roughly, as SurfaceT::memoryBytes() counts it
+template <typename S>
+size_t surfaceBytes(const std::vector<SurfaceT<S>>& surfaces);
+
+using EvaluationCache = EvaluationCacheT<real>;
+
+} // namespace theocad
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef INCLUDED_FIXED_HPP
+#define INCLUDED_FIXED_HPP
+
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <type_traits>
+
+/*
+Fixed-point number on an integer grid of 2^-FRACTION_BITS. Addition and
+subtraction are exact; multiplication and division round to the nearest
+grid point using __int128 intermediates. Fast, but not exact, so it's only
+suitable for previews.
+
+Values are 40.24 bits, so they have to stay below 2^39 in magnitude, and
+anything that would leave that range throws std::overflow_error. The
+kernel's plane offsets are cubic in the coordinates, which puts the usable
+range of coordinates at about +/-8000. At the other end, the cube of a
+coordinate below about 2^-8 is under one grid step.
+*/
+
+namespace theocad {
+
+class Fixed {
+    int64_t raw_;
+
+    struct Raw {};
+    Fixed(Raw, int64_t r) : raw_(r) {}
+
+public:
+    static constexpr int FRACTION_BITS = 24;
+
+    // For kernels that work on raw values in 128 bits: report overflow the
+    // way the operators do, narrow back to a raw value, and round x to the
+    // nearest multiple of 2^bits, dividing by it. Narrowing and rounding
+    // throw std::overflow_error if the result is out of range.
+    [[noreturn]] static void overflow() { throw std::overflow_error("Fixed: out of range"); }
+
+    static int64_t narrow(__int128 x) {
+        if (x > INT64_MAX || x < INT64_MIN) overflow();
+        return int64_t(x);
+    }
+
+    static int64_t roundShift(__int128 x, int bits) {
+        __int128 half = (__int128)1 << (bits - 1);
+        return narrow(x >= 0 ? (x + half) >> bits : -((-x + half) >> bits));
+    }
+
+    Fixed() : raw_(0) {}
+    template <typename I, typename = std::enable_if_t<std::is_integral<I>::value>>
+    Fixed(I n) : raw_(narrow((__int128)n << FRACTION_BITS)) {}
+
+    static Fixed fromRaw(int64_t r) { return Fixed(Raw(), r); }
+    static Fixed fraction(int64_t n, int64_t d) {
+        if (d == 0) throw std::domain_error("Fixed: zero denominator");
+        return fromRaw(divRound((__int128)n << FRACTION_BITS, d));
+    }
+
+    static int64_t divRound(__int128 n, __int128 d) {
+        if (d < 0) {
+            n = -n;
+            d = -d;
+        }
+        __int128 q = (n >= 0 ? n + d/2 : n - d/2) / d;
+        return narrow(q);
+    }
+
+    int64_t raw() const { return raw_; }
+    double toDouble() const { return double(raw_) / double(int64_t(1) << FRACTION_BITS); }
+
+    friend Fixed operator+(Fixed a, Fixed b) {
+        int64_t r;
+        if (__builtin_add_overflow(a.raw_, b.raw_, &r)) overflow();
+        return fromRaw(r);
+    }
+    friend Fixed operator-(Fixed a, Fixed b) {
+        int64_t r;
+        if (__builtin_sub_overflow(a.raw_, b.raw_, &r)) overflow();
+        return fromRaw(r);
+    }
+    friend Fixed operator-(Fixed a) { return Fixed() - a; }
+    friend Fixed operator*(Fixed a, Fixed b) {
+        return fromRaw(roundShift((__int128)a.raw_ * b.raw_, FRACTION_BITS));
+    }
+    friend Fixed operator/(Fixed a, Fixed b) {
+        if (b.raw_ == 0) throw std::domain_error("Fixed: division by zero");
+        return fromRaw(divRound((__int128)a.raw_ << FRACTION_BITS, b.raw_));
+    }
+
+    Fixed& operator+=(Fixed b) { return *this = *this + b; }
+    Fixed& operator-=(Fixed b) { return *this = *this - b; }
+    Fixed& operator*=(Fixed b) { return *this = *this * b; }
+    Fixed& operator/=(Fixed b) { return *this = *this / b; }
+
+    friend bool operator==(Fixed a, Fixed b) { return a.raw_ == b.raw_; }
+    friend bool operator!=(Fixed a, Fixed b) { return a.raw_ != b.raw_; }
+    friend bool operator<(Fixed a, Fixed b) { return a.raw_ < b.raw_; }
+    friend bool operator>(Fixed a, Fixed b) { return a.raw_ > b.raw_; }
+    friend bool operator<=(Fixed a, Fixed b) { return a.raw_ <= b.raw_; }
+    friend bool operator>=(Fixed a, Fixed b) { return a.raw_ >= b.raw_; }
+};
+
+inline Fixed abs(Fixed f) {
+    return f.raw() < 0 ? -f : f;
+}
+
+inline std::ostream& operator<<(std::ostream& os, Fixed f) {
+    os << f.toDouble();
+    return os;
+}
+
+} // namespace theocad
+
+#endif
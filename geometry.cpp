@@ -20,101 +20,176 @@ real rational_sqrt(real n, real threshold) {
 } 
 
 
-bool Line::parallelTo(const Line& that) const {
-    Vector4r dir1 = direction();
-    Vector4r dir2 = that.direction();
+template <typename S>
+bool LineT<S>::parallelTo(const LineT& that) const {
+    if constexpr (ScalarTraits<S>::exact) {
+        // Filter: if both directions are certainly nonzero and so is some component
+        // of their cross product, the lines are certainly not parallel.
+        IntervalVector idir1 = toInterval(p[1]) - toInterval(p[0]);
+        IntervalVector idir2 = toInterval(that.p[1]) - toInterval(that.p[0]);
+        if (idir1.certainlyNonzero() && idir2.certainlyNonzero() && cross(idir1, idir2).certainlyNonzero()) return false;
+    }
+    
+    Vector4<S> dir1 = direction();
+    Vector4<S> dir2 = that.direction();
 
     // Check if either line is actually a point
-    if (dir1 == Vector(0,0,0) || dir2 == Vector(0,0,0)) {
+    if (isZeroVector(dir1) || isZeroVector(dir2)) {
         return false;
     }
 
     // Compute the cross product
-    Vector4r cross_product = cross(dir1, dir2);
+    Vector4<S> cross_product = cross(dir1, dir2);
 
-    // Check if all components of the cross product are exactly zero
-    return cross_product == Vector(0,0,0);
+    // Check if all components of the cross product are zero
+    return isZeroVector(cross_product);
 }
 
 
-void Plane::compute(const Vector4r *points) {
-    Vector4r v1 = points[1] - points[0];
-    Vector4r v2 = points[2] - points[0];
-    Vector4r n = cross(v1, v2);
+template <typename S>
+void PlaneT<S>::compute(const Vector4<S> *points) {
+    Vector4<S> v1 = points[1] - points[0];
+    Vector4<S> v2 = points[2] - points[0];
+    Vector4<S> n = cross(v1, v2);
     c[0] = n.x();
     c[1] = n.y();
     c[2] = n.z();
     c[3] = -dot(n, points[0]);
     
-    std::cout << "Compute plane pts=" << points[0] << "," << points[1] << "," << points[2] << " v1=" << v1 << " v2=" << v2 << " n=" << n << " ";
+    THEOCAD_TRACE(GEOMETRY, VERBOSE, "Compute plane pts=" << points[0] << "," << points[1] << "," << points[2] << " v1=" << v1 << " v2=" << v2 << " n=" << n << " "
+        << float(ScalarTraits<S>::toDouble(c[0])) << ' ' << float(ScalarTraits<S>::toDouble(c[1])) << ' '
+        << float(ScalarTraits<S>::toDouble(c[2])) << ' ' << float(ScalarTraits<S>::toDouble(c[3])));
+}
+
+template <typename S>
+Sign PlaneT<S>::side(const Vector4<S>& point) const {
+    if constexpr (ScalarTraits<S>::exact) {
+        Interval d = toInterval(c[0])*toInterval(point[0]) + toInterval(c[1])*toInterval(point[1]) +
+                     toInterval(c[2])*toInterval(point[2]) + toInterval(c[3]);
+        Sign s = d.sign();
+        if (s != Sign::UNCERTAIN) return s;
+    }
     
-    std::cout << boost::rational_cast<float>(c[0]) << ' ' << boost::rational_cast<float>(c[1]) << ' ' << boost::rational_cast<float>(c[2])
-        << ' ' << boost::rational_cast<float>(c[3]) << std::endl;
+    // Too close to call in floating point, so fall back to exact arithmetic
+    S e = signedDistanceNumerator(point);
+    if (isZero(e)) return Sign::ZERO;
+    return e > S(0) ? Sign::POSITIVE : Sign::NEGATIVE;
 }
 
-bool Triangle::containsPoint(const Vector4r& p) const {
-    std::cout << "Checking if point " << p << " in " << *this << std::endl;
+// Barycentric test in floating point. Returns UNCERTAIN if any of the
+// barycentric coordinates is too close to zero to decide its sign.
+template <typename S>
+static Sign filteredContainsPoint(const Vector4<S> *points, const Vector4<S>& p) {
+    IntervalVector p0 = toInterval(points[0]);
+    IntervalVector v0 = toInterval(points[2]) - p0;
+    IntervalVector v1 = toInterval(points[1]) - p0;
+    IntervalVector v2 = toInterval(p) - p0;
+
+    Interval d00 = dot(v0, v0);
+    Interval d01 = dot(v0, v1);
+    Interval d11 = dot(v1, v1);
+    Interval d20 = dot(v2, v0);
+    Interval d21 = dot(v2, v1);
+
+    // Rather than dividing, compare the signs of the numerators to the sign of the denominator
+    Interval denom = d00 * d11 - d01 * d01;
+    Interval v_num = d11 * d20 - d01 * d21;
+    Interval w_num = d00 * d21 - d01 * d20;
+    Interval u_num = denom - v_num - w_num;
+
+    Sign s = denom.sign();
+    if (s != Sign::POSITIVE && s != Sign::NEGATIVE) return Sign::UNCERTAIN;
+    Sign su = u_num.sign(), sv = v_num.sign(), sw = w_num.sign();
+    if (su == Sign::UNCERTAIN || sv == Sign::UNCERTAIN || sw == Sign::UNCERTAIN) return Sign::UNCERTAIN;
+    
+    // Each coordinate is nonnegative if its numerator is zero or matches the sign of the denominator
+    bool inside = (su == Sign::ZERO || su == s) && (sv == Sign::ZERO || sv == s) && (sw == Sign::ZERO || sw == s);
+    return inside ? Sign::POSITIVE : Sign::NEGATIVE;
+}
+
+template <typename S>
+bool TriangleT<S>::containsPoint(const Vector4<S>& p) const {
+    THEOCAD_TRACE(GEOMETRY, VERBOSE, "Checking if point " << p << " in " << *this);
+    if constexpr (ScalarTraits<S>::exact) {
+        Sign filtered = filteredContainsPoint(points, p);
+        if (filtered != Sign::UNCERTAIN) return filtered == Sign::POSITIVE;
+    }
+    
     // Implement barycentric coordinate test
     // This is a simplified version and may need adjustment for exact arithmetic
-    Vector4r v0 = points[2] - points[0];
-    Vector4r v1 = points[1] - points[0];
-    Vector4r v2 = p - points[0];
-
-    real d00 = dot(v0, v0);
-    real d01 = dot(v0, v1);
-    real d11 = dot(v1, v1);
-    real d20 = dot(v2, v0);
-    real d21 = dot(v2, v1);
-
-    real denom = d00 * d11 - d01 * d01;
-    real v = (d11 * d20 - d01 * d21) / denom;
-    real w = (d00 * d21 - d01 * d20) / denom;
-    real u = 1 - v - w;
-
-    return (u >= 0) && (v >= 0) && (w >= 0);
+    Vector4<S> v0 = points[2] - points[0];
+    Vector4<S> v1 = points[1] - points[0];
+    Vector4<S> v2 = p - points[0];
+
+    S d00 = dot(v0, v0);
+    S d01 = dot(v0, v1);
+    S d11 = dot(v1, v1);
+    S d20 = dot(v2, v0);
+    S d21 = dot(v2, v1);
+
+    S denom = d00 * d11 - d01 * d01;
+    // A sliver can round down to nothing in inexact arithmetic, and then it contains nothing
+    if (denom == S(0)) return false;
+    S v = (d11 * d20 - d01 * d21) / denom;
+    S w = (d00 * d21 - d01 * d20) / denom;
+    S u = S(1) - v - w;
+
+    return (u >= S(0) || isZero(u)) && (v >= S(0) || isZero(v)) && (w >= S(0) || isZero(w));
 }
 
-real Line::distanceSquaredToPoint(const Vector4r& point) const {
-    Vector4r v = p[1] - p[0];
-    Vector4r w = point - p[0];
-    real c1 = dot(w, v);
-    real c2 = dot(v, v);
-    real b_num = c1;
-    real b_denom = c2;
-    Vector4r pb = p[0] * b_denom + v * b_num;
-    return magnitudeSquared((point * b_denom - pb));
+template <typename S>
+S LineT<S>::distanceSquaredToPoint(const Vector4<S>& point) const {
+    Vector4<S> v = p[1] - p[0];
+    Vector4<S> w = point - p[0];
+    S c1 = dot(w, v);
+    S c2 = dot(v, v);
+    S b_num = c1;
+    S b_denom = c2;
+    Vector4<S> pb = p[0] * b_denom + v * b_num;
+    Vector4<S> d = point * b_denom - pb;
+    return magnitudeSquared(d);
 }
 
 // https://www.songho.ca/math/line/line.html#google_vignette
-LineIntersection lineIntersection(const Line& a, const Line& b) {
-    LineIntersection result;
-
-    Vector4r da = a.direction();  // Direction vector of line a
-    Vector4r db = b.direction();  // Direction vector of line b
-    Vector4r r = a.p[0] - b.p[0];   // Vector between start points
-    std::cout << "da=" << da << std::endl;
-    std::cout << "db=" << db << std::endl;
-    std::cout << "r=" << r << std::endl;
-
-    Vector4r n = cross(da, db);     // Normal vector to both lines
-    std::cout << "n=" << n << std::endl;
-    real n_mag_sq = dot(n, n);      // Squared magnitude of n
-    std::cout << "nmag=" << n_mag_sq << std::endl;
-
-    if (n_mag_sq == 0) {
-        printf("nmag is zero\n");
+template <typename S>
+LineIntersectionT<S> lineIntersection(const LineT<S>& a, const LineT<S>& b) {
+    LineIntersectionT<S> result;
+
+    if constexpr (ScalarTraits<S>::exact) {
+        // Filter: lines that are certainly not parallel and certainly not
+        // coplanar are skew, and there's no need to compute the parameters.
+        IntervalVector ida = toInterval(a.p[1]) - toInterval(a.p[0]);
+        IntervalVector idb = toInterval(b.p[1]) - toInterval(b.p[0]);
+        IntervalVector ir = toInterval(a.p[0]) - toInterval(b.p[0]);
+        IntervalVector in = cross(ida, idb);
+        if (in.certainlyNonzero() && dot(ir, in).certainlyNonzero()) {
+            result.skew = true;
+            return result;
+        }
+    }
+
+    Vector4<S> da = a.direction();  // Direction vector of line a
+    Vector4<S> db = b.direction();  // Direction vector of line b
+    Vector4<S> r = a.p[0] - b.p[0];   // Vector between start points
+
+    Vector4<S> n = cross(da, db);     // Normal vector to both lines
+    S n_mag_sq = dot(n, n);      // Squared magnitude of n
+    THEOCAD_TRACE(GEOMETRY, VERBOSE, "da=" << da << " db=" << db << " r=" << r << " n=" << n << " nmag=" << n_mag_sq);
+
+    if (isZero(n_mag_sq)) {
+        THEOCAD_TRACE(GEOMETRY, VERBOSE, "nmag is zero");
         // Lines are parallel
-        Vector4r cross_r_db = cross(r, db);
-        real cross_r_db_mag_sq = dot(cross_r_db, cross_r_db);
+        Vector4<S> cross_r_db = cross(r, db);
+        S cross_r_db_mag_sq = dot(cross_r_db, cross_r_db);
         // std::cout << "Parallel, cross=" << cross_r_db << " sqmag=" << cross_r_db_mag_sq << std::endl;
         
-        if (cross_r_db_mag_sq == 0) {
+        if (isZero(cross_r_db_mag_sq)) {
             // Lines are coplanar and parallel
             result.coplanar = true;
             
             // Check if lines are coincident
-            Vector4r cross_r_da = cross(r, da);
-            if (dot(cross_r_da, cross_r_da) == 0) {
+            Vector4<S> cross_r_da = cross(r, da);
+            if (isZero(dot(cross_r_da, cross_r_da))) {
                 result.coincident = true;
                 result.exists = true;
                 // Compute overlap if needed
@@ -126,7 +201,7 @@ LineIntersection lineIntersection(const Line& a, const Line& b) {
         return result;
     }
 
-    printf("nmag is NOT zero\n");
+    THEOCAD_TRACE(GEOMETRY, VERBOSE, "nmag is NOT zero");
     
     // Lines are not parallel
     result.exists = true;
@@ -137,22 +212,22 @@ LineIntersection lineIntersection(const Line& a, const Line& b) {
     //     float t = b.dot(a) / dot;
     result.t[0] = -dot(cross(r, db), n) / n_mag_sq;
     result.t[1] = -dot(cross(r, da), n) / n_mag_sq;
-    std::cout << "t=" << result.t[0] << "," << result.t[1] << std::endl;
 
     // Check if intersection is within line segments
-    result.inside_line[0] = (result.t[0] >= 0 && result.t[0] <= 1);
-    result.inside_line[1] = (result.t[1] >= 0 && result.t[1] <= 1);
+    result.inside_line[0] = (result.t[0] >= S(0) && result.t[0] <= S(1));
+    result.inside_line[1] = (result.t[1] >= S(0) && result.t[1] <= S(1));
 
     // Compute intersection point
-    Vector4r intersection_a = a.p[0] + result.t[0] * da;
-    Vector4r intersection_b = b.p[0] + result.t[1] * db;
+    Vector4<S> intersection_a = a.p[0] + result.t[0] * da;
+    Vector4<S> intersection_b = b.p[0] + result.t[1] * db;
     result.point.push_back(intersection_a);
     result.point.push_back(intersection_b);
     
-    std::cout << "inter=" << intersection_a << ", " << intersection_b << std::endl;
+    THEOCAD_TRACE(GEOMETRY, VERBOSE, "t=" << result.t[0] << "," << result.t[1] << " inter=" << intersection_a << ", " << intersection_b);
 
     // Check if the computed intersection points are close enough
-    if (intersection_a != intersection_b) {
+    Vector4<S> gap = intersection_a - intersection_b;
+    if (!isZeroVector(gap)) {
         // If intersection points are not close enough, lines are skew
         result.skew = true;
         result.coplanar = false;
@@ -165,25 +240,18 @@ LineIntersection lineIntersection(const Line& a, const Line& b) {
 }
 
 // Invalid if coplanar or parallel
-Line planeIntersection(const Plane& plane1, const Plane& plane2) {
-    Line result;
+template <typename S>
+LineT<S> planeIntersection(const PlaneT<S>& plane1, const PlaneT<S>& plane2) {
+    using std::abs;
+    LineT<S> result;
 
     // Normals of the planes
-    Vector4r n1 = Vector(plane1.c[0], plane1.c[1], plane1.c[2]);
-    Vector4r n2 = Vector(plane2.c[0], plane2.c[1], plane2.c[2]);
-
-    std::cout << "n1=" << n1 << std::endl;
-    std::cout << "n2=" << n2 << std::endl;
+    Vector4<S> n1 = plane1.getNormal();
+    Vector4<S> n2 = plane2.getNormal();
 
     // Direction of the intersection line
-    Vector4r direction = cross(n1, n2);
-    std::cout << "Direction: " << direction << std::endl;
-    std::cout << "Dir:";
-    for (int i=0; i<3; i++) std::cout << " " << direction[i];
-    std::cout << std::endl;
-    std::cout << "Abs:";
-    for (int i=0; i<3; i++) std::cout << " " << abs(direction[i]);
-    std::cout << std::endl;
+    Vector4<S> direction = cross(n1, n2);
+    THEOCAD_TRACE(GEOMETRY, VERBOSE, "n1=" << n1 << " n2=" << n2 << " direction=" << direction);
 
     // Find a point on the intersection line
     // We'll use the method of choosing the largest component of the direction vector
@@ -198,15 +266,23 @@ Line planeIntersection(const Plane& plane1, const Plane& plane2) {
     int j = (i + 1) % 3;
     int k = (i + 2) % 3;
     
-    result.p[0][i] = 0;
+    result.p[0][i] = S(0);
     result.p[0][j] = (plane1.c[k] * plane2.c[3] - plane2.c[k] * plane1.c[3]) / 
                       (plane1.c[j] * plane2.c[k] - plane2.c[j] * plane1.c[k]);
     result.p[0][k] = (plane2.c[j] * plane1.c[3] - plane1.c[j] * plane2.c[3]) / 
                       (plane1.c[j] * plane2.c[k] - plane2.c[j] * plane1.c[k]);
-    result.p[0][3] = 1;  // Homogeneous coordinate
+    result.p[0][3] = S(1);  // Homogeneous coordinate
     result.p[1] = result.p[0] + direction;
 
     return result;
 }
 
-} // namespace theocad
\ No newline at end of file
+#define THEOCAD_INSTANTIATE_GEOMETRY(S) \
+    template struct PlaneT<S>; \
+    template struct LineT<S>; \
+    template class TriangleT<S>; \
+    template LineIntersectionT<S> lineIntersection<S>(const LineT<S>&, const LineT<S>&); \
+    template LineT<S> planeIntersection<S>(const PlaneT<S>&, const PlaneT<S>&);
+THEOCAD_FOR_EACH_SCALAR(THEOCAD_INSTANTIATE_GEOMETRY)
+
+} // namespace theocad
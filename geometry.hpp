@@ -2,29 +2,46 @@
 #define INCLUDED_GEOMETRY_HPP
 
 #include <eigen3/Eigen/Dense>
-#include <boost/rational.hpp>
+#include <atomic>
 #include <cstdint>
 #include <iostream>
+#include <numeric>
+#include <thread>
+#include <vector>
+#include "scalar.hpp"
+#include "trace.hpp"
 
 /*
 Notes:
 - serialization
 - Factory for more primitives
-- 
+-
 */
 
 namespace theocad {
 
-using real = boost::rational<int64_t>;
-using Vector4r = Eigen::Matrix<real, 4, 1>;
-using Matrix4r = Eigen::Matrix<real, 4, 4>;
+// The kernel is templated on its scalar type (see scalar.hpp). The names
+// without a T suffix are the exact, default instantiation.
+using real = Rational;
 
-inline Vector4r Point(real x, real y, real z) { return Vector4r(x, y, z, 1); }
+template <typename S> using Vector4 = Eigen::Matrix<S, 4, 1>;
+template <typename S> using Vector3 = Eigen::Matrix<S, 3, 1>; // Stored points, whose w is always 1
+template <typename S> using Matrix4 = Eigen::Matrix<S, 4, 4>;
+using Vector4r = Vector4<real>;
+using Matrix4r = Matrix4<real>;
+
+template <typename S>
+inline Vector4<S> PointT(S x, S y, S z) { return Vector4<S>(x, y, z, S(1)); }
+template <typename S>
+inline Vector4<S> VectorT(S x, S y, S z) { return Vector4<S>(x, y, z, S(0)); }
+
+inline Vector4r Point(real x, real y, real z) { return PointT<real>(x, y, z); }
 inline Vector4r Point() { return Point(0, 0, 0); }
-inline Vector4r Vector(real x, real y, real z) { return Vector4r(x, y, z, 0); }
+inline Vector4r Vector(real x, real y, real z) { return VectorT<real>(x, y, z); }
 inline Vector4r Vector() { return Vector(0, 0, 0); }
 
-inline std::ostream& operator<<(std::ostream& os, const Vector4r& i) {
+template <typename S>
+inline std::ostream& operator<<(std::ostream& os, const Vector4<S>& i) {
     os << '<';
     os << (i[0]) << ',';
     os << (i[1]) << ',';
@@ -35,92 +52,397 @@ inline std::ostream& operator<<(std::ostream& os, const Vector4r& i) {
 
 // inline std::ostream& operator<<(std::ostream& os, const Vector4r& i) {
 //     os << '<';
-//     os << boost::rational_cast<float>(i[0]) << ',';
-//     os << boost::rational_cast<float>(i[1]) << ',';
-//     os << boost::rational_cast<float>(i[2]) << ',';
-//     os << boost::rational_cast<float>(i[3]) << '>';
+//     os << rational_cast<float>(i[0]) << ',';
+//     os << rational_cast<float>(i[1]) << ',';
+//     os << rational_cast<float>(i[2]) << ',';
+//     os << rational_cast<float>(i[3]) << '>';
 //     return os;
 // }
 
-inline real dot(const Vector4r& a, const Vector4r& b) {
-    return a.head<3>().dot(b.head<3>());
+// Hot vector kernels. The generic versions work for any scalar; the
+// specializations below take advantage of what each scalar can do cheaply.
+template <typename S>
+struct GenericVectorKernels {
+    static S dot(const Vector4<S>& a, const Vector4<S>& b) {
+        return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+    }
+
+    static Vector4<S> cross(const Vector4<S>& a, const Vector4<S>& b) {
+        return VectorT<S>(a.y()*b.z() - a.z()*b.y(),
+                          a.z()*b.x() - a.x()*b.z(),
+                          a.x()*b.y() - a.y()*b.x());
+    }
+};
+
+template <typename S>
+struct VectorKernels : GenericVectorKernels<S> {};
+
+// Doubles: let Eigen vectorize
+template <>
+struct VectorKernels<double> {
+    static double dot(const Vector4<double>& a, const Vector4<double>& b) {
+        return a.head<3>().dot(b.head<3>());
+    }
+
+    static Vector4<double> cross(const Vector4<double>& a, const Vector4<double>& b) {
+        Vector4<double> r;
+        r.head<3>() = a.head<3>().cross(b.head<3>());
+        r[3] = 0;
+        return r;
+    }
+};
+
+// Fixed point: accumulate the full-precision products and round once. Like
+// Fixed's operators, these throw std::overflow_error rather than wrap.
+template <>
+struct VectorKernels<Fixed> {
+    static Fixed round(__int128 x) {
+        return Fixed::fromRaw(Fixed::roundShift(x, Fixed::FRACTION_BITS));
+    }
+
+    // A product of two raw values is below 2^126, so only sums of them can
+    // overflow 128 bits
+    static __int128 mul(Fixed a, Fixed b) { return (__int128)a.raw() * b.raw(); }
+    static __int128 add(__int128 a, __int128 b) {
+        __int128 r;
+        if (__builtin_add_overflow(a, b, &r)) Fixed::overflow();
+        return r;
+    }
+    static __int128 sub(__int128 a, __int128 b) {
+        __int128 r;
+        if (__builtin_sub_overflow(a, b, &r)) Fixed::overflow();
+        return r;
+    }
+
+    static Fixed dot(const Vector4<Fixed>& a, const Vector4<Fixed>& b) {
+        return round(add(add(mul(a[0], b[0]), mul(a[1], b[1])), mul(a[2], b[2])));
+    }
+
+    static Vector4<Fixed> cross(const Vector4<Fixed>& a, const Vector4<Fixed>& b) {
+        return VectorT<Fixed>(round(sub(mul(a.y(), b.z()), mul(a.z(), b.y()))),
+                              round(sub(mul(a.z(), b.x()), mul(a.x(), b.z()))),
+                              round(sub(mul(a.x(), b.y()), mul(a.y(), b.x()))));
+    }
+};
+
+// Adaptive rationals: when each vector's components share a denominator
+// (integer coordinates being the most common case), sum the products of the
+// numerators in 128 bits and normalize once instead of after every operation.
+template <>
+struct VectorKernels<Rational> {
+    // Products of numerators below this bound can be summed three at a time without overflow
+    static constexpr int64_t SMALL = int64_t(1) << 62;
+
+    static int64_t commonDenominator(const Vector4<Rational>& v) {
+        int64_t d = v[0].denominator();
+        for (int i=0; i<3; i++) {
+            if (!v[i].isInline() || v[i].denominator() != d) return 0;
+            if (v[i].numerator() >= SMALL || v[i].numerator() <= -SMALL) return 0;
+        }
+        return d;
+    }
+
+    static __int128 mul(const Rational& a, const Rational& b) {
+        return (__int128)a.numerator() * b.numerator();
+    }
+
+    static Rational dot(const Vector4<Rational>& a, const Vector4<Rational>& b) {
+        int64_t da = commonDenominator(a), db = commonDenominator(b);
+        if (!da || !db) return GenericVectorKernels<Rational>::dot(a, b);
+        return Rational::from128(mul(a[0], b[0]) + mul(a[1], b[1]) + mul(a[2], b[2]), (__int128)da * db);
+    }
+
+    static Vector4<Rational> cross(const Vector4<Rational>& a, const Vector4<Rational>& b) {
+        int64_t da = commonDenominator(a), db = commonDenominator(b);
+        if (!da || !db) return GenericVectorKernels<Rational>::cross(a, b);
+        __int128 d = (__int128)da * db;
+        return VectorT<Rational>(Rational::from128(mul(a.y(), b.z()) - mul(a.z(), b.y()), d),
+                                 Rational::from128(mul(a.z(), b.x()) - mul(a.x(), b.z()), d),
+                                 Rational::from128(mul(a.x(), b.y()) - mul(a.y(), b.x()), d));
+    }
+};
+
+// Affine matrices have a last row of 0 0 0 1
+template <typename S>
+inline bool isAffine(const Matrix4<S>& m) {
+    return isZero(m(3, 0)) && isZero(m(3, 1)) && isZero(m(3, 2)) && nearlyEqual(m(3, 3), S(1));
+}
+
+// The top three rows of an affine matrix m times the point or vector c.
+// Exact products are summed in pairs, which keeps denominators smaller.
+template <typename S>
+inline void applyAffine(const S (&m)[3][4], const S *c, S *out) {
+    for (int i = 0; i < 3; i++) {
+        if constexpr (ScalarTraits<S>::exact) {
+            out[i] = (m[i][0]*c[0] + m[i][1]*c[1]) + (m[i][2]*c[2] + m[i][3]*c[3]);
+        } else {
+            out[i] = m[i][0]*c[0] + m[i][1]*c[1] + m[i][2]*c[2] + m[i][3]*c[3];
+        }
+    }
+}
+
+// Kernels for AffineT below. Each scalar can prepare the matrix once for
+// the points it's going to transform.
+template <typename S>
+struct AffineKernels {
+    struct Prepared {};
+
+    static void prepare(const S (&)[3][4], Prepared&) {}
+
+    static void apply(const S (&m)[3][4], const Prepared&, const S *c, S *out) {
+        applyAffine(m, c, out);
+    }
+};
+
+// Fixed point: accumulate the full-precision products and round once
+template <>
+struct AffineKernels<Fixed> {
+    struct Prepared {};
+
+    static void prepare(const Fixed (&)[3][4], Prepared&) {}
+
+    static void apply(const Fixed (&m)[3][4], const Prepared&, const Fixed *c, Fixed *out) {
+        using K = VectorKernels<Fixed>;
+        for (int i = 0; i < 3; i++) {
+            out[i] = K::round(K::add(K::add(K::mul(m[i][0], c[0]), K::mul(m[i][1], c[1])),
+                                     K::add(K::mul(m[i][2], c[2]), K::mul(m[i][3], c[3]))));
+        }
+    }
+};
+
+// Adaptive rationals: the matrix is scaled by the common denominator of its
+// entries, and each point by the common denominator of its coordinates, so
+// that each coordinate of the result is a sum of four integer products,
+// normalized once. Anything too large for that falls back to the generic
+// kernel.
+template <>
+struct AffineKernels<Rational> {
+    // Integers below this bound, multiplied in pairs, can be summed four at a
+    // time without overflow
+    static constexpr int BITS = 62;
+
+    struct Prepared {
+        int64_t m[3][4];
+        int64_t d = 0; // 0 if the matrix doesn't fit
+        int bits;      // Of the largest entry of m
+    };
+
+    static int bitLength(uint64_t x) { return 64 - __builtin_clzll(x | 1); }
+
+    // The least common multiple of the inline denominators of n values, or 0
+    // if one isn't inline or the multiple needs more than BITS bits
+    static int64_t commonDenominator(const Rational *v, int n) {
+        __int128 d = 1;
+        for (int i = 0; i < n; i++) {
+            const Rational& r = v[i];
+            if (!r.isInline()) return 0;
+            d = d / std::gcd(int64_t(d), r.denominator()) * r.denominator();
+            if (d >> BITS) return 0;
+        }
+        return int64_t(d);
+    }
+
+    // Scale inline values to integers over d, or fail if one gets too large
+    static bool scale(const Rational& r, int64_t d, int64_t& out) {
+        __int128 x = (__int128)r.numerator() * (d / r.denominator());
+        if (x >= ((__int128)1 << BITS) || x <= -((__int128)1 << BITS)) return false;
+        out = int64_t(x);
+        return true;
+    }
+
+    static void prepare(const Rational (&m)[3][4], Prepared& p) {
+        p.d = commonDenominator(&m[0][0], 12);
+        if (!p.d) return;
+        uint64_t largest = 0;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) {
+                if (!scale(m[i][j], p.d, p.m[i][j])) {
+                    p.d = 0;
+                    return;
+                }
+                largest |= p.m[i][j] < 0 ? -uint64_t(p.m[i][j]) : uint64_t(p.m[i][j]);
+            }
+        }
+        p.bits = bitLength(largest);
+    }
+
+    static void apply(const Rational (&m)[3][4], const Prepared& p, const Rational *c, Rational *out) {
+        int64_t e = p.d ? commonDenominator(c, 4) : 0;
+        int64_t x[4];
+        uint64_t largest = 0;
+        for (int j = 0; j < 4 && e; j++) {
+            if (!scale(c[j], e, x[j])) {
+                e = 0;
+                break;
+            }
+            largest |= x[j] < 0 ? -uint64_t(x[j]) : uint64_t(x[j]);
+        }
+        // Each product has to stay below 2^124
+        if (!e || p.bits + bitLength(largest) > 124) {
+            applyAffine(m, c, out);
+            return;
+        }
+        __int128 d = (__int128)p.d * e;
+        for (int i = 0; i < 3; i++) {
+            __int128 n = (__int128)p.m[i][0] * x[0] + (__int128)p.m[i][1] * x[1] + (__int128)p.m[i][2] * x[2] + (__int128)p.m[i][3] * x[3];
+            out[i] = Rational::from128(n, d);
+        }
+    }
+};
+
+/*
+An affine matrix split into its linear part and translation, for
+transforming points without the homogeneous row: 12 products per point
+rather than 16. The result keeps the w of its input, so points (w of 1) are
+translated and vectors (w of 0) aren't.
+*/
+template <typename S>
+class AffineT {
+    S m[3][4];
+    typename AffineKernels<S>::Prepared prepared;
+
+public:
+    AffineT() : AffineT(Matrix4<S>::Identity()) {}
+
+    // The last row of a is assumed to be 0 0 0 1
+    explicit AffineT(const Matrix4<S>& a) {
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) m[i][j] = a(i, j);
+        }
+        AffineKernels<S>::prepare(m, prepared);
+    }
+
+    Vector4<S> operator*(const Vector4<S>& p) const {
+        Vector4<S> r;
+        AffineKernels<S>::apply(m, prepared, p.data(), r.data());
+        r[3] = p[3];
+        return r;
+    }
+
+    // Transform n stored points, whose w is 1
+    void transformPoints(const Vector3<S> *in, size_t n, Vector3<S> *out) const {
+        for (size_t i = 0; i < n; i++) {
+            S c[4] = {in[i][0], in[i][1], in[i][2], S(1)};
+            AffineKernels<S>::apply(m, prepared, c, out[i].data());
+        }
+    }
+};
+
+template <typename S>
+inline S dot(const Vector4<S>& a, const Vector4<S>& b) {
+    return VectorKernels<S>::dot(a, b);
 }
 
-inline Vector4r cross(const Vector4r& a, const Vector4r& b) {
-    return Vector(a.y()*b.z() - a.z()*b.y(),
-                  a.z()*b.x() - a.x()*b.z(),
-                  a.x()*b.y() - a.y()*b.x());
+template <typename S>
+inline Vector4<S> cross(const Vector4<S>& a, const Vector4<S>& b) {
+    return VectorKernels<S>::cross(a, b);
 }
 
-inline real magnitudeSquared(const Vector4r& v) {
-    return v[0]*v[0] + v[1]*v[1] + v[2]*v[2];
+template <typename S>
+inline S magnitudeSquared(const Vector4<S>& v) {
+    return VectorKernels<S>::dot(v, v);
+}
+
+template <typename S>
+inline bool isZeroVector(const Vector4<S>& v) {
+    return isZero(v[0]) && isZero(v[1]) && isZero(v[2]);
 }
 
 real rational_sqrt(real n, real threshold);
 
-struct Plane {
-    real c[4]; // coefficients
-    
-    Plane() : c{0, 0, 0, 0} {}
-    Plane(real a, real b, real c, real d) : c{a, b, c, d} {}
-    Plane(const Vector4r& normal, real d) : c{normal[0], normal[1], normal[2], d} {}
-    
-    void compute(const Vector4r *points);
-    
-    real signedDistanceNumerator(const Vector4r& point) const {
+// Conservative floating-point enclosures of exact values, for filtering predicates
+template <typename S>
+inline Interval toInterval(const S& r) {
+    return ScalarTraits<S>::toInterval(r);
+}
+
+template <typename S>
+inline IntervalVector toInterval(const Vector4<S>& v) {
+    IntervalVector r;
+    for (int i=0; i<3; i++) r[i] = toInterval(v[i]);
+    return r;
+}
+
+template <typename S>
+inline IntervalVector toInterval(const Vector3<S>& v) {
+    IntervalVector r;
+    for (int i=0; i<3; i++) r[i] = toInterval(v[i]);
+    return r;
+}
+
+template <typename S>
+struct PlaneT {
+    S c[4]; // coefficients
+
+    PlaneT() : c{0, 0, 0, 0} {}
+    PlaneT(S a, S b, S c, S d) : c{a, b, c, d} {}
+    PlaneT(const Vector4<S>& normal, S d) : c{normal[0], normal[1], normal[2], d} {}
+
+    void compute(const Vector4<S> *points);
+
+    S signedDistanceNumerator(const Vector4<S>& point) const {
         return c[0]*point[0] + c[1]*point[1] + c[2]*point[2] + c[3];
     }
-    
-    Vector4r getNormal() const {
-        return Vector(c[0], c[1], c[2]);
+
+    // Sign of signedDistanceNumerator, decided in floating point when possible
+    Sign side(const Vector4<S>& point) const;
+
+    Vector4<S> getNormal() const {
+        return VectorT<S>(c[0], c[1], c[2]);
     }
 };
 
-inline std::ostream& operator << (std::ostream& os, const Plane& t) {
+template <typename S>
+inline std::ostream& operator << (std::ostream& os, const PlaneT<S>& t) {
     os << t.c[0] << ":" << t.c[1] << ":" << t.c[2] << ":" << t.c[3];
     return os;
 }
 
 
-struct Line {
-    Vector4r p[2];
-    
-    Line() {}
-    Line(const Vector4r& start, const Vector4r& end) {
+template <typename S>
+struct LineT {
+    Vector4<S> p[2];
+
+    LineT() {}
+    LineT(const Vector4<S>& start, const Vector4<S>& end) {
         p[0] = start;
         p[1] = end;
     }
-    
-    Vector4r interpolate(real t) const {
+
+    Vector4<S> interpolate(S t) const {
         return p[0] + t * (p[1] - p[0]);
     }
-    
-    Vector4r direction() const { return p[1] - p[0]; }    
-    
-    real distanceSquaredToPoint(const Vector4r& point) const;
-    
-    Vector4r& operator[](int ix) { return p[ix]; }
-    const Vector4r& operator[](int ix) const { return p[ix]; }
-    
-    bool parallelTo(const Line& that) const;
+
+    Vector4<S> direction() const { return p[1] - p[0]; }
+
+    S distanceSquaredToPoint(const Vector4<S>& point) const;
+
+    Vector4<S>& operator[](int ix) { return p[ix]; }
+    const Vector4<S>& operator[](int ix) const { return p[ix]; }
+
+    bool parallelTo(const LineT& that) const;
 };
 
-inline std::ostream& operator << (std::ostream& os, const Line& l) {
+template <typename S>
+inline std::ostream& operator << (std::ostream& os, const LineT<S>& l) {
     os << l.p[0] << ":" << l.p[1];
     return os;
 }
 
-class Triangle {
+template <typename S>
+class TriangleT {
     enum {
         PLANE_VALID = 1,
-        //NORMAL_VALID = 2
+        PLANE_BUSY = 2,  // Some thread is computing the plane
+        //NORMAL_VALID = 4
     };
-    
-    int valid = 0;
-    Vector4r points[3];
-    Plane plane;
-    Vector4r normal;
-    
+
+    // Readers on several threads may race to memoize the plane, so the
+    // flags are atomic. Modifying the points is not thread-safe.
+    mutable std::atomic<int> valid{0};
+    Vector4<S> points[3];
+    PlaneT<S> plane;
+
     // struct Proxy {
     //     Triangle &t;
     //     int ix;
@@ -133,79 +455,104 @@ class Triangle {
     //     }
     //     operator Vector4r() { return t.points[ix]; }
     // };
-        
+
+    void computePlane() const {
+        int expected = 0;
+        if (valid.compare_exchange_strong(expected, PLANE_BUSY, std::memory_order_acquire)) {
+            TriangleT& self(const_cast<TriangleT&>(*this));
+            self.plane.compute(points);
+            valid.store(PLANE_VALID, std::memory_order_release);
+        } else {
+            // Someone else got there first
+            while (!(valid.load(std::memory_order_acquire) & PLANE_VALID)) std::this_thread::yield();
+        }
+    }
+
 public:
-    Triangle() = default;
-    Triangle(const Vector4r& p1, const Vector4r& p2, const Vector4r& p3) {
+    TriangleT() = default;
+    TriangleT(const Vector4<S>& p1, const Vector4<S>& p2, const Vector4<S>& p3) {
         points[0] = p1;
         points[1] = p2;
         points[2] = p3;
-        valid = 0;
         //if (!isValid()) throw std::runtime_error("bad triangle");
     }
-    
-    Vector4r center() const {
-        Vector4r total{};
+    // With a plane that's already known
+    TriangleT(const Vector4<S>& p1, const Vector4<S>& p2, const Vector4<S>& p3, const PlaneT<S>& pl) : TriangleT(p1, p2, p3) {
+        plane = pl;
+        valid.store(PLANE_VALID, std::memory_order_relaxed);
+    }
+
+    TriangleT(const TriangleT& that) { *this = that; }
+    TriangleT& operator=(const TriangleT& that) {
+        for (int i=0; i<3; i++) points[i] = that.points[i];
+        // Only carry over a plane that's finished
+        int v = that.valid.load(std::memory_order_acquire) & PLANE_VALID;
+        if (v) plane = that.plane;
+        valid.store(v, std::memory_order_relaxed);
+        return *this;
+    }
+
+    Vector4<S> center() const {
+        Vector4<S> total = Vector4<S>::Zero();
         total += points[0];
         total += points[1];
         total += points[2];
-        return total / 3;
+        return total / S(3);
     }
-    
+
     // Proxy operator[](int ix) { return Proxy(*this, ix); }
-    const Vector4r& operator[](int ix) const { return points[ix]; }
-    Vector4r& modifyPoint(int ix) {
-        valid = 0;
-        return points[ix]; 
+    const Vector4<S>& operator[](int ix) const { return points[ix]; }
+    Vector4<S>& modifyPoint(int ix) {
+        valid.store(0, std::memory_order_relaxed);
+        return points[ix];
     }
-    
-    const Plane& getPlane() const {
-        if (!(valid & PLANE_VALID)) {
-            // Memoize the plane
-            Triangle& self(const_cast<Triangle&>(*this));
-            self.plane.compute(points);
-            self.valid |= PLANE_VALID;
-        }
+
+    const PlaneT<S>& getPlane() const {
+        // Memoize the plane
+        if (!(valid.load(std::memory_order_acquire) & PLANE_VALID)) computePlane();
         return plane;
     }
-    
-    Vector4r getNormal() const {
+
+    Vector4<S> getNormal() const {
         return getPlane().getNormal();
     }
-    
-    bool containsPoint(const Vector4r& p) const;
-    
-    Line getSide(int a) const {
+
+    bool containsPoint(const Vector4<S>& p) const;
+
+    LineT<S> getSide(int a) const {
         int b = (a+1) % 3;
-        return Line(points[a], points[b]);
+        return LineT<S>(points[a], points[b]);
     }
-    Line getEdge(int a) const { return getSide(a); }
-    
-    bool parallelTo(const Triangle& that) const {
-        Vector4r this_normal = getNormal();
-        Vector4r that_normal = that.getNormal();
-        Vector4r cross_product = cross(this_normal, that_normal);
-        real cross_magnitude_squared = dot(cross_product, cross_product);
-        std::cout << "Checking parallel this=" << this_normal << " that=" << that_normal << " cross=" << cross_product << " sqr=" << cross_magnitude_squared << std::endl;
-        return cross_magnitude_squared == 0;
+    LineT<S> getEdge(int a) const { return getSide(a); }
+
+    bool parallelTo(const TriangleT& that) const {
+        Vector4<S> this_normal = getNormal();
+        Vector4<S> that_normal = that.getNormal();
+        if constexpr (ScalarTraits<S>::exact) {
+            // Any certainly-nonzero component of the cross product settles it
+            if (cross(toInterval(this_normal), toInterval(that_normal)).certainlyNonzero()) return false;
+        }
+        Vector4<S> cross_product = cross(this_normal, that_normal);
+        S cross_magnitude_squared = dot(cross_product, cross_product);
+        THEOCAD_TRACE(GEOMETRY, VERBOSE, "Checking parallel this=" << this_normal << " that=" << that_normal << " cross=" << cross_product << " sqr=" << cross_magnitude_squared);
+        return isZero(cross_magnitude_squared);
     }
-    
-    bool coplanar(const Triangle& that) const {
+
+    bool coplanar(const TriangleT& that) const {
         // First, check if the triangles are parallel
         if (!parallelTo(that)) return false;
 
         // If they're parallel, check if a point from t2 lies on the plane of t1
-        Plane plane = getPlane();
-        Vector4r point_on_t2 = that[0];  // Take any point from t2
+        PlaneT<S> plane = getPlane();
+        Vector4<S> point_on_t2 = that[0];  // Take any point from t2
 
-        std::cout << "Checking coplanar of " << point_on_t2 << " on " << plane << std::endl;
+        THEOCAD_TRACE(GEOMETRY, VERBOSE, "Checking coplanar of " << point_on_t2 << " on " << plane);
         // Compute the signed distance from the point to the plane
-        real distance = plane.signedDistanceNumerator(point_on_t2);
-        return distance == 0;
+        return plane.side(point_on_t2) == Sign::ZERO;
     }
-    
+
     // Only valid if triangles are coplanar
-    bool overlaps(const Triangle& that) const {
+    bool overlaps(const TriangleT& that) const {
         for (int i=0; i<3; i++) {
             if (containsPoint(that.points[i])) return true;
         }
@@ -214,17 +561,17 @@ public:
         }
         return false;
     }
-    
+
     // Only valid if triangles are coplanar
     // Checks if 'that' is completely contained in this.
-    bool contains(const Triangle& that) const {
+    bool contains(const TriangleT& that) const {
         for (int i=0; i<3; i++) {
             if (!containsPoint(that.points[i])) return false;
         }
         return true;
     }
-    
-    bool operator==(const Triangle& that) const {
+
+    bool operator==(const TriangleT& that) const {
         if (points[0] == that.points[0]) {
             if (points[1] == that.points[1] && points[2] == that.points[2]) return true;
             if (points[1] == that.points[2] && points[2] == that.points[1]) return true;
@@ -240,14 +587,14 @@ public:
         }
         return false;
     }
-    
+
     bool isValid() const {
         if (points[0] == points[1]) return false;
         if (points[0] == points[2]) return false;
         if (points[2] == points[1]) return false;
-        Line e0 = getEdge(0);
-        Line e1 = getEdge(1);
-        Line e2 = getEdge(2);
+        LineT<S> e0 = getEdge(0);
+        LineT<S> e1 = getEdge(1);
+        LineT<S> e2 = getEdge(2);
         if (e0.parallelTo(e1)) return false;
         if (e1.parallelTo(e2)) return false;
         if (e2.parallelTo(e0)) return false;
@@ -256,29 +603,97 @@ public:
 };
 
 
-inline std::ostream& operator << (std::ostream& os, const Triangle& t) {
+template <typename S>
+inline std::ostream& operator << (std::ostream& os, const TriangleT<S>& t) {
     os << t[0] << ":" << t[1] << ":" << t[2];
     return os;
 }
 
+template <typename S>
+inline std::ostream& operator << (std::ostream& os, const std::vector<TriangleT<S>>& v) {
+    for (const auto& t : v) os << " " << t;
+    return os;
+}
+
+/*
+Canonical form of a triangle, so that coincident triangles can be found by
+hashing rather than by comparing every pair. The vertices are rotated to put
+the least (in x, y, z order) first, which keeps the winding, and then the
+other two are put in order, recording whether that reversed the winding.
+Two triangles with equal keys cover the same points; they face the same way
+if their reversed flags agree.
+*/
+template <typename S>
+struct TriangleKeyT {
+    Vector4<S> points[3];
+    bool reversed = false;
+    
+    static bool less(const Vector4<S>& a, const Vector4<S>& b) {
+        for (int i=0; i<3; i++) {
+            if (a[i] < b[i]) return true;
+            if (b[i] < a[i]) return false;
+        }
+        return false;
+    }
+    
+    explicit TriangleKeyT(const TriangleT<S>& t) {
+        int first = 0;
+        if (less(t[1], t[first])) first = 1;
+        if (less(t[2], t[first])) first = 2;
+        for (int i=0; i<3; i++) points[i] = t[(first + i) % 3];
+        if (less(points[2], points[1])) {
+            std::swap(points[1], points[2]);
+            reversed = true;
+        }
+    }
+    
+    // Same points, either way round
+    bool operator==(const TriangleKeyT& that) const {
+        for (int i=0; i<3; i++) {
+            if (points[i] != that.points[i]) return false;
+        }
+        return true;
+    }
+    
+    struct Hash {
+        size_t operator()(const TriangleKeyT& k) const {
+            size_t h = 0;
+            for (int i=0; i<3; i++) {
+                for (int j=0; j<3; j++) h = hashPair(h, hashScalar(k.points[i][j]));
+            }
+            return h;
+        }
+    };
+};
+
 // Invalid if coplanar or parallel
-Line planeIntersection(const Plane& plane1, const Plane& plane2);
+template <typename S>
+LineT<S> planeIntersection(const PlaneT<S>& plane1, const PlaneT<S>& plane2);
 
-struct LineIntersection {
-    real t[2]; // Intersection parameters for lines a and b
+template <typename S>
+struct LineIntersectionT {
+    S t[2]; // Intersection parameters for lines a and b
     bool inside_line[2]; // True if the parameter lies within the bounds of a and b
-    std::vector<Vector4r> point; // Actual points of intersection    
+    std::vector<Vector4<S>> point; // Actual points of intersection
     bool exists, coplanar, skew, coincident;
-    
-    LineIntersection() : t{real(), real()}, inside_line{false, false}, exists(false), coplanar(false), skew(false), coincident(false) {}
+
+    LineIntersectionT() : t{S(), S()}, inside_line{false, false}, exists(false), coplanar(false), skew(false), coincident(false) {}
 };
 
 // LineTriangleIntersection intersect(const Line& line, const Triangle& triangle);
-LineIntersection lineIntersection(const Line& a, const Line& b);
+template <typename S>
+LineIntersectionT<S> lineIntersection(const LineT<S>& a, const LineT<S>& b);
 
-void sliceTriangles(const std::vector<Triangle>& A, const std::vector<Triangle>& B, std::vector<Triangle>& result);
+// Slice a triangle by each of the cutters in turn, appending the pieces to result
+template <typename S>
+void sliceTriangleBy(const TriangleT<S>& p, const std::vector<const TriangleT<S>*>& cutters, std::vector<TriangleT<S>>& result);
 
-inline std::ostream& operator<<(std::ostream& os, const LineIntersection& i) {
+// Slice every triangle of A by the triangles of B that can touch it
+template <typename S>
+void sliceTriangles(const std::vector<TriangleT<S>>& A, const std::vector<TriangleT<S>>& B, std::vector<TriangleT<S>>& result);
+
+template <typename S>
+inline std::ostream& operator<<(std::ostream& os, const LineIntersectionT<S>& i) {
     os << "exists=" << i.exists << " coincident=" << i.coincident << " skew=" << i.skew << " coplanar=" << i.coplanar << " in_line=" << i.inside_line[0] << "," << i.inside_line[1] << " t=" << i.t[0] << "," << i.t[1];
     os << " point=";
     bool prior_point = false;
@@ -290,6 +705,12 @@ inline std::ostream& operator<<(std::ostream& os, const LineIntersection& i) {
     return os;
 }
 
+using Plane = PlaneT<real>;
+using Line = LineT<real>;
+using Triangle = TriangleT<real>;
+using TriangleKey = TriangleKeyT<real>;
+using LineIntersection = LineIntersectionT<real>;
+
 } // namespace theocad
 
 
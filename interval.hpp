@@ -0,0 +1,133 @@
+#ifndef INCLUDED_INTERVAL_HPP
+#define INCLUDED_INTERVAL_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+
+/*
+Double-precision interval arithmetic used to filter exact predicates.
+
+Every operation rounds its bounds outward by one ulp, so the true (exact)
+result of an expression is always contained in the computed interval. If
+the interval excludes zero, the sign of the exact expression is known
+without doing any rational arithmetic.
+*/
+
+namespace theocad {
+
+enum class Sign {
+    NEGATIVE = -1,
+    ZERO = 0,
+    POSITIVE = 1,
+    UNCERTAIN = 2
+};
+
+struct Interval {
+    double lo, hi;
+
+    Interval() : lo(0), hi(0) {}
+    Interval(double x) : lo(x), hi(x) {}
+    Interval(double l, double h) : lo(l), hi(h) {}
+
+    // Enclose the exact value num/den.
+    static Interval fraction(int64_t num, int64_t den) {
+        if (num == 0) return Interval();
+        // Integers up to 2^53 convert exactly, and a single division
+        // rounds by at most half an ulp. Otherwise, allow for the
+        // conversion error of each operand as well.
+        const int64_t exact = int64_t(1) << 53;
+        double q = double(num) / double(den);
+        if (den == 1 && num <= exact && num >= -exact) return Interval(q);
+        Interval r(down(q), up(q));
+        if (num > exact || num < -exact || den > exact || den < -exact) {
+            r.lo = down(down(r.lo));
+            r.hi = up(up(r.hi));
+        }
+        return r;
+    }
+
+    // Enclose a value known only to within a few ulps of x
+    static Interval approximate(double x) {
+        if (!std::isfinite(x)) return Interval(-std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity());
+        double slack = std::abs(x) * std::ldexp(1.0, -48) + std::numeric_limits<double>::denorm_min();
+        return Interval(down(x - slack), up(x + slack));
+    }
+
+    static double down(double x) { return std::nextafter(x, -std::numeric_limits<double>::infinity()); }
+    static double up(double x) { return std::nextafter(x, std::numeric_limits<double>::infinity()); }
+
+    Sign sign() const {
+        if (lo > 0) return Sign::POSITIVE;
+        if (hi < 0) return Sign::NEGATIVE;
+        if (lo == 0 && hi == 0) return Sign::ZERO;
+        return Sign::UNCERTAIN;
+    }
+
+    bool certainlyNonzero() const { return lo > 0 || hi < 0; }
+};
+
+inline Interval operator-(const Interval& a) {
+    return Interval(-a.hi, -a.lo);
+}
+
+inline Interval operator+(const Interval& a, const Interval& b) {
+    // Adding an exact zero is exact
+    if (a.lo == 0 && a.hi == 0) return b;
+    if (b.lo == 0 && b.hi == 0) return a;
+    return Interval(Interval::down(a.lo + b.lo), Interval::up(a.hi + b.hi));
+}
+
+inline Interval operator-(const Interval& a, const Interval& b) {
+    return a + (-b);
+}
+
+inline Interval operator*(const Interval& a, const Interval& b) {
+    double p0 = a.lo * b.lo;
+    double p1 = a.lo * b.hi;
+    double p2 = a.hi * b.lo;
+    double p3 = a.hi * b.hi;
+    double lo = std::min(std::min(p0, p1), std::min(p2, p3));
+    double hi = std::max(std::max(p0, p1), std::max(p2, p3));
+    if (lo == 0 && hi == 0) return Interval();
+    return Interval(Interval::down(lo), Interval::up(hi));
+}
+
+inline Interval& operator+=(Interval& a, const Interval& b) { a = a + b; return a; }
+inline Interval& operator-=(Interval& a, const Interval& b) { a = a - b; return a; }
+
+// Three-component interval vector mirroring the spatial part of Vector4r
+struct IntervalVector {
+    Interval v[3];
+
+    Interval& operator[](int ix) { return v[ix]; }
+    const Interval& operator[](int ix) const { return v[ix]; }
+
+    // True if some component is certainly nonzero
+    bool certainlyNonzero() const {
+        return v[0].certainlyNonzero() || v[1].certainlyNonzero() || v[2].certainlyNonzero();
+    }
+};
+
+inline IntervalVector operator-(const IntervalVector& a, const IntervalVector& b) {
+    IntervalVector r;
+    for (int i=0; i<3; i++) r[i] = a[i] - b[i];
+    return r;
+}
+
+inline Interval dot(const IntervalVector& a, const IntervalVector& b) {
+    return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+inline IntervalVector cross(const IntervalVector& a, const IntervalVector& b) {
+    IntervalVector r;
+    r[0] = a[1]*b[2] - a[2]*b[1];
+    r[1] = a[2]*b[0] - a[0]*b[2];
+    r[2] = a[0]*b[1] - a[1]*b[0];
+    return r;
+}
+
+} // namespace theocad
+
+#endif
@@ -0,0 +1,840 @@
+#include "mesh_io.hpp"
+#include "threadpool.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "binary STL is little-endian, and is read and written straight from memory"
+#endif
+
+namespace theocad {
+
+namespace {
+
+using Sink = std::function<void(const char *, size_t)>;
+
+// Gathers output into large blocks before handing it to the sink
+class BlockWriter {
+    static const size_t BLOCK = size_t(4) << 20;
+    Sink sink;
+    std::string block;
+
+public:
+    BlockWriter(Sink s) : sink(std::move(s)) { block.reserve(BLOCK); }
+
+    void put(const char *p, size_t n) {
+        if (block.size() + n > BLOCK) flush();
+        if (n >= BLOCK) {
+            sink(p, n);
+        } else {
+            block.append(p, n);
+        }
+    }
+    void put(const std::string& s) { put(s.data(), s.size()); }
+
+    void flush() {
+        if (!block.empty()) sink(block.data(), block.size());
+        block.clear();
+    }
+};
+
+} // namespace
+
+static Sink streamSink(std::ostream& os) {
+    return [&os](const char *p, size_t n) { os.write(p, n); };
+}
+
+static Sink fdSink(int fd) {
+    return [fd](const char *p, size_t n) {
+        while (n) {
+            ssize_t written = ::write(fd, p, n);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("error writing mesh: ") + std::strerror(errno));
+            }
+            p += written;
+            n -= written;
+        }
+    };
+}
+
+// A run of one surface's vertices or triangles, to be formatted together
+struct Chunk {
+    int surface;
+    bool triangles;
+    size_t first, last;
+};
+
+static void addChunks(std::vector<Chunk>& chunks, int surface, bool triangles, size_t n) {
+    const size_t CHUNK = 4096;
+    for (size_t first = 0; first < n; first += CHUNK) chunks.push_back({surface, triangles, first, std::min(n, first + CHUNK)});
+}
+
+/*
+Format the chunks with format(chunk, text), which appends the chunk's text.
+A window of chunks, from however many surfaces, is formatted in parallel and
+then written in order, so only the window is ever held.
+*/
+template <typename F>
+static void streamChunks(BlockWriter& out, const std::vector<Chunk>& chunks, F format) {
+    const size_t WINDOW = 64;
+    std::vector<std::string> texts(std::min(chunks.size(), WINDOW));
+    for (size_t first = 0; first < chunks.size(); first += WINDOW) {
+        size_t m = std::min(WINDOW, chunks.size() - first);
+        parallelFor(m, [&](int k) {
+            texts[k].clear();
+            format(chunks[first + k], texts[k]);
+        });
+        for (size_t k = 0; k < m; k++) out.put(texts[k]);
+    }
+}
+
+// Convert vertices [first, last) to doubles, packed x, y, z
+template <typename S>
+static void convertVertices(const SurfaceT<S>& surface, size_t first, size_t last, double *out) {
+    static_assert(sizeof(Vector3<S>) == 3 * sizeof(S), "vertices have to be packed");
+    size_t n = last - first;
+    std::vector<double> coordinate(n);
+    for (int c = 0; c < 3; c++) {
+        if (n) toDoubles(&surface.getVertex(first)[c], 3, n, coordinate.data());
+        for (size_t i = 0; i < n; i++) out[3*i + c] = coordinate[i];
+    }
+}
+
+// The planes are memoized on each surface, and normally are already there
+// from evaluation. Make sure of them before chunks read them in parallel.
+template <typename S>
+static void computePlanes(const std::vector<const SurfaceT<S> *>& surfaces) {
+    parallelFor(surfaces.size(), [&](int si) { surfaces[si]->getPlanes(); });
+}
+
+// Convert triangles [first, last) to doubles: their unit normals, from
+// their exact planes, and their corners, each packed x, y, z
+template <typename S>
+static void convertTriangles(const SurfaceT<S>& surface, size_t first, size_t last, double *normals, double *corners) {
+    static_assert(sizeof(PlaneT<S>) == 4 * sizeof(S), "planes have to be packed");
+    size_t n = last - first;
+    if (!n) return;
+    const PlaneT<S> *planes = &surface.getPlanes()[first];
+    std::vector<double> coordinate(n);
+    for (int c = 0; c < 3; c++) {
+        toDoubles(&planes[0].c[c], 4, n, coordinate.data());
+        for (size_t i = 0; i < n; i++) normals[3*i + c] = coordinate[i];
+    }
+    for (size_t i = 0; i < n; i++) {
+        double *normal = &normals[3*i];
+        double length = std::sqrt(normal[0]*normal[0] + normal[1]*normal[1] + normal[2]*normal[2]);
+        if (length > 0) {
+            for (int c = 0; c < 3; c++) normal[c] /= length;
+        }
+    }
+
+    // Gather the corners' coordinates, so they convert in one go
+    std::vector<S> gathered;
+    gathered.reserve(9 * n);
+    for (size_t ix = first; ix < last; ix++) {
+        const TriangleIndices& t = surface.getIndices(ix);
+        for (int k = 0; k < 3; k++) {
+            for (int c = 0; c < 3; c++) gathered.push_back(surface.getVertex(t[k])[c]);
+        }
+    }
+    toDoubles(gathered.data(), 1, 9 * n, corners);
+}
+
+static void appendf(std::string& text, const char *format, double x, double y, double z) {
+    char line[128];
+    int n = std::snprintf(line, sizeof line, format, x, y, z);
+    text.append(line, n);
+}
+
+template <typename S>
+static void streamOBJ(BlockWriter& out, const SolidT<S>& solid) {
+    // OBJ indices count from 1, across the whole file
+    std::vector<const SurfaceT<S> *> surfaces;
+    std::vector<int> base;
+    std::vector<Chunk> chunks;
+    int next = 1;
+    for (int si = 0; si < solid.size(); si++) {
+        const SurfaceT<S>& surface = solid[si];
+        surfaces.push_back(&surface);
+        base.push_back(next);
+        next += surface.vertexCount();
+        // Every surface needs a chunk for its group, even without vertices
+        if (surface.vertexCount()) {
+            addChunks(chunks, si, false, surface.vertexCount());
+        } else {
+            chunks.push_back({si, false, 0, 0});
+        }
+        addChunks(chunks, si, true, surface.size());
+    }
+
+    out.put(std::string("# theocad\n"));
+    streamChunks(out, chunks, [&](const Chunk& c, std::string& text) {
+        const SurfaceT<S>& surface = *surfaces[c.surface];
+        if (!c.triangles) {
+            if (c.first == 0) text.append("g surface" + std::to_string(c.surface) + "\n");
+            std::vector<double> v(3 * (c.last - c.first));
+            convertVertices(surface, c.first, c.last, v.data());
+            for (size_t i = 0; i < c.last - c.first; i++) appendf(text, "v %.17g %.17g %.17g\n", v[3*i], v[3*i + 1], v[3*i + 2]);
+            return;
+        }
+        char line[64];
+        int b = base[c.surface];
+        for (size_t ix = c.first; ix < c.last; ix++) {
+            const TriangleIndices& t = surface.getIndices(ix);
+            int n = std::snprintf(line, sizeof line, "f %d %d %d\n", b + t[0], b + t[1], b + t[2]);
+            text.append(line, n);
+        }
+    });
+    out.flush();
+}
+
+// The surfaces, and chunks of their triangles
+template <typename S>
+static std::vector<Chunk> triangleChunks(const SolidT<S>& solid, std::vector<const SurfaceT<S> *>& surfaces) {
+    std::vector<Chunk> chunks;
+    for (int si = 0; si < solid.size(); si++) {
+        surfaces.push_back(&solid[si]);
+        addChunks(chunks, si, true, solid[si].size());
+    }
+    computePlanes(surfaces);
+    return chunks;
+}
+
+template <typename S>
+static void streamSTL(BlockWriter& out, const SolidT<S>& solid, const std::string& name) {
+    std::vector<const SurfaceT<S> *> surfaces;
+    std::vector<Chunk> chunks = triangleChunks(solid, surfaces);
+    out.put("solid " + name + "\n");
+    streamChunks(out, chunks, [&](const Chunk& c, std::string& text) {
+        std::vector<double> normals(3 * (c.last - c.first)), corners(9 * (c.last - c.first));
+        convertTriangles(*surfaces[c.surface], c.first, c.last, normals.data(), corners.data());
+        for (size_t i = 0; i < c.last - c.first; i++) {
+            const double *n = &normals[3*i], *v = &corners[9*i];
+            appendf(text, "facet normal %.9g %.9g %.9g\nouter loop\n", n[0], n[1], n[2]);
+            for (int k = 0; k < 3; k++) appendf(text, "vertex %.9g %.9g %.9g\n", v[3*k], v[3*k + 1], v[3*k + 2]);
+            text.append("endloop\nendfacet\n");
+        }
+    });
+    out.put("endsolid " + name + "\n");
+    out.flush();
+}
+
+template <typename S>
+static void streamBinarySTL(BlockWriter& out, const SolidT<S>& solid, const std::string& name) {
+    std::vector<const SurfaceT<S> *> surfaces;
+    std::vector<Chunk> chunks = triangleChunks(solid, surfaces);
+    uint64_t total = 0;
+    for (const SurfaceT<S> *s : surfaces) total += s->size();
+    if (total > UINT32_MAX) throw std::runtime_error("too many triangles for STL");
+
+    char header[80] = {};
+    std::memcpy(header, name.data(), std::min(name.size(), sizeof header));
+    out.put(header, sizeof header);
+    uint32_t count = total;
+    out.put(reinterpret_cast<const char *>(&count), sizeof count);
+
+    // Each facet is 50 bytes: the normal and the corners as floats, and two
+    // unused bytes
+    streamChunks(out, chunks, [&](const Chunk& c, std::string& text) {
+        text.resize(50 * (c.last - c.first));
+        char *record = &text[0];
+        std::vector<double> normals(3 * (c.last - c.first)), corners(9 * (c.last - c.first));
+        convertTriangles(*surfaces[c.surface], c.first, c.last, normals.data(), corners.data());
+        for (size_t i = 0; i < c.last - c.first; i++, record += 50) {
+            const double *n = &normals[3*i], *v = &corners[9*i];
+            float f[12];
+            for (int i = 0; i < 3; i++) f[i] = n[i];
+            for (int i = 0; i < 9; i++) f[3 + i] = v[i];
+            std::memcpy(record, f, sizeof f);
+            std::memset(record + 48, 0, 2);
+        }
+    });
+    out.flush();
+}
+
+template <typename S>
+void writeOBJ(std::ostream& os, const SolidT<S>& solid) {
+    BlockWriter out(streamSink(os));
+    streamOBJ(out, solid);
+}
+
+template <typename S>
+void writeOBJ(int fd, const SolidT<S>& solid) {
+    BlockWriter out(fdSink(fd));
+    streamOBJ(out, solid);
+}
+
+template <typename S>
+void writeSTL(std::ostream& os, const SolidT<S>& solid, const std::string& name) {
+    BlockWriter out(streamSink(os));
+    streamSTL(out, solid, name);
+}
+
+template <typename S>
+void writeBinarySTL(std::ostream& os, const SolidT<S>& solid, const std::string& name) {
+    BlockWriter out(streamSink(os));
+    streamBinarySTL(out, solid, name);
+}
+
+template <typename S>
+void writeBinarySTL(int fd, const SolidT<S>& solid, const std::string& name) {
+    BlockWriter out(fdSink(fd));
+    streamBinarySTL(out, solid, name);
+}
+
+static bool endsWith(const std::string& s, const std::string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+template <typename S>
+void writeMesh(const std::string& filename, const SolidT<S>& solid) {
+    bool stl = endsWith(filename, ".stl") || endsWith(filename, ".STL");
+    if (!stl && !endsWith(filename, ".obj") && !endsWith(filename, ".OBJ")) {
+        throw std::runtime_error("unknown mesh format: " + filename);
+    }
+    int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) throw std::runtime_error("can't write " + filename + ": " + std::strerror(errno));
+    try {
+        if (stl) {
+            writeBinarySTL(fd, solid);
+        } else {
+            writeOBJ(fd, solid);
+        }
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    if (::close(fd) != 0) throw std::runtime_error("error writing " + filename + ": " + std::strerror(errno));
+}
+
+namespace {
+
+// A file mapped read-only into memory
+class MappedFile {
+    void *data_ = nullptr;
+    size_t size_ = 0;
+
+public:
+    explicit MappedFile(const std::string& filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("can't read " + filename + ": " + std::strerror(errno));
+        struct stat st;
+        bool ok = ::fstat(fd, &st) == 0;
+        if (ok && st.st_size > 0) {
+            void *p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = p != MAP_FAILED;
+            if (ok) {
+                data_ = p;
+                size_ = st.st_size;
+            }
+        }
+        ::close(fd);
+        if (!ok) throw std::runtime_error("can't map " + filename);
+    }
+    ~MappedFile() {
+        if (data_) ::munmap(data_, size_);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char *data() const { return static_cast<const char *>(data_); }
+    size_t size() const { return size_; }
+};
+
+// Thrown while parsing a piece of text, and reported with its line number
+struct BadText {
+    const char *where;
+    std::string message;
+};
+
+const int64_t POWERS_OF_TEN[19] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000,
+    10000000000, 100000000000, 1000000000000, 10000000000000, 100000000000000,
+    1000000000000000, 10000000000000000, 100000000000000000, 1000000000000000000
+};
+
+// Powers of ten beyond this either way are past the range of double, so no
+// mesh needs them, and the exact scalars would take ages to build them
+const int MAX_EXPONENT = 400;
+
+// The rest of one line of text
+struct Cursor {
+    const char *p, *end;
+
+    void fail(const std::string& message) const { throw BadText{p, message}; }
+
+    void skipSpace() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    }
+
+    bool atEnd() {
+        skipSpace();
+        return p == end;
+    }
+
+    // Accept a keyword, if it's the next word
+    bool word(const char *w) {
+        skipSpace();
+        size_t n = std::strlen(w);
+        if (size_t(end - p) < n || std::memcmp(p, w, n) != 0) return false;
+        if (p + n < end && p[n] != ' ' && p[n] != '\t' && p[n] != '\r') return false;
+        p += n;
+        return true;
+    }
+
+    // The rest of the word the cursor is in
+    void skipWord() {
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r') p++;
+    }
+
+    long integer() {
+        skipSpace();
+        const char *start = p;
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+        long n = 0;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (n > INT32_MAX) fail("index out of range");
+            n = n*10 + (*p++ - '0');
+        }
+        if (p == start || !std::isdigit((unsigned char)p[-1])) fail("expected an index");
+        return negative ? -n : n;
+    }
+
+    // A decimal, read exactly for the exact scalars
+    template <typename S>
+    S number() {
+        skipSpace();
+        const char *start = p;
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+        // The significant digits, and the power of ten they're scaled by
+        char digits[64];
+        int count = 0, exponent = 0;
+        bool any = false, point = false;
+        for (; p < end; p++) {
+            if (*p == '.' && !point) {
+                point = true;
+                continue;
+            }
+            if (*p < '0' || *p > '9') break;
+            any = true;
+            if (point) exponent--;
+            if (count == 0 && *p == '0') continue;
+            if (count == int(sizeof digits)) fail("number too long");
+            digits[count++] = *p;
+        }
+        if (!any) fail("expected a number");
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            p++;
+            bool down = false;
+            if (p < end && (*p == '-' || *p == '+')) down = *p++ == '-';
+            int e = 0;
+            if (p == end || *p < '0' || *p > '9') fail("expected an exponent");
+            while (p < end && *p >= '0' && *p <= '9') {
+                if (e > MAX_EXPONENT) fail("exponent out of range");
+                e = e*10 + (*p++ - '0');
+            }
+            exponent += down ? -e : e;
+        }
+        if (p < end && *p != ' ' && *p != '\t' && *p != '\r') fail("expected a number");
+        // Leading zeros after the point count too
+        if (exponent + count > MAX_EXPONENT || exponent + count < -MAX_EXPONENT) fail("exponent out of range");
+
+        if (!ScalarTraits<S>::exact) {
+            std::string text(start, p);
+            return ScalarTraits<S>::fromDouble(std::strtod(text.c_str(), nullptr));
+        }
+        while (count && digits[count - 1] == '0') {
+            count--;
+            exponent++;
+        }
+        if (count <= 18 && exponent <= 0 && exponent >= -18) {
+            int64_t n = 0;
+            for (int k = 0; k < count; k++) n = n*10 + (digits[k] - '0');
+            return ScalarTraits<S>::fraction(negative ? -n : n, POWERS_OF_TEN[-exponent]);
+        }
+        // Eighteen digits at a time
+        S x(0);
+        for (int i = 0; i < count; i += 18) {
+            int n = std::min(18, count - i);
+            int64_t group = 0;
+            for (int k = 0; k < n; k++) group = group*10 + (digits[i + k] - '0');
+            x = x * S(POWERS_OF_TEN[n]) + S(group);
+        }
+        while (exponent > 0) {
+            int step = std::min(exponent, 18);
+            x *= S(POWERS_OF_TEN[step]);
+            exponent -= step;
+        }
+        while (exponent < 0) {
+            int step = std::min(-exponent, 18);
+            x /= S(POWERS_OF_TEN[step]);
+            exponent += step;
+        }
+        return negative ? -x : x;
+    }
+
+    template <typename S>
+    Vector3<S> point() {
+        S x = number<S>();
+        S y = number<S>();
+        S z = number<S>();
+        return Vector3<S>(x, y, z);
+    }
+};
+
+// A piece of text, from a line's start to just past a newline
+struct Piece {
+    const char *begin, *end;
+};
+
+// Cut text into pieces of about a megabyte, at line ends, to parse in parallel
+static std::vector<Piece> splitLines(const char *begin, const char *end) {
+    const size_t PIECE = size_t(1) << 20;
+    std::vector<Piece> pieces;
+    while (begin < end) {
+        const char *cut = end;
+        if (size_t(end - begin) > PIECE) {
+            const char *newline = static_cast<const char *>(std::memchr(begin + PIECE, '\n', end - begin - PIECE));
+            if (newline) cut = newline + 1;
+        }
+        pieces.push_back({begin, cut});
+        begin = cut;
+    }
+    return pieces;
+}
+
+// Run parse(piece, ix) on every piece, and throw the first error in the text
+template <typename F>
+static void parsePieces(const std::string& filename, const char *text, const std::vector<Piece>& pieces, F parse) {
+    std::vector<BadText> errors(pieces.size(), BadText{nullptr, ""});
+    parallelFor(pieces.size(), [&](int ix) {
+        try {
+            parse(pieces[ix], ix);
+        } catch (const BadText& e) {
+            errors[ix] = e;
+        }
+    });
+    for (const BadText& e : errors) {
+        if (!e.where) continue;
+        long line = 1 + std::count(text, e.where, '\n');
+        throw std::runtime_error(filename + ":" + std::to_string(line) + ": " + e.message);
+    }
+}
+
+// Call each(line) for every line of a piece
+template <typename F>
+static void forLines(const Piece& piece, F each) {
+    for (const char *p = piece.begin; p < piece.end;) {
+        const char *newline = static_cast<const char *>(std::memchr(p, '\n', piece.end - p));
+        const char *end = newline ? newline : piece.end;
+        Cursor line{p, end};
+        each(line);
+        p = end + 1;
+    }
+}
+
+// Run body(first, last) over [0, n) in parallel chunks
+template <typename F>
+static void forChunks(size_t n, F body) {
+    const size_t CHUNK = 4096;
+    parallelFor((n + CHUNK - 1) / CHUNK, [&](int k) {
+        body(k * CHUNK, std::min(n, (k + 1) * CHUNK));
+    });
+}
+
+// A mesh as read, before it's welded: points, and triangles indexing them
+template <typename S>
+struct RawMesh {
+    std::vector<Vector3<S>> points;
+    std::vector<TriangleIndices> triangles;
+};
+
+} // namespace
+
+template <typename S>
+static void readBinarySTL(const MappedFile& file, RawMesh<S>& mesh) {
+    size_t n = (file.size() - 84) / 50;
+    mesh.points.resize(3 * n);
+    mesh.triangles.resize(n);
+    forChunks(n, [&](size_t first, size_t last) {
+        for (size_t ix = first; ix < last; ix++) {
+            // Skip the normal, which is recomputed exactly
+            float f[9];
+            std::memcpy(f, file.data() + 84 + 50 * ix + 12, sizeof f);
+            for (int k = 0; k < 3; k++) {
+                mesh.points[3*ix + k] = Vector3<S>(ScalarTraits<S>::fromDouble(f[3*k]), ScalarTraits<S>::fromDouble(f[3*k + 1]), ScalarTraits<S>::fromDouble(f[3*k + 2]));
+                mesh.triangles[ix][k] = 3*ix + k;
+            }
+        }
+    });
+}
+
+template <typename S>
+static void readASCIISTL(const std::string& filename, const MappedFile& file, RawMesh<S>& mesh) {
+    std::vector<Piece> pieces = splitLines(file.data(), file.data() + file.size());
+    std::vector<std::vector<Vector3<S>>> points(pieces.size());
+    parsePieces(filename, file.data(), pieces, [&](const Piece& piece, int ix) {
+        forLines(piece, [&](Cursor& line) {
+            if (line.word("vertex")) {
+                points[ix].push_back(line.point<S>());
+            } else if (!line.atEnd() && !line.word("solid") && !line.word("facet") && !line.word("outer") &&
+                       !line.word("endloop") && !line.word("endfacet") && !line.word("endsolid")) {
+                line.fail("expected STL");
+            }
+        });
+    });
+    for (std::vector<Vector3<S>>& p : points) {
+        mesh.points.insert(mesh.points.end(), p.begin(), p.end());
+    }
+    if (mesh.points.size() % 3) throw std::runtime_error(filename + ": facet without three vertices");
+    mesh.triangles.resize(mesh.points.size() / 3);
+    for (size_t ix = 0; ix < mesh.triangles.size(); ix++) {
+        for (int k = 0; k < 3; k++) mesh.triangles[ix][k] = 3*ix + k;
+    }
+}
+
+template <typename S>
+static void readOBJ(const std::string& filename, const MappedFile& file, RawMesh<S>& mesh) {
+    // Faces are kept as they're written, along with how many vertices
+    // came before them in the piece, for the indices counting back from
+    // there
+    struct Faces {
+        std::vector<long> indices;
+        std::vector<int> sizes;
+        std::vector<int> bases;
+    };
+    std::vector<Piece> pieces = splitLines(file.data(), file.data() + file.size());
+    std::vector<std::vector<Vector3<S>>> points(pieces.size());
+    std::vector<Faces> faces(pieces.size());
+    parsePieces(filename, file.data(), pieces, [&](const Piece& piece, int ix) {
+        forLines(piece, [&](Cursor& line) {
+            if (line.word("v")) {
+                points[ix].push_back(line.point<S>());
+            } else if (line.word("f")) {
+                Faces& f = faces[ix];
+                int size = 0;
+                while (!line.atEnd()) {
+                    long vi = line.integer();
+                    if (vi == 0) line.fail("vertex index 0");
+                    f.indices.push_back(vi);
+                    size++;
+                    // Texture coordinates and normals
+                    line.skipWord();
+                }
+                if (size < 3) line.fail("face with fewer than three vertices");
+                f.sizes.push_back(size);
+                f.bases.push_back(points[ix].size());
+            }
+            // Everything else is about appearance
+        });
+    });
+
+    long total = 0;
+    for (const std::vector<Vector3<S>>& p : points) total += p.size();
+    long base = 0;
+    for (size_t ix = 0; ix < pieces.size(); ix++) {
+        mesh.points.insert(mesh.points.end(), points[ix].begin(), points[ix].end());
+        const Faces& f = faces[ix];
+        size_t next = 0;
+        for (size_t fi = 0; fi < f.sizes.size(); fi++) {
+            // Fan out from the first vertex
+            int corners[3];
+            for (int k = 0; k < f.sizes[fi]; k++) {
+                long vi = f.indices[next++];
+                vi = vi > 0 ? vi - 1 : base + f.bases[fi] + vi;
+                if (vi < 0 || vi >= total) {
+                    throw std::runtime_error(filename + ": vertex index out of range");
+                }
+                if (k < 2) {
+                    corners[k] = vi;
+                    continue;
+                }
+                corners[2] = vi;
+                mesh.triangles.push_back({{corners[0], corners[1], corners[2]}});
+                corners[1] = vi;
+            }
+        }
+        base += points[ix].size();
+    }
+}
+
+/*
+Weld equal points, returning an id for each point, and the distinct points
+in order of first appearance. The points are sharded by hash, and each
+shard's table of first appearances is built in parallel.
+*/
+template <typename S>
+static std::vector<int> weldPoints(const std::vector<Vector3<S>>& points, std::vector<Vector3<S>>& unique) {
+    size_t n = points.size();
+    std::vector<size_t> hashes(n);
+    forChunks(n, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++) {
+            const Vector3<S>& v = points[i];
+            hashes[i] = hashPair(hashPair(hashScalar(v[0]), hashScalar(v[1])), hashScalar(v[2]));
+        }
+    });
+
+    const int SHARDS = 64;
+    std::vector<std::vector<int>> shards(SHARDS);
+    for (size_t i = 0; i < n; i++) shards[(hashes[i] >> 7) % SHARDS].push_back(i);
+
+    std::vector<int> first(n);
+    parallelFor(SHARDS, [&](int shard) {
+        auto hash = [&](int i) { return hashes[i]; };
+        auto equal = [&](int a, int b) {
+            return points[a][0] == points[b][0] && points[a][1] == points[b][1] && points[a][2] == points[b][2];
+        };
+        std::unordered_set<int, decltype(hash), decltype(equal)> seen(shards[shard].size(), hash, equal);
+        for (int i : shards[shard]) first[i] = *seen.insert(i).first;
+    });
+
+    std::vector<int> ids(n);
+    for (size_t i = 0; i < n; i++) {
+        if (first[i] == int(i)) {
+            ids[i] = unique.size();
+            unique.push_back(points[i]);
+        } else {
+            ids[i] = ids[first[i]];
+        }
+    }
+    return ids;
+}
+
+/*
+Turn a raw mesh into a solid: weld its points, drop the triangles with no
+area, and put each set of triangles on the same plane, facing the same way,
+into a surface of its own.
+*/
+template <typename S>
+static SolidPtrT<S> buildMeshSolid(const std::string& filename, const RawMesh<S>& mesh) {
+    std::vector<Vector3<S>> vertices;
+    std::vector<int> ids = weldPoints(mesh.points, vertices);
+
+    // Each triangle's plane, scaled so that its first nonzero normal
+    // component is 1 or -1, so equal planes are equal coefficients
+    size_t n = mesh.triangles.size();
+    std::vector<TriangleIndices> triangles(n);
+    std::vector<PlaneT<S>> planes(n);
+    std::vector<char> flat(n);
+    forChunks(n, [&](size_t first, size_t last) {
+        for (size_t ix = first; ix < last; ix++) {
+            Vector4<S> corners[3];
+            for (int k = 0; k < 3; k++) {
+                triangles[ix][k] = ids[mesh.triangles[ix][k]];
+                const Vector3<S>& v = vertices[triangles[ix][k]];
+                corners[k] = PointT<S>(v[0], v[1], v[2]);
+            }
+            PlaneT<S>& plane = planes[ix];
+            plane.compute(corners);
+            int lead = 0;
+            while (lead < 3 && isZero(plane.c[lead])) lead++;
+            flat[ix] = lead == 3;
+            if (flat[ix]) continue;
+            S scale = plane.c[lead] < S(0) ? -plane.c[lead] : plane.c[lead];
+            for (int c = 0; c < 4; c++) plane.c[c] /= scale;
+        }
+    });
+
+    auto hash = [&](int ix) {
+        const PlaneT<S>& p = planes[ix];
+        return hashPair(hashPair(hashScalar(p.c[0]), hashScalar(p.c[1])), hashPair(hashScalar(p.c[2]), hashScalar(p.c[3])));
+    };
+    auto equal = [&](int a, int b) {
+        for (int c = 0; c < 4; c++) {
+            if (planes[a].c[c] != planes[b].c[c]) return false;
+        }
+        return true;
+    };
+    std::unordered_map<int, int, decltype(hash), decltype(equal)> surface_of(16, hash, equal);
+    std::vector<std::vector<int>> members;
+    size_t dropped = 0;
+    for (size_t ix = 0; ix < n; ix++) {
+        if (flat[ix]) {
+            dropped++;
+            continue;
+        }
+        auto found = surface_of.emplace(ix, members.size());
+        if (found.second) members.emplace_back();
+        members[found.first->second].push_back(ix);
+    }
+    if (dropped) THEOCAD_TRACE(BODIES, WARN, "Dropped " << dropped << " triangles without area from " << filename);
+    if (members.empty()) throw std::runtime_error(filename + ": no triangles");
+
+    // Each surface gets its own pool of the vertices it uses
+    std::vector<SurfaceT<S>> surfaces(members.size());
+    std::vector<int> owner(vertices.size(), -1), local(vertices.size());
+    for (size_t si = 0; si < members.size(); si++) {
+        std::vector<Vector3<S>> pool;
+        std::vector<TriangleIndices> indices;
+        indices.reserve(members[si].size());
+        for (int ix : members[si]) {
+            TriangleIndices t;
+            for (int k = 0; k < 3; k++) {
+                int vi = triangles[ix][k];
+                if (owner[vi] != int(si)) {
+                    owner[vi] = si;
+                    local[vi] = pool.size();
+                    pool.push_back(vertices[vi]);
+                }
+                t[k] = local[vi];
+            }
+            indices.push_back(t);
+        }
+        surfaces[si].setContents(std::move(pool), std::move(indices));
+    }
+    THEOCAD_TRACE(BODIES, INFO, "Read " << n - dropped << " triangles, " << vertices.size() << " vertices and "
+                  << surfaces.size() << " surfaces from " << filename);
+    return std::make_shared<MeshSolidT<S>>(std::move(surfaces));
+}
+
+template <typename S>
+SolidPtrT<S> readMesh(const std::string& filename) {
+    bool obj = endsWith(filename, ".obj") || endsWith(filename, ".OBJ");
+    if (!obj && !endsWith(filename, ".stl") && !endsWith(filename, ".STL")) {
+        throw std::runtime_error("unknown mesh format: " + filename);
+    }
+    MappedFile file(filename);
+    RawMesh<S> mesh;
+    if (obj) {
+        readOBJ(filename, file, mesh);
+    } else {
+        // ASCII STL can't be told by its first word, since some binary
+        // files start with "solid" too, but binary STL has to be exactly
+        // the size its count of triangles says
+        uint32_t count = 0;
+        if (file.size() >= 84) std::memcpy(&count, file.data() + 80, sizeof count);
+        if (file.size() >= 84 && file.size() == 84 + 50 * uint64_t(count)) {
+            readBinarySTL(file, mesh);
+        } else {
+            readASCIISTL(filename, file, mesh);
+        }
+    }
+    return buildMeshSolid(filename, mesh);
+}
+
+#define THEOCAD_INSTANTIATE_MESH_IO(S) \
+    template void writeOBJ<S>(std::ostream&, const SolidT<S>&); \
+    template void writeOBJ<S>(int, const SolidT<S>&); \
+    template void writeSTL<S>(std::ostream&, const SolidT<S>&, const std::string&); \
+    template void writeBinarySTL<S>(std::ostream&, const SolidT<S>&, const std::string&); \
+    template void writeBinarySTL<S>(int, const SolidT<S>&, const std::string&); \
+    template void writeMesh<S>(const std::string&, const SolidT<S>&); \
+    template SolidPtrT<S> readMesh<S>(const std::string&);
+THEOCAD_FOR_EACH_SCALAR(THEOCAD_INSTANTIATE_MESH_IO)
+
+} // namespace theocad
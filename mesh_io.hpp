@@ -0,0 +1,59 @@
+#ifndef INCLUDED_MESH_IO_HPP
+#define INCLUDED_MESH_IO_HPP
+
+#include "bodies.hpp"
+#include <iostream>
+#include <string>
+
+/*
+Writing a solid's surfaces out as a mesh, in floating point.
+
+- OBJ keeps the indexed structure: each surface becomes a group, with its
+  own vertices.
+- STL is one facet per triangle, with a unit normal, in ASCII or binary.
+
+The writers stream. They go a surface at a time, convert the exact values
+to floating point in parallel chunks, straight into the text or records to
+be written, and write in large blocks, so the float mesh is never all in
+memory at once. STL normals come from the surfaces' memoized exact
+planes. The overloads taking a file descriptor write to it directly, and
+leave it open.
+
+Meshes are read back into a MeshSolidT, from OBJ or from STL in either
+form. The file is mapped into memory and parsed in parallel pieces.
+Coordinates are converted without loss: binary STL's floats exactly, and
+the decimals in text files as the exact decimals they are, for the exact
+scalars. Vertices that are exactly equal are welded into one, triangles
+without area are dropped, and the triangles on each plane, facing the same
+way, become a surface. OBJ polygons are fanned into triangles.
+*/
+
+namespace theocad {
+
+template <typename S>
+void writeOBJ(std::ostream& os, const SolidT<S>& solid);
+template <typename S>
+void writeOBJ(int fd, const SolidT<S>& solid);
+
+template <typename S>
+void writeSTL(std::ostream& os, const SolidT<S>& solid, const std::string& name = "theocad");
+
+// The name goes in the 80-byte header
+template <typename S>
+void writeBinarySTL(std::ostream& os, const SolidT<S>& solid, const std::string& name = "theocad");
+template <typename S>
+void writeBinarySTL(int fd, const SolidT<S>& solid, const std::string& name = "theocad");
+
+// Write to a file, picking the format from its extension: .obj, or .stl
+// for binary STL
+template <typename S>
+void writeMesh(const std::string& filename, const SolidT<S>& solid);
+
+// Read a .obj or .stl file. Throws std::runtime_error, with the line
+// number for text, if it can't be read.
+template <typename S>
+SolidPtrT<S> readMesh(const std::string& filename);
+
+} // namespace theocad
+
+#endif
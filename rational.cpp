@@ -0,0 +1,174 @@
+#include "rational.hpp"
+#include "dyadic.hpp"
+#include <boost/multiprecision/cpp_int.hpp>
+#include <atomic>
+#include <iterator>
+
+namespace theocad {
+
+using boost::multiprecision::cpp_int;
+using boost::multiprecision::cpp_rational;
+
+struct BigRational {
+    std::atomic<int> refs;
+    cpp_rational value;
+
+    BigRational(const cpp_rational& v) : refs(1), value(v) {}
+
+    static const cpp_rational& get(const Rational& r) { return r.big_->value; }
+
+    static cpp_rational toBig(const Rational& r) {
+        if (r.den_) return cpp_rational(r.num_, r.den_);
+        return r.big_->value;
+    }
+
+    static bool fits(const cpp_int& x) {
+        return x <= INT64_MAX && x >= -INT64_MAX;
+    }
+
+    // Demote to inline storage whenever the reduced value fits
+    static Rational fromBig(const cpp_rational& v) {
+        const cpp_int& n = boost::multiprecision::numerator(v);
+        const cpp_int& d = boost::multiprecision::denominator(v);
+        if (fits(n) && fits(d)) {
+            return Rational(Rational::Raw(), n.convert_to<int64_t>(), d.convert_to<int64_t>());
+        }
+        Rational r;
+        r.den_ = 0;
+        r.big_ = new BigRational(v);
+        return r;
+    }
+};
+
+static cpp_int toCppInt(__int128 x) {
+    bool negative = x < 0;
+    unsigned __int128 m = negative ? -(unsigned __int128)x : (unsigned __int128)x;
+    cpp_int r = uint64_t(m >> 64);
+    r <<= 64;
+    r += uint64_t(m);
+    return negative ? cpp_int(-r) : r;
+}
+
+static unsigned __int128 gcd128(unsigned __int128 a, unsigned __int128 b) {
+    while (b) {
+        unsigned __int128 t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+void Rational::retain(BigRational *b) {
+    b->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Rational::release(BigRational *b) {
+    if (b->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete b;
+}
+
+Rational::Rational(int64_t n, int64_t d) : num_(0), den_(1) {
+    if (d == 0) throw std::domain_error("Rational: zero denominator");
+    *this = from128(n, d);
+}
+
+Rational Rational::fromReduced128(__int128 n, __int128 d) {
+    if (n == 0) return Rational();
+    if (fits(n) && d <= INT64_MAX) return Rational(Raw(), int64_t(n), int64_t(d));
+    return BigRational::fromBig(cpp_rational(toCppInt(n), toCppInt(d)));
+}
+
+Rational Rational::from128(__int128 n, __int128 d) {
+    if (d < 0) {
+        n = -n;
+        d = -d;
+    }
+    unsigned __int128 g = gcd128(n < 0 ? -(unsigned __int128)n : (unsigned __int128)n, (unsigned __int128)d);
+    if (g > 1) {
+        n /= (__int128)g;
+        d /= (__int128)g;
+    }
+    return fromReduced128(n, d);
+}
+
+Rational Rational::bigAdd(const Rational& a, const Rational& b) {
+    return BigRational::fromBig(BigRational::toBig(a) + BigRational::toBig(b));
+}
+
+Rational Rational::bigSub(const Rational& a, const Rational& b) {
+    return BigRational::fromBig(BigRational::toBig(a) - BigRational::toBig(b));
+}
+
+Rational Rational::bigMul(const Rational& a, const Rational& b) {
+    return BigRational::fromBig(BigRational::toBig(a) * BigRational::toBig(b));
+}
+
+Rational Rational::bigDiv(const Rational& a, const Rational& b) {
+    if (b.sign() == 0) throw std::domain_error("Rational: division by zero");
+    return BigRational::fromBig(BigRational::toBig(a) / BigRational::toBig(b));
+}
+
+int Rational::bigCompare(const Rational& a, const Rational& b) {
+    return BigRational::toBig(a).compare(BigRational::toBig(b));
+}
+
+int Rational::sign() const {
+    if (den_) return (num_ > 0) - (num_ < 0);
+    return BigRational::get(*this).sign();
+}
+
+double Rational::toDouble() const {
+    if (den_) return double(num_) / double(den_);
+    return BigRational::get(*this).convert_to<double>();
+}
+
+static void exportWords(const cpp_int& x, std::vector<uint64_t>& words) {
+    words.clear();
+    boost::multiprecision::export_bits(x, std::back_inserter(words), 64, false);
+}
+
+static cpp_int importWords(const uint64_t *words, size_t n) {
+    cpp_int x;
+    if (n) boost::multiprecision::import_bits(x, words, words + n, 64, false);
+    return x;
+}
+
+size_t Rational::bigHeapBytes() const {
+    const cpp_rational& v = BigRational::get(*this);
+    auto bytes = [](const cpp_int& x) -> size_t { return x == 0 ? 0 : msb(abs(x)) / 8 + 1; };
+    return sizeof(BigRational) + bytes(boost::multiprecision::numerator(v)) + bytes(boost::multiprecision::denominator(v));
+}
+
+void Rational::toWords(bool& negative, std::vector<uint64_t>& num, std::vector<uint64_t>& den) const {
+    cpp_rational v = BigRational::toBig(*this);
+    negative = v.sign() < 0;
+    exportWords(abs(boost::multiprecision::numerator(v)), num);
+    exportWords(boost::multiprecision::denominator(v), den);
+}
+
+Rational Rational::fromWords(bool negative, const uint64_t *num, size_t num_words, const uint64_t *den, size_t den_words) {
+    cpp_int n = importWords(num, num_words), d = importWords(den, den_words);
+    if (d == 0) throw std::domain_error("Rational: zero denominator");
+    if (negative) n = -n;
+    return BigRational::fromBig(cpp_rational(n, d));
+}
+
+Rational Rational::fromDouble(double x) {
+    int64_t m, n, d;
+    int e;
+    splitDouble(x, m, e);
+    if (dyadicFraction(m, e, n, d)) return Rational(n, d);
+    cpp_int big = m;
+    if (e > 0) return BigRational::fromBig(cpp_rational(big << e));
+    return BigRational::fromBig(cpp_rational(big, cpp_int(1) << -e));
+}
+
+void Rational::print(std::ostream& os) const {
+    if (den_) {
+        os << num_ << '/' << den_;
+    } else {
+        const cpp_rational& v(BigRational::get(*this));
+        os << boost::multiprecision::numerator(v) << '/' << boost::multiprecision::denominator(v);
+    }
+}
+
+} // namespace theocad
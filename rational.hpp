@@ -0,0 +1,238 @@
+#ifndef INCLUDED_RATIONAL_HPP
+#define INCLUDED_RATIONAL_HPP
+
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+Adaptive-precision exact rational number.
+
+Values whose reduced numerator and denominator fit in 64 bits are stored
+inline. Arithmetic on those is done with __int128 intermediates, so products
+and sums never overflow, comparisons need no gcd at all, and additions and
+multiplications use Knuth's cross-reduction to keep the gcds small. Only when
+a reduced result doesn't fit in 64 bits does it spill to a heap-allocated,
+reference-counted arbitrary-precision rational.
+
+Values are always kept in canonical form (reduced, positive denominator,
+inline whenever they fit), so equality is a field-by-field compare.
+*/
+
+namespace theocad {
+
+struct BigRational; // Defined in rational.cpp
+
+class Rational {
+    // den_ > 0 for inline values. den_ == 0 marks a heap value, in which case
+    // big_ replaces num_.
+    union {
+        int64_t num_;
+        BigRational *big_;
+    };
+    int64_t den_;
+
+    struct Raw {};
+    Rational(Raw, int64_t n, int64_t d) : num_(n), den_(d) {}
+
+    static void retain(BigRational *b);
+    static void release(BigRational *b);
+
+    // Build from a reduced 128-bit fraction with d > 0
+    static Rational fromReduced128(__int128 n, __int128 d);
+
+    // Slow paths, taken when either operand is on the heap
+    static Rational bigAdd(const Rational& a, const Rational& b);
+    static Rational bigSub(const Rational& a, const Rational& b);
+    static Rational bigMul(const Rational& a, const Rational& b);
+    static Rational bigDiv(const Rational& a, const Rational& b);
+    static int bigCompare(const Rational& a, const Rational& b);
+    size_t bigHeapBytes() const;
+
+    static uint64_t gcd(uint64_t a, uint64_t b) {
+        if (a == 0) return b;
+        if (b == 0) return a;
+        int shift = __builtin_ctzll(a | b);
+        a >>= __builtin_ctzll(a);
+        do {
+            b >>= __builtin_ctzll(b);
+            if (a > b) std::swap(a, b);
+            b -= a;
+        } while (b);
+        return a << shift;
+    }
+
+    static uint64_t magnitude(int64_t x) { return x < 0 ? -uint64_t(x) : uint64_t(x); }
+    static uint64_t magnitude(__int128 x, uint64_t mod) {
+        unsigned __int128 m = x < 0 ? -(unsigned __int128)x : (unsigned __int128)x;
+        return uint64_t(m % mod);
+    }
+
+    static bool fits(__int128 x) { return x <= INT64_MAX && x >= -INT64_MAX; }
+
+public:
+    Rational() : num_(0), den_(1) {}
+    template <typename I, typename = std::enable_if_t<std::is_integral<I>::value>>
+    Rational(I n) : num_(int64_t(n)), den_(1) {
+        if ((__int128)n > INT64_MAX || (__int128)n < -INT64_MAX) *this = from128(n, 1);
+    }
+    Rational(int64_t n, int64_t d);
+
+    Rational(const Rational& that) : num_(that.num_), den_(that.den_) {
+        if (!den_) retain(big_);
+    }
+    Rational(Rational&& that) noexcept : num_(that.num_), den_(that.den_) {
+        that.den_ = 1;
+        that.num_ = 0;
+    }
+    ~Rational() {
+        if (!den_) release(big_);
+    }
+
+    Rational& operator=(const Rational& that) {
+        if (!that.den_) retain(that.big_);
+        if (!den_) release(big_);
+        num_ = that.num_;
+        den_ = that.den_;
+        return *this;
+    }
+    Rational& operator=(Rational&& that) noexcept {
+        std::swap(num_, that.num_);
+        std::swap(den_, that.den_);
+        return *this;
+    }
+
+    // Build from an arbitrary 128-bit fraction, for kernels that accumulate
+    // several products before normalizing
+    static Rational from128(__int128 n, __int128 d);
+
+    // Take a numerator and denominator already in canonical form, as
+    // written out by numerator() and denominator(), without reducing them
+    // again. Throws std::domain_error if they can't be an inline value;
+    // that they're reduced is the caller's word.
+    static Rational fromCanonical(int64_t n, int64_t d) {
+        if (d <= 0 || n == INT64_MIN || (n == 0 && d != 1)) throw std::domain_error("Rational: not canonical");
+        return Rational(Raw(), n, d);
+    }
+
+    // True if the value is held inline, in which case numerator() and
+    // denominator() are valid.
+    bool isInline() const { return den_ != 0; }
+    int64_t numerator() const { return num_; }
+    int64_t denominator() const { return den_; }
+
+    int sign() const;
+    double toDouble() const;
+    // Bytes on the heap behind a value that has spilled there, roughly,
+    // and 0 for an inline one
+    size_t heapBytes() const {
+        return den_ ? 0 : bigHeapBytes();
+    }
+    void print(std::ostream& os) const;
+
+    // The exact value as a sign and the magnitudes of the numerator and
+    // denominator, in 64-bit words, least significant first. For storing
+    // heap values, which numerator() and denominator() can't describe.
+    void toWords(bool& negative, std::vector<uint64_t>& num, std::vector<uint64_t>& den) const;
+    static Rational fromWords(bool negative, const uint64_t *num, size_t num_words, const uint64_t *den, size_t den_words);
+
+    // The exact value of a finite double, which may need the heap
+    static Rational fromDouble(double x);
+
+    friend Rational operator+(const Rational& a, const Rational& b) {
+        if (!a.den_ || !b.den_) return bigAdd(a, b);
+        if (a.den_ == b.den_) {
+            __int128 n = (__int128)a.num_ + b.num_;
+            if (a.den_ == 1) return fromReduced128(n, 1);
+            uint64_t g = gcd(magnitude(n, a.den_), a.den_);
+            return fromReduced128(n / g, a.den_ / g);
+        }
+        uint64_t g = gcd(a.den_, b.den_);
+        if (g == 1) {
+            return fromReduced128((__int128)a.num_ * b.den_ + (__int128)b.num_ * a.den_, (__int128)a.den_ * b.den_);
+        }
+        __int128 t = (__int128)a.num_ * (b.den_ / g) + (__int128)b.num_ * (a.den_ / g);
+        uint64_t g2 = gcd(magnitude(t, g), g);
+        return fromReduced128(t / g2, (__int128)(a.den_ / g) * (b.den_ / g2));
+    }
+
+    friend Rational operator-(const Rational& a) {
+        if (!a.den_) return bigSub(Rational(), a);
+        return Rational(Raw(), -a.num_, a.den_);
+    }
+
+    friend Rational operator-(const Rational& a, const Rational& b) {
+        if (!a.den_ || !b.den_) return bigSub(a, b);
+        return a + Rational(Raw(), -b.num_, b.den_);
+    }
+
+    friend Rational operator*(const Rational& a, const Rational& b) {
+        if (!a.den_ || !b.den_) return bigMul(a, b);
+        if (a.num_ == 0 || b.num_ == 0) return Rational();
+        if (a.den_ == 1 && b.den_ == 1) return fromReduced128((__int128)a.num_ * b.num_, 1);
+        int64_t g1 = gcd(magnitude(a.num_), b.den_);
+        int64_t g2 = gcd(magnitude(b.num_), a.den_);
+        return fromReduced128((__int128)(a.num_ / g1) * (b.num_ / g2), (__int128)(a.den_ / g2) * (b.den_ / g1));
+    }
+
+    friend Rational operator/(const Rational& a, const Rational& b) {
+        if (!a.den_ || !b.den_) return bigDiv(a, b);
+        if (b.num_ == 0) throw std::domain_error("Rational: division by zero");
+        if (a.num_ == 0) return Rational();
+        int64_t g1 = gcd(magnitude(a.num_), magnitude(b.num_));
+        int64_t g2 = gcd(a.den_, b.den_);
+        __int128 n = (__int128)(a.num_ / g1) * (b.den_ / g2);
+        __int128 d = (__int128)(a.den_ / g2) * (b.num_ / g1);
+        if (d < 0) {
+            n = -n;
+            d = -d;
+        }
+        return fromReduced128(n, d);
+    }
+
+    Rational& operator+=(const Rational& b) { return *this = *this + b; }
+    Rational& operator-=(const Rational& b) { return *this = *this - b; }
+    Rational& operator*=(const Rational& b) { return *this = *this * b; }
+    Rational& operator/=(const Rational& b) { return *this = *this / b; }
+
+    friend bool operator==(const Rational& a, const Rational& b) {
+        if (a.den_ && b.den_) return a.num_ == b.num_ && a.den_ == b.den_;
+        // Canonical form means inline and heap values are never equal
+        if (a.den_ || b.den_) return false;
+        return bigCompare(a, b) == 0;
+    }
+    friend bool operator!=(const Rational& a, const Rational& b) { return !(a == b); }
+
+    friend bool operator<(const Rational& a, const Rational& b) {
+        if (!a.den_ || !b.den_) return bigCompare(a, b) < 0;
+        return (__int128)a.num_ * b.den_ < (__int128)b.num_ * a.den_;
+    }
+    friend bool operator>(const Rational& a, const Rational& b) { return b < a; }
+    friend bool operator<=(const Rational& a, const Rational& b) { return !(b < a); }
+    friend bool operator>=(const Rational& a, const Rational& b) { return !(a < b); }
+
+    friend struct BigRational;
+};
+
+inline Rational abs(const Rational& r) {
+    return r.sign() < 0 ? -r : r;
+}
+
+inline std::ostream& operator<<(std::ostream& os, const Rational& r) {
+    r.print(os);
+    return os;
+}
+
+// Conversion to floating point, analogous to boost::rational_cast
+template <typename T>
+T rational_cast(const Rational& r) {
+    if (r.isInline()) return T(r.numerator()) / T(r.denominator());
+    return T(r.toDouble());
+}
+
+} // namespace theocad
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef INCLUDED_SCALAR_HPP
+#define INCLUDED_SCALAR_HPP
+
+#include <boost/rational.hpp>
+#include <cmath>
+#include <cstddef>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+#include "checked_int.hpp"
+#include "dyadic.hpp"
+#include "rational.hpp"
+#include "fixed.hpp"
+#include "interval.hpp"
+
+/*
+Scalar policies for the geometry kernel. Every class in the kernel is a
+template on its scalar type S, and ScalarTraits<S> supplies what the kernel
+needs to know about it:
+
+- ExactRational: the original boost::rational<int64_t>, on a checked
+  integer. Exact until it overflows, when it throws std::overflow_error.
+- Rational: adaptive precision, exact. This is the default (theocad::real).
+- Fixed: integer grid, inexact. Fast previews.
+- double: inexact. Fastest previews.
+
+fromDouble converts a double exactly, as a fraction over a power of two,
+for the scalars that are exact.
+
+Exact scalars compare against zero exactly and filter their predicates
+through interval arithmetic. Inexact scalars compare against zero with a
+tolerance and skip the filters, since there's nothing slower to fall back to.
+*/
+
+namespace theocad {
+
+using ExactRational = boost::rational<CheckedInt64>;
+
+template <typename S>
+struct ScalarTraits;
+
+inline size_t hashPair(int64_t a, int64_t b) {
+    uint64_t h = uint64_t(a) * 0x9e3779b97f4a7c15ull;
+    h ^= uint64_t(b) + 0x7f4a7c159e3779b9ull + (h << 6) + (h >> 2);
+    return h;
+}
+
+template <>
+struct ScalarTraits<ExactRational> {
+    static constexpr bool exact = true;
+    static const char *name() { return "boost_rational"; }
+    static ExactRational fraction(int64_t n, int64_t d) { return ExactRational(n, d); }
+    // Exactly, when it fits
+    static ExactRational fromDouble(double x) {
+        int64_t m, n, d;
+        int e;
+        splitDouble(x, m, e);
+        if (!dyadicFraction(m, e, n, d)) throw std::runtime_error("number out of range for boost_rational");
+        return ExactRational(n, d);
+    }
+    static double toDouble(const ExactRational& x) { return boost::rational_cast<double>(x); }
+    static size_t heapBytes(const ExactRational&) { return 0; }
+    static Interval toInterval(const ExactRational& x) { return Interval::fraction(x.numerator().value(), x.denominator().value()); }
+    static bool isZero(const ExactRational& x) { return x == 0; }
+    static size_t hash(const ExactRational& x) { return hashPair(x.numerator().value(), x.denominator().value()); }
+};
+
+template <>
+struct ScalarTraits<Rational> {
+    static constexpr bool exact = true;
+    static const char *name() { return "rational"; }
+    static Rational fraction(int64_t n, int64_t d) { return Rational(n, d); }
+    static Rational fromDouble(double x) { return Rational::fromDouble(x); }
+    static double toDouble(const Rational& x) { return x.toDouble(); }
+    // What a spilled value holds on the heap, for accounting
+    static size_t heapBytes(const Rational& x) { return x.heapBytes(); }
+    static Interval toInterval(const Rational& x) {
+        if (x.isInline()) return Interval::fraction(x.numerator(), x.denominator());
+        return Interval::approximate(x.toDouble());
+    }
+    static bool isZero(const Rational& x) { return x == 0; }
+    // Canonical form means equal values hash alike, inline or not
+    static size_t hash(const Rational& x) {
+        if (x.isInline()) return hashPair(x.numerator(), x.denominator());
+        return std::hash<double>()(x.toDouble());
+    }
+};
+
+template <>
+struct ScalarTraits<Fixed> {
+    static constexpr bool exact = false;
+    static const char *name() { return "fixed"; }
+    static Fixed fraction(int64_t n, int64_t d) { return Fixed::fraction(n, d); }
+    static Fixed fromDouble(double x) {
+        double raw = std::ldexp(x, Fixed::FRACTION_BITS);
+        if (!(std::abs(raw) < 0x1p63)) throw std::overflow_error("Fixed: out of range");
+        return Fixed::fromRaw(std::llround(raw));
+    }
+    static double toDouble(Fixed x) { return x.toDouble(); }
+    static size_t heapBytes(Fixed) { return 0; }
+    static Interval toInterval(Fixed x) { return Interval::approximate(x.toDouble()); }
+    // A few grid steps absorbs the rounding of a handful of products
+    static bool isZero(Fixed x) { return x.raw() <= 16 && x.raw() >= -16; }
+    static size_t hash(Fixed x) { return std::hash<int64_t>()(x.raw()); }
+};
+
+template <>
+struct ScalarTraits<double> {
+    static constexpr bool exact = false;
+    static const char *name() { return "double"; }
+    static double fraction(int64_t n, int64_t d) { return double(n) / double(d); }
+    static double fromDouble(double x) { return x; }
+    static double toDouble(double x) { return x; }
+    static size_t heapBytes(double) { return 0; }
+    static Interval toInterval(double x) { return Interval(x); }
+    static bool isZero(double x) { return std::abs(x) <= 1e-9; }
+    static size_t hash(double x) { return x == 0 ? 0 : std::hash<double>()(x); } // -0 == 0
+};
+
+template <typename S>
+inline bool isZero(const S& x) { return ScalarTraits<S>::isZero(x); }
+
+// Equal values have equal hashes
+template <typename S>
+inline size_t hashScalar(const S& x) { return ScalarTraits<S>::hash(x); }
+
+// Convert n scalars, stride apart, to double
+template <typename S>
+inline void toDoubles(const S *in, size_t stride, size_t n, double *out) {
+    for (size_t i = 0; i < n; i++) out[i] = ScalarTraits<S>::toDouble(in[i*stride]);
+}
+
+// For Rationals, the divisions go in a loop of their own, which vectorizes
+template <>
+inline void toDoubles<Rational>(const Rational *in, size_t stride, size_t n, double *out) {
+    std::vector<double> num(n), den(n);
+    for (size_t i = 0; i < n; i++) {
+        const Rational& r = in[i*stride];
+        if (r.isInline()) {
+            num[i] = double(r.numerator());
+            den[i] = double(r.denominator());
+        } else {
+            num[i] = r.toDouble();
+            den[i] = 1;
+        }
+    }
+    for (size_t i = 0; i < n; i++) out[i] = num[i] / den[i];
+}
+
+template <typename S>
+inline bool nearlyEqual(const S& a, const S& b) { return ScalarTraits<S>::isZero(a - b); }
+
+// Invoke X(S) for every supported scalar type, for explicit instantiation
+#define THEOCAD_FOR_EACH_SCALAR(X) \
+    X(ExactRational) \
+    X(Rational) \
+    X(Fixed) \
+    X(double)
+
+} // namespace theocad
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef INCLUDED_STRUCTURAL_HASH_HPP
+#define INCLUDED_STRUCTURAL_HASH_HPP
+
+#include "scalar.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+/*
+128-bit hashes of what a solid is: its kind, its exact parameters and the
+hashes of its children. Solids that hash alike evaluate to the same
+surfaces, so the hash can stand in for the subtree as a cache key.
+
+The hash isn't cryptographic. At 128 bits, accidental collisions are out of
+the question, but it's not meant to resist anyone crafting them.
+*/
+
+namespace theocad {
+
+struct Hash128 {
+    uint64_t lo = 0, hi = 0;
+
+    bool operator==(const Hash128& that) const { return lo == that.lo && hi == that.hi; }
+    bool operator!=(const Hash128& that) const { return !(*this == that); }
+};
+
+// For unordered containers keyed by Hash128. Either half is already well
+// mixed.
+struct Hash128Hasher {
+    size_t operator()(const Hash128& h) const { return h.lo; }
+};
+
+/*
+Accumulates a Hash128 a word at a time, in two independently seeded and
+mixed 64-bit lanes. Scalars go in exactly, so values that differ by less
+than a double can resolve still hash apart.
+*/
+class StructuralHasher {
+    uint64_t a = 0x243f6a8885a308d3ull, b = 0x13198a2e03707344ull;
+    uint64_t count = 0;
+
+    // The splitmix64 finalizer
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebull;
+        x ^= x >> 31;
+        return x;
+    }
+
+public:
+    StructuralHasher& add(uint64_t w) {
+        count++;
+        a = mix(a ^ w) + count;
+        b = mix(b + (w ^ 0xa4093822299f31d0ull) * 0x9e3779b97f4a7c15ull) ^ (a >> 32);
+        return *this;
+    }
+
+    StructuralHasher& add(int64_t w) { return add(uint64_t(w)); }
+    StructuralHasher& add(int w) { return add(uint64_t(int64_t(w))); }
+
+    // Strings go in with their length, so that adjacent ones can't run
+    // together
+    StructuralHasher& add(const std::string& s) {
+        add(uint64_t(s.size()));
+        for (size_t i = 0; i < s.size(); i += 8) {
+            uint64_t w = 0;
+            std::memcpy(&w, s.data() + i, std::min<size_t>(8, s.size() - i));
+            add(w);
+        }
+        return *this;
+    }
+
+    StructuralHasher& add(const char *s) { return add(std::string(s)); }
+
+    StructuralHasher& add(const Hash128& h) { return add(h.lo).add(h.hi); }
+
+    StructuralHasher& add(const ExactRational& x) { return add(x.numerator().value()).add(x.denominator().value()); }
+
+    // Inline values go in as their numerator and denominator. The rare
+    // big ones go in as their exact decimal text, after a marker that no
+    // inline denominator can be, since those are positive.
+    StructuralHasher& add(const Rational& x) {
+        if (x.isInline()) return add(x.numerator()).add(x.denominator());
+        std::ostringstream os;
+        x.print(os);
+        return add(int64_t(0)).add(os.str());
+    }
+
+    StructuralHasher& add(Fixed x) { return add(x.raw()); }
+
+    StructuralHasher& add(double x) {
+        if (x == 0) x = 0; // -0 == 0
+        uint64_t w;
+        std::memcpy(&w, &x, sizeof w);
+        return add(w);
+    }
+
+    Hash128 finish() const {
+        Hash128 h;
+        h.lo = mix(a ^ (count * 0x9e3779b97f4a7c15ull));
+        h.hi = mix(b ^ h.lo);
+        return h;
+    }
+};
+
+} // namespace theocad
+
+#endif
@@ -1,12 +1,15 @@
 # Project configuration
 TEMPLATE = app
 TARGET = test_geometry
-CONFIG += console c++17 warn_on release
+CONFIG += console c++17 warn_on release thread
 
 # Compiler and linker settings
 QMAKE_CXX = clang++
 QMAKE_CXXFLAGS += -Wall -Wextra -g
 
+# The kernel's per-operation traces are compiled in, or not, with the
+# core library (see theocad_core.pro)
+
 # Include paths
 INCLUDEPATH += /usr/include \
                /usr/local/include \
@@ -19,25 +22,15 @@ QMAKE_LFLAGS += -L/usr/lib \
                 -L/opt/homebrew/Cellar/boost/1.85.0/lib
 
 # Libraries to link
-LIBS += -lboost_system
+LIBS += -L$$OUT_PWD -ltheocad_core -lboost_system
+PRE_TARGETDEPS += $$OUT_PWD/libtheocad_core.a
 
 # Source files
-SOURCES += bodies.cpp \
-           geometry.cpp \
-           test.cpp \
-           cad_visualizer.cpp \
-           triangle.cpp \
-           rational_circle.cpp \
-           transforms.cpp \
-           collections.cpp
-
-# Header files (optional, for clarity)
-HEADERS += bodies.hpp \
-           cad_visualizer.hpp \
-           geometry.hpp \
-           rational_circle.hpp \
-           transforms.hpp \
-           collections.hpp
+SOURCES += test.cpp \
+           cad_visualizer.cpp
+
+# Header files, for moc
+HEADERS += cad_visualizer.hpp
 
 # Qt modules
 QT += core gui widgets 3dcore 3drender 3dextras 3dinput 3dlogic
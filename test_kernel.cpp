@@ -0,0 +1,597 @@
+#include "binary_io.hpp"
+#include "csg.hpp"
+#include "mesh_io.hpp"
+#include "trace.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/*
+Headless checks of the core library:
+
+    test_kernel [name...]
+
+runs the named tests, or all of them, and exits with 1 if any check
+failed. Each test is deterministic and needs nothing but a scratch
+directory under /tmp.
+*/
+
+using namespace theocad;
+
+using Clock = std::chrono::steady_clock;
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed\n"; \
+        failures++; \
+    } \
+} while (0)
+
+#define CHECK_THROWS(expr) do { \
+    bool threw = false; \
+    try { (void)(expr); } catch (const std::exception&) { threw = true; } \
+    CHECK(threw); \
+} while (0)
+
+static double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// The volume a closed solid bounds, exactly for the exact scalars
+template <typename S>
+static S volume(const SolidT<S>& solid) {
+    S total(0);
+    for (int i = 0; i < solid.size(); i++) {
+        const SurfaceT<S>& surface = solid[i];
+        for (int t = 0; t < surface.size(); t++) {
+            total += dot(surface.getPoint(t, 0), cross(surface.getPoint(t, 1), surface.getPoint(t, 2)));
+        }
+    }
+    return total / S(6);
+}
+
+template <typename S>
+static int triangleCount(const SolidT<S>& solid) {
+    int n = 0;
+    for (int i = 0; i < solid.size(); i++) n += solid[i].size();
+    return n;
+}
+
+// Rational stays inline exactly while its reduced parts fit in 64 bits, and
+// comes back inline when a result fits again. The other scalars throw
+// where they'd overflow.
+static void testScalarBoundaries() {
+    real top(INT64_MAX);
+    CHECK(top.isInline());
+    real over = top + 1;
+    CHECK(!over.isInline());
+    CHECK((over - 1).isInline() && over - 1 == top);
+    CHECK(!real(INT64_MIN).isInline());
+    CHECK(real(INT64_MIN) == -over);
+    CHECK(real(INT64_MIN) + 1 == -top);
+
+    real square = top * top;
+    CHECK(!square.isInline());
+    CHECK((square / top).isInline() && square / top == top);
+    real tiny = real(1, INT64_MAX) * real(1, 2);
+    CHECK(!tiny.isInline());
+    CHECK((tiny * 2).isInline() && tiny * 2 == real(1, INT64_MAX));
+    CHECK(real(3, 6).numerator() == 1 && real(3, 6).denominator() == 2);
+    CHECK(real(-3, -6) == real(1, 2));
+
+    // Doubles are fractions over powers of two, taken exactly
+    CHECK(real::fromDouble(0.1) == real(3602879701896397, int64_t(1) << 55));
+    CHECK(real::fromDouble(-0.75) == real(-3, 4));
+    for (double x : {1e300, -1e-300, std::numeric_limits<double>::denorm_min()}) {
+        real r = real::fromDouble(x);
+        CHECK(!r.isInline() && r.toDouble() == x);
+    }
+    CHECK_THROWS(real::fromDouble(std::numeric_limits<double>::quiet_NaN()));
+    CHECK_THROWS(real(1, 0));
+
+    CHECK(ExactRational(INT64_MAX - 1) + 1 == ExactRational(INT64_MAX));
+    CHECK_THROWS(ExactRational(INT64_MAX) + 1);
+    CHECK_THROWS(ExactRational(1, INT64_MAX) * ExactRational(1, 2));
+    CHECK(ScalarTraits<ExactRational>::fromDouble(0.375) == ExactRational(3, 8));
+    CHECK_THROWS(ScalarTraits<ExactRational>::fromDouble(1e300));
+
+    CHECK(Fixed(8000) * Fixed(8000) * Fixed(8000) == Fixed(int64_t(512000000000)));
+    CHECK_THROWS(Fixed(int64_t(1) << 39));
+    CHECK_THROWS(Fixed(1 << 20) * Fixed(1 << 20));
+    CHECK_THROWS(Fixed(int64_t(1) << 38) + Fixed(int64_t(1) << 38));
+
+    // So do the kernels that work on Fixed's raw values in 128 bits
+    Fixed big(700000), huge(1000000);
+    CHECK(dot(VectorT<Fixed>(big, 0, 0), VectorT<Fixed>(big, 0, 0)) == Fixed(int64_t(490000000000)));
+    CHECK_THROWS(dot(VectorT<Fixed>(huge, 0, 0), VectorT<Fixed>(huge, 0, 0)));
+    CHECK_THROWS(cross(VectorT<Fixed>(huge, 0, 0), VectorT<Fixed>(0, huge, 0)));
+    Matrix4<Fixed> stretch = Matrix4<Fixed>::Identity();
+    stretch(0, 0) = huge;
+    CHECK(AffineT<Fixed>(stretch) * PointT<Fixed>(1, 2, 3) == PointT<Fixed>(huge, 2, 3));
+    CHECK_THROWS(AffineT<Fixed>(stretch) * PointT<Fixed>(huge, 0, 0));
+}
+
+// Booleans whose volumes are known exactly
+static void testBooleanVolumes() {
+    struct {
+        const char *csg;
+        int64_t num, den;
+    } scenes[] = {
+        {"intersection() { cube(); cube(); }", 1, 1},
+        {"intersection() { cube(); translate([1/2, 0, 0]) cube(); }", 1, 2},
+        {"intersection() { cube(); translate([1/2, 1/3, 1/5]) cube(); }", 4, 15},
+        {"intersection() { cube(); translate([1/2, 1/2, 0]) rotate(30, [0, 0, 1]) cube(); }", 1, 4},
+    };
+    for (const auto& scene : scenes) {
+        SolidPtr solid = parseCSG(scene.csg);
+        CHECK(volume(*solid) == real(scene.num, scene.den));
+    }
+}
+
+// Pieces cut from pieces used to grow without bound in exact arithmetic, so
+// that this scene (the example in csg.hpp) didn't finish in ten minutes
+static void testSliceDepth() {
+    const char *csg = "intersection() { cylinder(); translate([-1/2, 0, 0]) scale([2, 1, 1]) cube(); }";
+    auto start = Clock::now();
+    SolidPtr exact = parseCSG(csg);
+    int triangles = triangleCount(*exact);
+    double seconds = secondsSince(start);
+    CHECK(seconds < 30);
+    CHECK(triangles > 0);
+
+    // The same up to rounding in double
+    SolidPtrT<double> rough = parseCSG<double>(csg);
+    CHECK(std::abs(volume(*exact).toDouble() - volume(*rough)) < 1e-9);
+}
+
+// A fresh directory under /tmp, removed with its files when done
+class ScratchDirectory {
+    std::string path_;
+
+public:
+    ScratchDirectory() {
+        char name[] = "/tmp/test_kernel.XXXXXX";
+        if (!::mkdtemp(name)) throw std::runtime_error("can't make a scratch directory");
+        path_ = name;
+    }
+    ~ScratchDirectory() {
+        for (const std::string& f : files()) ::unlink((path_ + "/" + f).c_str());
+        ::rmdir(path_.c_str());
+    }
+
+    const std::string& path() const { return path_; }
+
+    std::vector<std::string> files() const {
+        std::vector<std::string> names;
+        if (DIR *d = ::opendir(path_.c_str())) {
+            while (struct dirent *e = ::readdir(d)) {
+                if (e->d_name[0] != '.') names.push_back(e->d_name);
+            }
+            ::closedir(d);
+        }
+        return names;
+    }
+};
+
+static std::string readFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+static void writeFile(const std::string& path, const std::string& bytes) {
+    std::ofstream(path, std::ios::binary) << bytes;
+}
+
+// Offset of the format version in a binary file's header, after the magic
+const size_t FORMAT_VERSION_OFFSET = 8;
+
+// Surfaces and trees come back from a binary file just as they went in,
+// including rationals too big to be held inline
+static void testBinaryRoundTrip() {
+    ScratchDirectory dir;
+    std::string path = dir.path() + "/solid.tcb";
+    SolidPtr solid = parseCSG("intersection() { cube(); translate([1/2, 1/2, 0]) rotate(30, [0, 0, 1]) cube(); }");
+    writeBinary(path, *solid);
+    {
+        BinaryFile file(path);
+        CHECK(file.key() == solid->getStructuralHash());
+        std::vector<SurfaceT<real>> surfaces = readSurfaces<real>(file);
+        CHECK(int(surfaces.size()) == solid->size());
+        for (int i = 0; i < solid->size() && i < int(surfaces.size()); i++) {
+            CHECK(surfaces[i].vertexCount() == (*solid)[i].vertexCount());
+            CHECK(surfaces[i].size() == (*solid)[i].size());
+            for (int t = 0; t < surfaces[i].size(); t++) {
+                for (int k = 0; k < 3; k++) CHECK(surfaces[i].getPoint(t, k) == (*solid)[i].getPoint(t, k));
+            }
+        }
+        SolidPtr tree = readTree<real>(file);
+        CHECK(tree->getStructuralHash() == solid->getStructuralHash());
+        CHECK(volume(*tree) == real(1, 4));
+        CHECK_THROWS(readSurfaces<double>(file));
+    }
+
+    real big = real(INT64_MAX) * real(3) / real(INT64_MAX - 2);
+    CHECK(!big.isInline());
+    SurfaceT<real> surface;
+    surface.addTriangle(surface.addVertex(PointT<real>(big, 0, 0)),
+                        surface.addVertex(PointT<real>(0, big, 0)),
+                        surface.addVertex(PointT<real>(0, 0, -big)));
+    writeBinary(path, std::vector<SurfaceT<real>>{surface}, Hash128());
+    BinaryFile file(path);
+    std::vector<SurfaceT<real>> loaded = readSurfaces<real>(file);
+    CHECK(loaded.size() == 1 && loaded[0].getPoint(0, 0)[0] == big && loaded[0].getPoint(0, 2)[2] == -big);
+}
+
+// A damaged file is refused with std::runtime_error, never read past
+static void testBinaryCorrupt() {
+    ScratchDirectory dir;
+    std::string path = dir.path() + "/solid.tcb";
+    writeBinary(path, *parseCSG("intersection() { cube(); translate([1/2, 1/3, 1/5]) cube(); }"));
+    const std::string good = readFile(path);
+
+    auto refused = [&](const std::string& bytes) {
+        writeFile(path, bytes);
+        try {
+            BinaryFile file(path);
+            readSurfaces<real>(file);
+            if (file.hasTree()) readTree<real>(file);
+        } catch (const std::runtime_error&) {
+            return true;
+        }
+        return false;
+    };
+    CHECK(!refused(good));
+    CHECK(refused(good.substr(0, good.size() / 2)));
+    CHECK(refused(good.substr(0, 16)));
+    std::string old = good;
+    old[FORMAT_VERSION_OFFSET] = BinaryFile::FORMAT_VERSION - 1;
+    CHECK(refused(old));
+
+    // Any byte flipped either still reads or is refused
+    int refusals = 0;
+    for (size_t i = 0; i < good.size(); i++) {
+        std::string bad = good;
+        bad[i] ^= 0xff;
+        if (refused(bad)) refusals++;
+    }
+    CHECK(refusals > 0);
+}
+
+// Meshes written out and read back bound the same volume, exactly, when
+// their coordinates are exact in floating point, and can take part in
+// booleans
+static void testMeshRoundTrip() {
+    ScratchDirectory dir;
+    SolidPtr solid = parseCSG("intersection() { cube(); translate([1/2, 1/4, 1/8]) cube(); }");
+    real expected(21, 64);
+    CHECK(volume(*solid) == expected);
+
+    std::string ascii = dir.path() + "/ascii.stl";
+    {
+        std::ofstream out(ascii);
+        writeSTL(out, *solid);
+    }
+    for (const char *name : {"solid.obj", "solid.stl", "ascii.stl"}) {
+        std::string path = dir.path() + "/" + name;
+        if (path != ascii) writeMesh(path, *solid);
+        SolidPtr mesh = readMesh<real>(path);
+        CHECK(volume(*mesh) == expected);
+        CHECK(mesh->inside(PointT<real>(real(3, 4), real(1, 2), real(1, 2))));
+        CHECK(!mesh->inside(PointT<real>(real(1, 4), real(1, 2), real(1, 2))));
+
+        // Out again, and back in
+        std::string again = dir.path() + "/again" + path.substr(path.size() - 4);
+        writeMesh(again, *mesh);
+        CHECK(volume(*readMesh<real>(again)) == expected);
+        CHECK(std::abs(volume(*readMesh<double>(again)) - expected.toDouble()) < 1e-12);
+    }
+
+    SolidPtr cut = parseCSG("intersection() { import(\"" + dir.path() + "/solid.stl\"); translate([0, 0, 1/2]) cube(); }");
+    CHECK(volume(*cut) == real(3, 16));
+
+    std::string broken = dir.path() + "/broken.obj";
+    writeFile(broken, "v 0 0 0\nv 1 0 0\nf 1 2 3\n");
+    CHECK_THROWS(readMesh<real>(broken));
+
+    // Numbers past double's range are refused, rather than built exactly
+    auto start = Clock::now();
+    auto tetrahedron = [](const std::string& x) {
+        return "v " + x + " 0 0\nv 1 0 0\nv 0 1 0\nv 0 0 1\nf 1 3 2\nf 1 2 4\nf 1 4 3\nf 2 3 4\n";
+    };
+    for (const std::string& x : {std::string("1e-900000"), std::string("1e401"), std::string("12345e-420"),
+                                 "0." + std::string(500, '0') + "1"}) {
+        writeFile(broken, tetrahedron(x));
+        CHECK_THROWS(readMesh<real>(broken));
+    }
+    CHECK(secondsSince(start) < 1);
+    writeFile(broken, tetrahedron("1e-300"));
+    CHECK(readMesh<real>(broken)->size() > 0);
+}
+
+// A surface's double mirror holds its vertices, and the unit normals of its
+// triangles' exact planes
+static void testDoubleMirror() {
+    SolidPtr solid = parseCSG("intersection() { cube(); translate([1/2, 1/2, 0]) rotate(30, [0, 0, 1]) cube(); }");
+    for (int i = 0; i < solid->size(); i++) {
+        const SurfaceT<real>& surface = (*solid)[i];
+        const MeshMirror<double>& mirror = surface.getDoubleMirror();
+        CHECK(int(mirror.positions.size()) == 3 * surface.vertexCount());
+        CHECK(int(mirror.normals.size()) == 3 * surface.size());
+        for (int v = 0; v < surface.vertexCount(); v++) {
+            for (int c = 0; c < 3; c++) CHECK(mirror.positions[3*v + c] == surface.getVertex(v)[c].toDouble());
+        }
+        for (int t = 0; t < surface.size(); t++) {
+            const PlaneT<real>& plane = surface.getPlane(t);
+            const double *n = &mirror.normals[3*t];
+            double length = std::sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+            CHECK(std::abs(length - 1) < 1e-12);
+            // Parallel to the plane's normal, and the same way round
+            double along = 0, plane_length = 0;
+            for (int c = 0; c < 3; c++) {
+                along += n[c] * plane.c[c].toDouble();
+                plane_length += plane.c[c].toDouble() * plane.c[c].toDouble();
+            }
+            CHECK(std::abs(along - std::sqrt(plane_length)) < 1e-9 * std::sqrt(plane_length));
+        }
+    }
+}
+
+// Each kind of affine transform has its inverse worked out exactly, by its
+// own shortcut or by the adjugate, and one that can't be inverted throws
+static void testTransformInverses() {
+    auto inverts = [](const Transform& t) {
+        Matrix4<real> identity = Matrix4<real>::Identity();
+        return t.getAffine() * t.getInverse() == identity && t.getInverse() * t.getAffine() == identity;
+    };
+    Translate translate(PointT<real>(real(1, 2), -3, real(7, 5)));
+    CHECK(inverts(translate));
+    Scale scale(VectorT<real>(2, real(1, 3), -5));
+    CHECK(inverts(scale));
+    Rotate rotate;
+    rotate.setAngle(30);
+    rotate.modifyAxis() = VectorT<real>(0, 0, 1);
+    CHECK(inverts(rotate));
+    CHECK(rotate.getInverse()(0, 1) == rotate.getAffine()(1, 0));
+
+    // Scaled, rotated and translated, which only the adjugate inverts
+    Transform composed;
+    composed.modifyAffine() = translate.getAffine() * rotate.getAffine() * scale.getAffine();
+    CHECK(inverts(composed));
+    Vector4<real> p = PointT<real>(real(1, 7), 2, real(-3, 11));
+    CHECK(composed.getInverse() * (composed.getAffine() * p) == p);
+
+    Scale flat(VectorT<real>(1, 0, 2));
+    CHECK_THROWS(flat.getInverse());
+    Transform sheared;
+    sheared.modifyAffine() = rotate.getAffine() * flat.getAffine();
+    CHECK_THROWS(sheared.getInverse());
+}
+
+static SolidPtr translatedCube(int x) {
+    auto t = std::make_shared<Translate>();
+    t->setShift(Vector(x, 0, 0));
+    t->setChild(globalUnitCube<real>());
+    return t;
+}
+
+// Equal subtrees are evaluated once, the least recently used results are
+// evicted when the cache is full, and what a surface memoizes counts
+// against the capacity
+static void testEvaluationCache() {
+    EvaluationCache& cache = EvaluationCache::global();
+    cache.clear();
+    EvaluationCacheStats before = cache.getStats();
+    SolidPtr a = translatedCube(1), b = translatedCube(1);
+    CHECK(volume(*a) == 1);
+    CHECK(volume(*b) == 1);
+    EvaluationCacheStats after = cache.getStats();
+    CHECK(after.misses == before.misses + 1);
+    CHECK(after.hits == before.hits + 1);
+    CHECK(after.entries == 1);
+    CHECK((*a)[0].getVersion() == (*b)[0].getVersion());
+
+    // Room for two results: touching the first makes the second the one to go
+    cache.setCapacity(after.bytes * 5 / 2);
+    translatedCube(2)->size();
+    translatedCube(1)->size();
+    translatedCube(3)->size();
+    EvaluationCacheStats full = cache.getStats();
+    CHECK(full.entries == 2);
+    CHECK(full.evictions == after.evictions + 1);
+    translatedCube(1)->size();
+    CHECK(cache.getStats().hits == full.hits + 1);
+    translatedCube(2)->size();
+    CHECK(cache.getStats().misses == full.misses + 1);
+    cache.setCapacity(EvaluationCache::defaultCapacity);
+    cache.clear();
+
+    SurfaceT<real> surface;
+    real big = real(INT64_MAX) * 3;
+    surface.addTriangle(surface.addVertex(PointT<real>(0, 0, 0)),
+                        surface.addVertex(PointT<real>(1, 0, 0)),
+                        surface.addVertex(PointT<real>(0, 1, 0)));
+    size_t bare = surface.memoryBytes();
+    surface.getPlanes();
+    surface.getTree();
+    surface.getFloatMirror();
+    CHECK(surface.memoryBytes() >= bare + sizeof(PlaneT<real>) + 6 * sizeof(double) + 6 * sizeof(float));
+    SurfaceT<real> spilled;
+    spilled.addVertex(PointT<real>(big, big, big));
+    CHECK(spilled.memoryBytes() >= sizeof(SurfaceT<real>) + 3 * big.heapBytes());
+    CHECK(big.heapBytes() > 0 && real(1, 3).heapBytes() == 0);
+}
+
+// Results come back from the disk for an equal tree, and not for a changed one
+static void testDiskCache() {
+    ScratchDirectory dir;
+    DiskCache& cache = DiskCache::global();
+    cache.setDirectory(dir.path());
+    const char *csg = "intersection() { cube(); translate([1/2, 1/3, 1/5]) cube(); }";
+
+    // Earlier tests may have left the result in memory
+    EvaluationCache::global().clear();
+    SolidPtr first = parseCSG(csg);
+    real expected = volume(*first);
+    DiskCacheStats before = cache.getStats();
+    EvaluationCache::global().clear();
+    SolidPtr second = parseCSG(csg);
+    CHECK(volume(*second) == expected);
+    DiskCacheStats after = cache.getStats();
+    CHECK(after.hits == before.hits + 1);
+    CHECK(after.stores == before.stores);
+
+    EvaluationCache::global().clear();
+    SolidPtr changed = parseCSG("intersection() { cube(); translate([1/2, 1/3, 1/7]) cube(); }");
+    CHECK(volume(*changed) == real(2, 7));
+    CHECK(cache.getStats().misses == after.misses + 1);
+    CHECK(cache.getStats().stores == after.stores + 1);
+
+    // An entry in an older format is a miss, and is replaced
+    std::vector<std::string> entries = dir.files();
+    CHECK(entries.size() == 2);
+    for (const std::string& entry : entries) {
+        std::string bytes = readFile(dir.path() + "/" + entry);
+        bytes[FORMAT_VERSION_OFFSET] = BinaryFile::FORMAT_VERSION - 1;
+        writeFile(dir.path() + "/" + entry, bytes);
+    }
+    DiskCacheStats stale = cache.getStats();
+    EvaluationCache::global().clear();
+    CHECK(volume(*parseCSG(csg)) == expected);
+    CHECK(cache.getStats().hits == stale.hits);
+    CHECK(cache.getStats().misses == stale.misses + 1);
+    CHECK(cache.getStats().stores == stale.stores + 1);
+    cache.setDirectory("");
+}
+
+// Threads storing the same key at once each write a file of their own
+static void testDiskCacheConcurrentStores() {
+    ScratchDirectory dir;
+    DiskCache cache;
+    cache.setDirectory(dir.path());
+    SolidPtr cube = globalUnitCube<real>();
+    std::vector<SurfaceT<real>> surfaces;
+    for (int i = 0; i < cube->size(); i++) surfaces.push_back((*cube)[i]);
+    Hash128 key = cube->getStructuralHash();
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; t++) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 20; i++) cache.store(key, surfaces);
+        });
+    }
+    for (std::thread& t : threads) t.join();
+    CHECK(cache.getStats().stores == 160);
+    CHECK(dir.files().size() == 1);
+
+    std::vector<SurfaceT<real>> loaded;
+    CHECK(cache.load(key, loaded));
+    CHECK(loaded.size() == surfaces.size());
+}
+
+// A ring buffer full of records drops the oldest whole, keeps the newest
+// intact where they wrap around its end, truncates what could never fit,
+// and saves what it keeps
+static void testTraceRingBuffer() {
+    // Records of 24 header bytes and 9 text bytes padded to 16 don't divide
+    // 256, so some of them straddle the end of the buffer
+    trace::RingBufferSink sink(256);
+    auto record = [](int i) {
+        trace::Record r;
+        r.nanoseconds = 1000 * i;
+        r.thread = i % 3;
+        r.category = trace::SLICE;
+        r.level = trace::DEBUG;
+        r.text = std::string("record ") + char('0' + i / 10) + char('0' + i % 10);
+        return r;
+    };
+    for (int i = 0; i < 20; i++) sink.write(record(i));
+    std::vector<trace::Record> kept = sink.records();
+    CHECK(kept.size() == 6);
+    CHECK(sink.droppedRecords() == 14);
+    for (size_t k = 0; k < kept.size(); k++) {
+        trace::Record expected = record(14 + k);
+        CHECK(kept[k].text == expected.text);
+        CHECK(kept[k].nanoseconds == expected.nanoseconds);
+        CHECK(kept[k].thread == expected.thread);
+        CHECK(kept[k].category == expected.category);
+        CHECK(kept[k].level == expected.level);
+    }
+    std::ostringstream dumped;
+    sink.dump(dumped);
+    CHECK(dumped.str().compare(0, 26, "(14 older records dropped)") == 0);
+
+    // Saved as the magic, the version, and each record's 24-byte header
+    // with its length at 16, followed by its text without padding
+    std::ostringstream saved;
+    sink.save(saved);
+    const std::string bytes = saved.str();
+    CHECK(bytes.size() == 8 + 6 * (24 + 9));
+    CHECK(bytes.compare(0, 4, "THTR") == 0);
+    uint32_t version, length;
+    std::memcpy(&version, &bytes[4], sizeof(version));
+    std::memcpy(&length, &bytes[8 + 16], sizeof(length));
+    CHECK(version == 1);
+    CHECK(length == 9);
+    CHECK(bytes.compare(8 + 24, 9, "record 14") == 0);
+    CHECK(bytes.compare(8 + 5 * (24 + 9) + 24, 9, "record 19") == 0);
+
+    // A record bigger than the buffer pushes out everything else and keeps
+    // as much of its text as fits
+    trace::Record huge = record(20);
+    huge.text = std::string(1000, 'x');
+    sink.write(huge);
+    kept = sink.records();
+    CHECK(kept.size() == 1);
+    CHECK(kept[0].text == std::string(256 - 24, 'x'));
+    CHECK(sink.droppedRecords() == 20);
+    sink.write(record(21));
+    kept = sink.records();
+    CHECK(kept.size() == 1 && kept[0].text == "record 21");
+
+    sink.clear();
+    CHECK(sink.records().empty());
+    CHECK(sink.droppedRecords() == 0);
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<std::pair<const char *, std::function<void()>>> tests = {
+        {"scalar_boundaries", testScalarBoundaries},
+        {"boolean_volumes", testBooleanVolumes},
+        {"slice_depth", testSliceDepth},
+        {"binary_round_trip", testBinaryRoundTrip},
+        {"binary_corrupt", testBinaryCorrupt},
+        {"mesh_round_trip", testMeshRoundTrip},
+        {"transform_inverses", testTransformInverses},
+        {"double_mirror", testDoubleMirror},
+        {"evaluation_cache", testEvaluationCache},
+        {"disk_cache", testDiskCache},
+        {"disk_cache_concurrent_stores", testDiskCacheConcurrentStores},
+        {"trace_ring_buffer", testTraceRingBuffer},
+    };
+    for (const auto& test : tests) {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; i++) selected = selected || !std::strcmp(argv[i], test.first);
+        if (!selected) continue;
+        int before = failures;
+        auto start = Clock::now();
+        try {
+            test.second();
+        } catch (const std::exception& e) {
+            std::cerr << test.first << ": threw " << e.what() << "\n";
+            failures++;
+        }
+        std::cout << (failures == before ? "pass " : "FAIL ") << test.first << " (" << secondsSince(start) << " s)\n";
+    }
+    return failures ? 1 : 0;
+}
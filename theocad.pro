@@ -0,0 +1,27 @@
+# Everything: the core library, the batch tool, the benchmarks, the tests and the visualizer
+TEMPLATE = subdirs
+
+core.file = theocad_core.pro
+core.makefile = Makefile.theocad_core
+
+batch.file = theocad_batch.pro
+batch.makefile = Makefile.theocad_batch
+batch.depends = core
+
+bench.file = bench_scalar.pro
+bench.makefile = Makefile.bench_scalar
+bench.depends = core
+
+kernel_bench.file = bench_kernel.pro
+kernel_bench.makefile = Makefile.bench_kernel
+kernel_bench.depends = core
+
+tests.file = test_kernel.pro
+tests.makefile = Makefile.test_kernel
+tests.depends = core
+
+visualizer.file = test_geometry.pro
+visualizer.makefile = Makefile.test_geometry
+visualizer.depends = core
+
+SUBDIRS = core batch bench kernel_bench tests visualizer
@@ -0,0 +1,119 @@
+#include "csg.hpp"
+#include "mesh_io.hpp"
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+
+/*
+Evaluate a CSG description without a GUI, for batch and server use:
+
+    theocad_batch [-s scalar] [-c cache] [-o output.obj|output.stl] input.csg
+
+The input is described in csg.hpp; "-" reads it from stdin. The scalar is
+one of the ScalarTraits names (boost_rational, rational, fixed, double) and
+defaults to rational. Timings go to stderr, so the mesh can go to stdout
+(as OBJ) when there's no -o. STL output is binary.
+
+With -c, the results of Booleans are kept in the given directory (see
+disk_cache.hpp), and later runs on the same subtrees load them instead.
+*/
+
+using namespace theocad;
+
+using Clock = std::chrono::steady_clock;
+
+static double millisecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+template <typename S>
+static void run(const std::string& text, const std::string& output, const std::string& cache) {
+    if (!cache.empty()) DiskCacheT<S>::global().setDirectory(cache);
+
+    auto start = Clock::now();
+    SolidPtrT<S> solid = parseCSG<S>(text);
+    double parse_ms = millisecondsSince(start);
+
+    // Evaluation is lazy, so walk every surface to force it
+    start = Clock::now();
+    int surfaces = solid->size();
+    int triangles = 0, vertices = 0;
+    for (int i = 0; i < surfaces; i++) {
+        triangles += (*solid)[i].size();
+        vertices += (*solid)[i].vertexCount();
+    }
+    double evaluate_ms = millisecondsSince(start);
+
+    start = Clock::now();
+    if (output.empty()) {
+        writeOBJ(STDOUT_FILENO, *solid);
+    } else {
+        writeMesh(output, *solid);
+    }
+    double write_ms = millisecondsSince(start);
+
+    std::cerr << "scalar " << ScalarTraits<S>::name() << ": " << surfaces << " surfaces, " << triangles << " triangles, " << vertices << " vertices\n";
+    std::cerr << "parse " << parse_ms << " ms, evaluate " << evaluate_ms << " ms, write " << write_ms << " ms\n";
+    if (!cache.empty()) {
+        DiskCacheStats stats = DiskCacheT<S>::global().getStats();
+        std::cerr << "cache " << stats.hits << " hits, " << stats.misses << " misses, " << stats.stores << " stored\n";
+    }
+}
+
+static int usage() {
+    std::cerr << "usage: theocad_batch [-s scalar] [-c cache] [-o output.obj|output.stl] input.csg\n";
+    return 2;
+}
+
+int main(int argc, char *argv[]) {
+    std::string scalar = "rational", output, cache, input;
+    for (int i = 1; i < argc; i++) {
+        if (!std::strcmp(argv[i], "-s") && i+1 < argc) {
+            scalar = argv[++i];
+        } else if (!std::strcmp(argv[i], "-c") && i+1 < argc) {
+            cache = argv[++i];
+        } else if (!std::strcmp(argv[i], "-o") && i+1 < argc) {
+            output = argv[++i];
+        } else if (input.empty() && (argv[i][0] != '-' || !std::strcmp(argv[i], "-"))) {
+            input = argv[i];
+        } else {
+            return usage();
+        }
+    }
+    if (input.empty()) return usage();
+
+    std::ostringstream text;
+    if (input == "-") {
+        text << std::cin.rdbuf();
+    } else {
+        std::ifstream is(input);
+        if (!is) {
+            std::cerr << "theocad_batch: can't read " << input << "\n";
+            return 1;
+        }
+        text << is.rdbuf();
+    }
+
+    try {
+        bool known = false;
+#define THEOCAD_RUN(S) \
+        if (scalar == ScalarTraits<S>::name()) { \
+            run<S>(text.str(), output, cache); \
+            known = true; \
+        }
+        THEOCAD_FOR_EACH_SCALAR(THEOCAD_RUN)
+#undef THEOCAD_RUN
+        if (!known) {
+            std::cerr << "theocad_batch: unknown scalar " << scalar << "\n";
+            return 2;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "theocad_batch: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
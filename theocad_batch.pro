@@ -0,0 +1,30 @@
+# Command line evaluation of CSG descriptions, linked against the core library
+TEMPLATE = app
+TARGET = theocad_batch
+CONFIG += console c++17 warn_on release thread
+CONFIG -= qt app_bundle
+
+# Compiler and linker settings
+QMAKE_CXX = clang++
+QMAKE_CXXFLAGS += -Wall -Wextra -O2
+
+# Include paths
+INCLUDEPATH += /usr/include \
+               /usr/local/include \
+               /opt/homebrew/Cellar/eigen/3.4.0_1/include \
+               /opt/homebrew/Cellar/boost/1.85.0/include
+
+# Library paths
+QMAKE_LFLAGS += -L/usr/lib \
+                -L/usr/local/lib \
+                -L/opt/homebrew/Cellar/boost/1.85.0/lib
+
+# Libraries to link
+LIBS += -L$$OUT_PWD -ltheocad_core -lboost_system
+PRE_TARGETDEPS += $$OUT_PWD/libtheocad_core.a
+
+# Source files
+SOURCES += theocad_batch.cpp
+
+# Clean
+QMAKE_CLEAN += $(OBJECTS) $(TARGET)
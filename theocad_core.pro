@@ -0,0 +1,61 @@
+# The geometry kernel as a static library, with no Qt, for headless use
+TEMPLATE = lib
+TARGET = theocad_core
+CONFIG += staticlib c++17 warn_on release thread
+CONFIG -= qt
+
+# Compiler and linker settings
+QMAKE_CXX = clang++
+QMAKE_CXXFLAGS += -Wall -Wextra -O2
+
+# Compile in the kernel's per-operation traces (see trace.hpp)
+# DEFINES += THEOCAD_TRACE_LEVEL=5
+
+# Include paths
+INCLUDEPATH += /usr/include \
+               /usr/local/include \
+               /opt/homebrew/Cellar/eigen/3.4.0_1/include \
+               /opt/homebrew/Cellar/boost/1.85.0/include
+
+# Source files
+SOURCES += binary_io.cpp \
+           bodies.cpp \
+           bvh.cpp \
+           csg.cpp \
+           geometry.cpp \
+           mesh_io.cpp \
+           triangle.cpp \
+           rational_circle.cpp \
+           rational.cpp \
+           threadpool.cpp \
+           trace.cpp \
+           transforms.cpp \
+           collections.cpp \
+           disk_cache.cpp \
+           evaluation_cache.cpp
+
+# Header files (optional, for clarity)
+HEADERS += binary_io.hpp \
+           checked_int.hpp \
+           dyadic.hpp \
+           bodies.hpp \
+           bvh.hpp \
+           csg.hpp \
+           fixed.hpp \
+           geometry.hpp \
+           interval.hpp \
+           mesh_io.hpp \
+           rational_circle.hpp \
+           rational.hpp \
+           scalar.hpp \
+           threadpool.hpp \
+           trace.hpp \
+           transforms.hpp \
+           collections.hpp \
+           disk_cache.hpp \
+           evaluation_cache.hpp \
+           structural_hash.hpp \
+           version.hpp
+
+# Clean
+QMAKE_CLEAN += $(OBJECTS) $(TARGET)
@@ -0,0 +1,158 @@
+#include "threadpool.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+
+namespace theocad {
+
+// Index of the calling thread's queue in the pool it works for, or -1
+static thread_local const ThreadPool *worker_pool = nullptr;
+static thread_local int worker_index = -1;
+
+// The cancellation flag of whatever the calling thread is working on
+static thread_local const std::atomic<bool> *cancel_flag = nullptr;
+
+CancelScope::CancelScope(const std::atomic<bool> *flag) : previous(cancel_flag) {
+    cancel_flag = flag;
+}
+
+CancelScope::~CancelScope() {
+    cancel_flag = previous;
+}
+
+void checkCancelled() {
+    if (cancel_flag && cancel_flag->load(std::memory_order_relaxed)) throw Cancelled();
+}
+
+ThreadPool::ThreadPool(int workers) {
+    if (workers < 0) workers = 0;
+    for (int i=0; i<=workers; i++) queues.push_back(std::make_unique<Queue>());
+    for (int i=0; i<workers; i++) threads.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& t : threads) t.join();
+}
+
+int ThreadPool::currentQueue() const {
+    if (worker_pool == this) return worker_index;
+    return queues.size() - 1;
+}
+
+void ThreadPool::push(Task task) {
+    Queue& q = *queues[currentQueue()];
+    {
+        std::lock_guard<std::mutex> lock(q.mutex);
+        q.tasks.push_back(std::move(task));
+    }
+    pending++;
+    {
+        // Taking the lock orders this against a worker deciding to sleep
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+    }
+    wake.notify_one();
+}
+
+bool ThreadPool::runOne() {
+    int self = currentQueue();
+    int n = queues.size();
+    Task task;
+    // Newest of our own tasks first, then the oldest of everyone else's
+    for (int k=0; k<n && !task; k++) {
+        Queue& q = *queues[(self + k) % n];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty()) continue;
+        if (k == 0) {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+        } else {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+        }
+    }
+    if (!task) return false;
+    pending--;
+    task();
+    return true;
+}
+
+void ThreadPool::workerLoop(int ix) {
+    worker_pool = this;
+    worker_index = ix;
+    for (;;) {
+        if (runOne()) continue;
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        wake.wait(lock, [this] { return stopping || pending > 0; });
+        if (stopping) return;
+    }
+}
+
+void ThreadPool::parallelFor(int n, const std::function<void(int)>& body) {
+    if (n <= 0) return;
+    if (threads.empty() || n == 1) {
+        for (int i=0; i<n; i++) body(i);
+        return;
+    }
+
+    // A few chunks per thread keeps everyone busy without drowning in tasks
+    int chunks = std::min(n, 4 * (workers() + 1));
+    std::atomic<int> remaining{chunks};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    const std::atomic<bool> *flag = cancel_flag;
+
+    for (int c=0; c<chunks; c++) {
+        int first = (long long)n * c / chunks;
+        int last = (long long)n * (c+1) / chunks;
+        push([&, first, last] {
+            CancelScope scope(flag);
+            try {
+                for (int i=first; i<last; i++) body(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) error = std::current_exception();
+            }
+            remaining--;
+        });
+    }
+
+    // Help out until our chunks are done
+    while (remaining > 0) {
+        if (!runOne()) std::this_thread::yield();
+    }
+    if (error) std::rethrow_exception(error);
+}
+
+ThreadPool& ThreadPool::global() {
+    static ThreadPool pool([] {
+        int threads = std::thread::hardware_concurrency();
+        if (const char *env = std::getenv("THEOCAD_THREADS")) threads = std::atoi(env);
+        return std::max(threads, 1) - 1;
+    }());
+    return pool;
+}
+
+static std::atomic<Execution> execution{Execution::PARALLEL};
+
+void setExecution(Execution e) {
+    execution = e;
+}
+
+Execution getExecution() {
+    return execution;
+}
+
+void parallelFor(int n, const std::function<void(int)>& body) {
+    if (execution == Execution::PARALLEL) {
+        ThreadPool::global().parallelFor(n, body);
+    } else {
+        for (int i=0; i<n; i++) body(i);
+    }
+}
+
+} // namespace theocad
@@ -0,0 +1,108 @@
+#ifndef INCLUDED_THREADPOOL_HPP
+#define INCLUDED_THREADPOOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+/*
+Work-stealing thread pool.
+
+Each worker has its own deque of tasks. A worker pushes and pops at the
+back of its own deque, and when that runs dry it steals from the front of
+the others'. Threads that aren't workers submit through an extra shared
+deque. A thread that waits on a parallelFor keeps running tasks until its
+own have finished, so parallelFor may be nested inside a task.
+*/
+
+namespace theocad {
+
+class ThreadPool {
+    using Task = std::function<void()>;
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    // One queue per worker, plus one last queue for outside threads
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+
+    std::atomic<int> pending{0};
+    std::atomic<bool> stopping{false};
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+
+    int currentQueue() const;
+    void push(Task task);
+    bool runOne();
+    void workerLoop(int ix);
+
+public:
+    // Start the given number of worker threads. With none, everything runs
+    // on the calling thread.
+    explicit ThreadPool(int workers);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int workers() const { return threads.size(); }
+
+    // Run body(i) for every i in [0, n) and return once they've all finished.
+    // The first exception thrown by body is rethrown here.
+    void parallelFor(int n, const std::function<void(int)>& body);
+
+    // Shared pool with a worker for every core but the caller's. Setting
+    // THEOCAD_THREADS in the environment overrides the number of cores.
+    static ThreadPool& global();
+};
+
+// Thrown by checkCancelled() once the current cancellation flag is set
+struct Cancelled : std::runtime_error {
+    Cancelled() : std::runtime_error("cancelled") {}
+};
+
+/*
+Cooperative cancellation. A CancelScope makes a flag current on the calling
+thread until it goes out of scope, and ThreadPool::parallelFor hands the
+current flag on to the tasks it runs. Long loops in the kernel call
+checkCancelled(), which throws Cancelled once the flag is set. Lazy results
+are only marked valid once they're complete, so a cancelled evaluation can
+simply be run again.
+*/
+class CancelScope {
+    const std::atomic<bool> *previous;
+
+public:
+    explicit CancelScope(const std::atomic<bool> *flag);
+    ~CancelScope();
+
+    CancelScope(const CancelScope&) = delete;
+    CancelScope& operator=(const CancelScope&) = delete;
+};
+
+void checkCancelled();
+
+enum class Execution {
+    SEQUENTIAL,
+    PARALLEL
+};
+
+// Whether slicing fans out across the global pool. Results are the same either way.
+void setExecution(Execution e);
+Execution getExecution();
+
+// ThreadPool::global().parallelFor in parallel mode, a plain loop otherwise
+void parallelFor(int n, const std::function<void(int)>& body);
+
+} // namespace theocad
+
+#endif
@@ -0,0 +1,192 @@
+#include "trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+namespace theocad {
+namespace trace {
+
+std::atomic<uint32_t> enabled_categories{0};
+std::atomic<int> enabled_level{NONE};
+
+static std::mutex sink_mutex;
+
+// Function-local so that traces from static initializers are safe
+static std::shared_ptr<Sink>& currentSink() {
+    static std::shared_ptr<Sink> sink = std::make_shared<StreamSink>(std::cerr);
+    return sink;
+}
+
+const char *categoryName(uint32_t category) {
+    switch (category) {
+    case GEOMETRY: return "geometry";
+    case SLICE: return "slice";
+    case BODIES: return "bodies";
+    case TRANSFORM: return "transform";
+    case COLLECTION: return "collection";
+    case VISUALIZER: return "visualizer";
+    case CACHE: return "cache";
+    default: return "?";
+    }
+}
+
+const char *levelName(int level) {
+    switch (level) {
+    case ERROR: return "error";
+    case WARN: return "warn";
+    case INFO: return "info";
+    case DEBUG: return "debug";
+    case VERBOSE: return "verbose";
+    default: return "?";
+    }
+}
+
+std::ostream& operator<<(std::ostream& os, const Record& r) {
+    os << '[' << r.nanoseconds / 1000 << "us t" << r.thread << ' ' << categoryName(r.category) << ' ' << levelName(r.level) << "] " << r.text;
+    return os;
+}
+
+void StreamSink::write(const Record& r) {
+    std::lock_guard<std::mutex> lock(mutex);
+    os << r << '\n';
+}
+
+RingBufferSink::RingBufferSink(size_t bytes) : buffer(std::max(bytes, recordSize(64))) {}
+
+void RingBufferSink::copyIn(size_t offset, const void *src, size_t n) {
+    offset %= buffer.size();
+    size_t first = std::min(n, buffer.size() - offset);
+    std::memcpy(&buffer[offset], src, first);
+    std::memcpy(&buffer[0], (const char *)src + first, n - first);
+}
+
+void RingBufferSink::copyOut(size_t offset, void *dst, size_t n) const {
+    offset %= buffer.size();
+    size_t first = std::min(n, buffer.size() - offset);
+    std::memcpy(dst, &buffer[offset], first);
+    std::memcpy((char *)dst + first, &buffer[0], n - first);
+}
+
+void RingBufferSink::write(const Record& r) {
+    // Truncate anything that could never fit
+    size_t length = std::min(r.text.size(), buffer.size() - sizeof(Header));
+    size_t size = recordSize(length);
+    if (size > buffer.size()) {
+        length = buffer.size() - sizeof(Header) - 7;
+        size = recordSize(length);
+    }
+
+    Header h = {};
+    h.nanoseconds = r.nanoseconds;
+    h.thread = r.thread;
+    h.category = r.category;
+    h.length = length;
+    h.level = r.level;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    // Make room by dropping the oldest records
+    while (used + size > buffer.size()) {
+        Header oldest;
+        copyOut(start, &oldest, sizeof(oldest));
+        size_t n = recordSize(oldest.length);
+        start = (start + n) % buffer.size();
+        used -= n;
+        dropped++;
+    }
+    size_t end = start + used;
+    copyIn(end, &h, sizeof(h));
+    copyIn(end + sizeof(h), r.text.data(), length);
+    used += size;
+}
+
+void RingBufferSink::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    start = used = 0;
+    dropped = 0;
+}
+
+uint64_t RingBufferSink::droppedRecords() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return dropped;
+}
+
+std::vector<Record> RingBufferSink::records() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<Record> result;
+    for (size_t offset = 0; offset < used; ) {
+        Header h;
+        copyOut(start + offset, &h, sizeof(h));
+        Record r;
+        r.nanoseconds = h.nanoseconds;
+        r.thread = h.thread;
+        r.category = h.category;
+        r.level = h.level;
+        r.text.resize(h.length);
+        copyOut(start + offset + sizeof(h), &r.text[0], h.length);
+        result.push_back(std::move(r));
+        offset += recordSize(h.length);
+    }
+    return result;
+}
+
+void RingBufferSink::dump(std::ostream& os) const {
+    uint64_t d = droppedRecords();
+    if (d) os << "(" << d << " older records dropped)\n";
+    for (const Record& r : records()) os << r << '\n';
+}
+
+void RingBufferSink::save(std::ostream& os) const {
+    const uint32_t version = 1;
+    os.write("THTR", 4);
+    os.write((const char *)&version, sizeof(version));
+    for (const Record& r : records()) {
+        Header h = {};
+        h.nanoseconds = r.nanoseconds;
+        h.thread = r.thread;
+        h.category = r.category;
+        h.length = r.text.size();
+        h.level = r.level;
+        os.write((const char *)&h, sizeof(h));
+        os.write(r.text.data(), r.text.size());
+    }
+}
+
+void setSink(std::shared_ptr<Sink> sink) {
+    std::lock_guard<std::mutex> lock(sink_mutex);
+    currentSink() = sink;
+}
+
+std::shared_ptr<Sink> getSink() {
+    std::lock_guard<std::mutex> lock(sink_mutex);
+    return currentSink();
+}
+
+void enable(uint32_t categories, Level level) {
+    enabled_categories = categories;
+    enabled_level = level;
+}
+
+void disable() {
+    enable(0, NONE);
+}
+
+static uint32_t threadNumber() {
+    static std::atomic<uint32_t> next{0};
+    static thread_local uint32_t number = next++;
+    return number;
+}
+
+Message::~Message() {
+    std::shared_ptr<Sink> sink = getSink();
+    if (!sink) return;
+    Record r;
+    r.nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    r.thread = threadNumber();
+    r.category = category;
+    r.level = level;
+    r.text = os.str();
+    sink->write(r);
+}
+
+} // namespace trace
+} // namespace theocad
@@ -0,0 +1,176 @@
+#ifndef INCLUDED_TRACE_HPP
+#define INCLUDED_TRACE_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <atomic>
+
+/*
+Diagnostic tracing with categories and levels.
+
+    THEOCAD_TRACE(SLICE, DEBUG, "Slicing " << p << " by " << q);
+
+Trace points above THEOCAD_TRACE_LEVEL are compiled out entirely. The rest
+cost one branch unless their category and level have been enabled at run
+time with trace::enable, and only then is the message formatted and
+handed to the current sink. Nothing is enabled by default, so the default
+path does no formatting and no I/O.
+
+Two sinks are provided: StreamSink writes text to a stream as it goes, and
+RingBufferSink keeps the most recent records in memory in a compact binary
+form, to be dumped or saved when something goes wrong.
+*/
+
+#define THEOCAD_TRACE_NONE 0
+#define THEOCAD_TRACE_ERROR 1
+#define THEOCAD_TRACE_WARN 2
+#define THEOCAD_TRACE_INFO 3
+#define THEOCAD_TRACE_DEBUG 4
+#define THEOCAD_TRACE_VERBOSE 5
+
+// Most detailed level compiled in. The kernel's per-operation traces are
+// DEBUG and VERBOSE, so by default they don't exist.
+#ifndef THEOCAD_TRACE_LEVEL
+#define THEOCAD_TRACE_LEVEL THEOCAD_TRACE_INFO
+#endif
+
+#define THEOCAD_TRACE(category, level, message) \
+    do { \
+        if (THEOCAD_TRACE_##level <= THEOCAD_TRACE_LEVEL && \
+            ::theocad::trace::enabled(::theocad::trace::category, ::theocad::trace::Level(THEOCAD_TRACE_##level))) { \
+            ::theocad::trace::Message trace_message_(::theocad::trace::category, ::theocad::trace::Level(THEOCAD_TRACE_##level)); \
+            trace_message_.stream() << message; \
+        } \
+    } while (0)
+
+namespace theocad {
+namespace trace {
+
+enum Category : uint32_t {
+    GEOMETRY   = 1 << 0, // Planes, lines and their intersections
+    SLICE      = 1 << 1, // Cutting triangles by triangles
+    BODIES     = 1 << 2, // Surfaces, solids and primitives
+    TRANSFORM  = 1 << 3,
+    COLLECTION = 1 << 4, // Collections and Booleans
+    VISUALIZER = 1 << 5,
+    CACHE      = 1 << 6, // Sharing evaluated subtrees
+    ALL        = ~0u
+};
+
+enum Level : uint8_t {
+    NONE = THEOCAD_TRACE_NONE,
+    ERROR = THEOCAD_TRACE_ERROR,
+    WARN = THEOCAD_TRACE_WARN,
+    INFO = THEOCAD_TRACE_INFO,
+    DEBUG = THEOCAD_TRACE_DEBUG,
+    VERBOSE = THEOCAD_TRACE_VERBOSE
+};
+
+const char *categoryName(uint32_t category);
+const char *levelName(int level);
+
+struct Record {
+    uint64_t nanoseconds; // Since the epoch of the steady clock
+    uint32_t thread;      // Small per-process thread number
+    uint32_t category;
+    uint8_t level;
+    std::string text;
+};
+
+std::ostream& operator<<(std::ostream& os, const Record& r);
+
+class Sink {
+public:
+    virtual ~Sink() {}
+    virtual void write(const Record& r) = 0;
+};
+
+// Writes each record as a line of text
+class StreamSink : public Sink {
+    std::ostream& os;
+    std::mutex mutex;
+
+public:
+    StreamSink(std::ostream& os_in = std::cerr) : os(os_in) {}
+    void write(const Record& r) override;
+};
+
+// Keeps the most recent records in a fixed-size circular byte buffer,
+// dropping the oldest when it fills
+class RingBufferSink : public Sink {
+    // Each record is stored as this header followed by the text, padded to
+    // a multiple of 8 bytes
+    struct Header {
+        uint64_t nanoseconds;
+        uint32_t thread;
+        uint32_t category;
+        uint32_t length;
+        uint8_t level;
+        uint8_t pad[3];
+    };
+
+    std::vector<char> buffer;
+    size_t start = 0; // Offset of the oldest record
+    size_t used = 0;
+    uint64_t dropped = 0;
+    mutable std::mutex mutex;
+
+    static size_t recordSize(size_t length) { return sizeof(Header) + ((length + 7) & ~size_t(7)); }
+    void copyIn(size_t offset, const void *src, size_t n);
+    void copyOut(size_t offset, void *dst, size_t n) const;
+
+public:
+    explicit RingBufferSink(size_t bytes = 1 << 20);
+
+    void write(const Record& r) override;
+    void clear();
+
+    // Records dropped to make room since the last clear
+    uint64_t droppedRecords() const;
+
+    std::vector<Record> records() const;
+    void dump(std::ostream& os) const;
+
+    // Save the retained records in binary form. The file is "THTR", a
+    // 32-bit format version, and then each record's header and text.
+    void save(std::ostream& os) const;
+};
+
+// The sink starts out as a StreamSink on std::cerr
+void setSink(std::shared_ptr<Sink> sink);
+std::shared_ptr<Sink> getSink();
+
+// Enable the given categories up to the given level, replacing the previous settings
+void enable(uint32_t categories, Level level);
+void disable();
+
+extern std::atomic<uint32_t> enabled_categories;
+extern std::atomic<int> enabled_level;
+
+inline bool enabled(uint32_t category, Level level) {
+    return level <= enabled_level.load(std::memory_order_relaxed) &&
+           (enabled_categories.load(std::memory_order_relaxed) & category);
+}
+
+// Collects one message and hands it to the sink when it goes out of scope
+class Message {
+    uint32_t category;
+    Level level;
+    std::ostringstream os;
+
+public:
+    Message(uint32_t c, Level l) : category(c), level(l) {}
+    ~Message();
+    std::ostream& stream() { return os; }
+};
+
+} // namespace trace
+} // namespace theocad
+
+#endif
@@ -1,98 +1,167 @@
 #include "transforms.hpp"
+#include <cmath>
 #include <iostream>
 #include "rational_circle.hpp"
+#include "threadpool.hpp"
+#include <stdexcept>
 
 namespace theocad {
     
-void Transform::compute_inverse() {
-    // LU decomposition
-    Matrix4r L, U;
-    L.setIdentity();
-    U = affine;
-
-    for (int i = 0; i < 4; ++i) {
-        for (int j = i; j < 4; ++j) {
-            L(j, i) = U(j, i);
-            for (int k = 0; k < i; ++k) {
-                L(j, i) -= L(j, k) * U(k, i);
-            }
+// Translates, scales and rotations, alone or composed, all make affine
+// matrices. Invert those in closed form: the inverse l^-1 of the linear
+// part, and the translation -l^-1 t
+template <typename S>
+static void invertAffine(const Matrix4<S>& m, Matrix4<S>& inverse) {
+    S l[3][3], r[3][3];
+    bool identity = true, diagonal = true, orthonormal = true;
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            l[i][j] = m(i, j);
+            if (i != j && !isZero(l[i][j])) identity = diagonal = false;
         }
-        for (int j = i + 1; j < 4; ++j) {
-            U(i, j) /= L(i, i);
-            for (int k = 0; k < i; ++k) {
-                U(i, j) -= L(i, k) * U(k, j) / L(i, i);
+        if (!nearlyEqual(l[i][i], S(1))) identity = false;
+    }
+    // The columns of a rotation are orthogonal unit vectors
+    for (int i = 0; i < 3 && !diagonal && orthonormal; ++i) {
+        for (int j = i; j < 3; ++j) {
+            S dot = l[0][i]*l[0][j] + l[1][i]*l[1][j] + l[2][i]*l[2][j];
+            if (!nearlyEqual(dot, S(i == j ? 1 : 0))) {
+                orthonormal = false;
+                break;
             }
         }
     }
 
-    // Compute inverse using forward and backward substitution
-    Matrix4r invL, invU;
-    invL.setIdentity();
-    invU.setIdentity();
-
-    for (int i = 0; i < 4; ++i) {
-        for (int j = 0; j < i; ++j) {
-            real sum = 0;
-            for (int k = j; k < i; ++k) {
-                sum += L(i, k) * invL(k, j);
+    if (identity) {
+        // Translation
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) r[i][j] = S(i == j ? 1 : 0);
+        }
+    } else if (diagonal) {
+        // Scale
+        for (int i = 0; i < 3; ++i) {
+            if (isZero(l[i][i])) throw std::runtime_error("transform can't be inverted");
+            for (int j = 0; j < 3; ++j) r[i][j] = i == j ? S(1) / l[i][i] : S(0);
+        }
+    } else if (orthonormal) {
+        // Rotation
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) r[i][j] = l[j][i];
+        }
+    } else {
+        // Adjugate over determinant
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                int i1 = (j + 1) % 3, i2 = (j + 2) % 3, j1 = (i + 1) % 3, j2 = (i + 2) % 3;
+                r[i][j] = l[i1][j1] * l[i2][j2] - l[i1][j2] * l[i2][j1];
             }
-            invL(i, j) = -sum / L(i, i);
+        }
+        S det = l[0][0] * r[0][0] + l[0][1] * r[1][0] + l[0][2] * r[2][0];
+        if (isZero(det)) throw std::runtime_error("transform can't be inverted");
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) r[i][j] /= det;
         }
     }
 
-    for (int i = 3; i >= 0; --i) {
-        for (int j = 3; j > i; --j) {
-            real sum = 0;
-            for (int k = i + 1; k <= j; ++k) {
-                sum += U(i, k) * invU(k, j);
-            }
-            invU(i, j) = -sum;
+    inverse.setIdentity();
+    for (int i = 0; i < 3; ++i) {
+        S shift = 0;
+        for (int j = 0; j < 3; ++j) {
+            inverse(i, j) = r[i][j];
+            shift -= r[i][j] * m(j, 3);
         }
-        invU(i, i) = real(1) / U(i, i);
+        inverse(i, 3) = shift;
     }
-
-    inverse = invU * invL;
 }
 
-void Transform::transform_child() {
-    surfaces.clear();
-
-    if (!child) {
+template <typename S>
+void TransformT<S>::compute_inverse() {
+    const Matrix4<S>& m = getAffine();
+    if (isAffine(m)) {
+        invertAffine(m, inverse);
+        inverse_affine = AffineT<S>(inverse);
         return;
     }
+    inverse_affine.reset();
+
+    // Anything else goes through Gauss-Jordan elimination, pivoting on the
+    // largest entry left in each column
+    Matrix4<S> a = m;
+    inverse.setIdentity();
+    for (int c = 0; c < 4; ++c) {
+        int pivot = c;
+        for (int r = c + 1; r < 4; ++r) {
+            if (std::abs(ScalarTraits<S>::toDouble(a(r, c))) > std::abs(ScalarTraits<S>::toDouble(a(pivot, c)))) pivot = r;
+        }
+        if (isZero(a(pivot, c))) throw std::runtime_error("transform can't be inverted");
+        a.row(c).swap(a.row(pivot));
+        inverse.row(c).swap(inverse.row(pivot));
+
+        S scale = S(1) / a(c, c);
+        for (int j = 0; j < 4; ++j) {
+            a(c, j) *= scale;
+            inverse(c, j) *= scale;
+        }
+        for (int r = 0; r < 4; ++r) {
+            S f = a(r, c);
+            if (r == c || f == S(0)) continue;
+            for (int j = 0; j < 4; ++j) {
+                a(r, j) -= f * a(c, j);
+                inverse(r, j) -= f * inverse(c, j);
+            }
+        }
+    }
+}
 
-    for (int i = 0; i < child->size(); ++i) {
-        printf("Child surface\n");
-        const Surface& childSurface = (*child)[i];
-        Surface& newSurface = allocateSurface();
+template <typename S>
+void TransformT<S>::transform_child() {
+    this->surfaces.clear();
+
+    // A chain of transforms is folded into one matrix, so the transforms in
+    // between never have to be evaluated
+    Matrix4<S> m = getAffine();
+    SolidPtrT<S> source = child;
+    while (auto transform = std::dynamic_pointer_cast<TransformT<S>>(source)) {
+        m = m * transform->getAffine();
+        source = transform->getChild();
+    }
 
-        for (int j = 0; j < childSurface.size(); ++j) {
-            printf("Child triangle\n");
-            const Triangle& childTriangle = childSurface[j];
-            Triangle& newTriangle = newSurface.allocateTriangle();
+    if (!source) {
+        return;
+    }
 
-            for (int k = 0; k < 3; ++k) {
-                Vector4r transformedPoint = affine * childTriangle[k];
-                std::cout << "Transformed " << childTriangle[k] << " to " << transformedPoint << std::endl;
-                newTriangle.modifyPoint(k) = transformedPoint;
-            }
+    // The matrix is prepared once for all the surfaces
+    if (isAffine(m)) {
+        AffineT<S> kernel(m);
+        for (int i = 0; i < source->size(); ++i) {
+            THEOCAD_TRACE(TRANSFORM, VERBOSE, "Child surface");
+            checkCancelled();
+            this->allocateSurface().setTransformed((*source)[i], kernel);
         }
+        return;
+    }
+
+    for (int i = 0; i < source->size(); ++i) {
+        THEOCAD_TRACE(TRANSFORM, VERBOSE, "Child surface");
+        checkCancelled();
+        this->allocateSurface().setTransformed((*source)[i], m);
     }
 }
 
-void Rotate::compute_affine() {
+template <typename S>
+void RotateT<S>::compute_affine() {
     // Assume the axis is already normalized
 
     // Get rational approximation of sin and cos
     FIII rational_angle = find_rational_angle(angle);
-    real cos_theta(rational_angle.c, rational_angle.d); // cos = run / hypotenuse
-    real sin_theta(rational_angle.b, rational_angle.d); // sin = rise / hypotenuse
+    S cos_theta = ScalarTraits<S>::fraction(rational_angle.c, rational_angle.d); // cos = run / hypotenuse
+    S sin_theta = ScalarTraits<S>::fraction(rational_angle.b, rational_angle.d); // sin = rise / hypotenuse
 
     // Compute rotation matrix using Rodrigues' rotation formula
-    Matrix4r& rot = modifyAffine();
+    Matrix4<S>& rot = this->setAffine();
     rot.setIdentity();
 
-    real one_minus_cos = real(1) - cos_theta;
+    S one_minus_cos = S(1) - cos_theta;
 
     for (int i = 0; i < 3; ++i) {
         for (int j = 0; j < 3; ++j) {
@@ -100,12 +169,30 @@ void Rotate::compute_affine() {
                 rot(i, i) = cos_theta + axis[i] * axis[i] * one_minus_cos;
             } else {
                 int k = 3 - i - j; // Third index (0, 1, or 2)
-                real v = axis[i] * axis[j] * one_minus_cos;
-                real s = axis[k] * sin_theta;
-                rot(i, j) = v + ((i - j + 4) % 3 - 1) * s; // +s if (i,j) is (0,1), (1,2), or (2,0), else -s
+                S v = axis[i] * axis[j] * one_minus_cos;
+                S s = axis[k] * sin_theta;
+                rot(i, j) = v + S((i - j + 4) % 3 - 1) * s; // +s if (i,j) is (0,1), (1,2), or (2,0), else -s
             }
         }
     }
 }
 
+// Every kind of transform comes down to its matrix
+template <typename S>
+void TransformT<S>::hashStructure(StructuralHasher& h) const {
+    const Matrix4<S>& m = getAffine();
+    h.add("transform");
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) h.add(m(i, j));
+    }
+    h.add(child ? child->getStructuralHash() : Hash128());
+}
+
+#define THEOCAD_INSTANTIATE_TRANSFORMS(S) \
+    template class TransformT<S>; \
+    template class RotateT<S>; \
+    template class TranslateT<S>; \
+    template class ScaleT<S>;
+THEOCAD_FOR_EACH_SCALAR(THEOCAD_INSTANTIATE_TRANSFORMS)
+
 }
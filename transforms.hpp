@@ -2,123 +2,151 @@
 #define INCLUDED_TRANSFORMS_HPP
 
 #include "bodies.hpp"
+#include "evaluation_cache.hpp"
+#include <optional>
 
 namespace theocad {
 
-class Transform : public Solid {
+template <typename S>
+class TransformT : public SolidT<S> {
 protected:
-    SolidPtr child;
-    Matrix4r affine, inverse;
+    SolidPtrT<S> child;
+    Matrix4<S> affine, inverse;
     bool inverse_valid = false;
-    bool cache_valid = false;
+    // The inverse prepared for transforming points, if it's affine
+    std::optional<AffineT<S>> inverse_affine = AffineT<S>();
+    // The version that the surfaces were computed at
+    uint64_t cache_version = 0;
 
     void compute_inverse();
     void transform_child();
 
+    virtual uint64_t childrenVersion() const { return child ? child->getVersion() : 0; }
+    virtual void hashStructure(StructuralHasher& h) const;
+
+    // For subclasses that compute the matrix from their parameters
+    Matrix4<S>& setAffine() {
+        inverse_valid = false;
+        return affine;
+    }
+
 public:
-    Transform() {
+    TransformT() {
         affine.setIdentity();
         inverse.setIdentity();
         inverse_valid = true;
     }
-    virtual ~Transform() {}
+    virtual ~TransformT() {}
 
-    virtual const Matrix4r& getAffine() const { return affine; }
-    Matrix4r& modifyAffine() { 
-        inverse_valid = false;
-        cache_valid = false;
-        return affine;
+    virtual const Matrix4<S>& getAffine() const { return affine; }
+    Matrix4<S>& modifyAffine() { 
+        this->touch();
+        return setAffine();
     }
 
-    const Matrix4r& getInverse() const {
+    const Matrix4<S>& getInverse() const {
+        // Bringing the matrix up to date may invalidate the inverse
+        getAffine();
         if (!inverse_valid) {
-            Transform& self(const_cast<Transform&>(*this));
+            TransformT& self(const_cast<TransformT&>(*this));
             self.compute_inverse();
             self.inverse_valid = true;
         }
         return inverse;
     }
 
-    const SolidPtr& getChild() const { return child; }
-    SolidPtr& modifyChild() { 
-        cache_valid = false;
+    const SolidPtrT<S>& getChild() const { return child; }
+    SolidPtrT<S>& modifyChild() { 
+        this->touch();
         return child; 
     }
-    void setChild(SolidPtr p) {
-        cache_valid = false;
+    void setChild(SolidPtrT<S> p) {
+        this->touch();
         child = p;
     }
 
     void check_cache() const {
-        if (!cache_valid) {
-            Transform& self(const_cast<Transform&>(*this));
-            self.transform_child();
-            self.cache_valid = true;
+        uint64_t current = this->getVersion();
+        if (cache_version != current) {
+            TransformT& self(const_cast<TransformT&>(*this));
+            EvaluationCacheT<S>::global().evaluate(this->getStructuralHash(), self.surfaces, [&self] {
+                self.transform_child();
+            });
+            self.cache_version = current;
         }
     }
 
     virtual int size() const { 
         check_cache();
-        return Solid::size(); 
+        return SolidT<S>::size(); 
     }
 
-    virtual const Surface& operator[](int ix) const {
+    virtual const SurfaceT<S>& operator[](int ix) const {
         check_cache();
-        return surfaces[ix];
+        return this->surfaces[ix];
     }
     
-    virtual bool inside(const Vector4r& p);
+    virtual bool inside(const Vector4<S>& p);
 };
 
-class Rotate : public Transform {
+template <typename S>
+class RotateT : public TransformT<S> {
 protected:
     bool affine_valid = false;
-    Vector4r axis;
+    Vector4<S> axis;
     float angle;
 
     void compute_affine();
 
 public:
-    virtual ~Rotate() {}
+    virtual ~RotateT() {}
 
-    float getAngle() { return angle; }
-    const Vector4r& getAxis() { return axis; }
+    float getAngle() const { return angle; }
+    const Vector4<S>& getAxis() const { return axis; }
 
     void setAngle(float a) {
+        this->touch();
         angle = a;
         affine_valid = false;
     }
-    Vector4r& modifyAxis() { 
+    Vector4<S>& modifyAxis() { 
+        this->touch();
         affine_valid = false;
         return axis;
     }
 
     void check_affine() const {
-        if (!cache_valid) {
-            Rotate& self(const_cast<Rotate&>(*this));
+        if (!affine_valid) {
+            RotateT& self(const_cast<RotateT&>(*this));
             self.compute_affine();
             self.affine_valid = true;
         }
     }
 
+    virtual const Matrix4<S>& getAffine() const {
+        check_affine();
+        return this->affine;
+    }
+
     virtual int size() const { 
         check_affine();
-        return Transform::size(); 
+        return TransformT<S>::size(); 
     }
 
-    virtual const Surface& operator[](int ix) const {
+    virtual const SurfaceT<S>& operator[](int ix) const {
         check_affine();
-        return Transform::operator[](ix);
+        return TransformT<S>::operator[](ix);
     }    
 };
 
-class Translate : public Transform {
+template <typename S>
+class TranslateT : public TransformT<S> {
 protected:
-    Vector4r shift;
+    Vector4<S> shift;
     bool affine_valid = false;
 
     void compute_affine() {
-        Matrix4r& trans = modifyAffine();
+        Matrix4<S>& trans = this->setAffine();
         trans.setIdentity();
         trans(0, 3) = shift[0];
         trans(1, 3) = shift[1];
@@ -133,40 +161,48 @@ protected:
     }
 
 public:
-    Translate(const Vector4r& s = Point(0, 0, 0)) : shift(s) {}
+    TranslateT(const Vector4<S>& s = PointT<S>(0, 0, 0)) : shift(s) {}
 
-    virtual ~Translate() {}
+    virtual ~TranslateT() {}
 
-    const Vector4r& getShift() const { return shift; }
+    const Vector4<S>& getShift() const { return shift; }
 
-    void setShift(const Vector4r& s) {
+    void setShift(const Vector4<S>& s) {
+        this->touch();
         shift = s;
         affine_valid = false;
     }
 
-    Vector4r& modifyShift() {
+    Vector4<S>& modifyShift() {
+        this->touch();
         affine_valid = false;
         return shift;
     }
 
+    virtual const Matrix4<S>& getAffine() const {
+        const_cast<TranslateT*>(this)->check_affine();
+        return this->affine;
+    }
+
     virtual int size() const { 
-        const_cast<Translate*>(this)->check_affine();
-        return Transform::size(); 
+        const_cast<TranslateT*>(this)->check_affine();
+        return TransformT<S>::size(); 
     }
 
-    virtual const Surface& operator[](int ix) const {
-        const_cast<Translate*>(this)->check_affine();
-        return Transform::operator[](ix);
+    virtual const SurfaceT<S>& operator[](int ix) const {
+        const_cast<TranslateT*>(this)->check_affine();
+        return TransformT<S>::operator[](ix);
     }
 };
 
-class Scale : public Transform {
+template <typename S>
+class ScaleT : public TransformT<S> {
 protected:
-    Vector4r factors;
+    Vector4<S> factors;
     bool affine_valid = false;
 
     void compute_affine() {
-        Matrix4r& scale = modifyAffine();
+        Matrix4<S>& scale = this->setAffine();
         scale.setIdentity();
         scale(0, 0) = factors[0];
         scale(1, 1) = factors[1];
@@ -175,18 +211,20 @@ protected:
     }
 
 public:
-    Scale(const Vector4r& f = Vector(1, 1, 1)) : factors(f) {}
+    ScaleT(const Vector4<S>& f = VectorT<S>(1, 1, 1)) : factors(f) {}
 
-    virtual ~Scale() {}
+    virtual ~ScaleT() {}
 
-    const Vector4r& getFactors() const { return factors; }
+    const Vector4<S>& getFactors() const { return factors; }
 
-    void setFactors(const Vector4r& f) {
+    void setFactors(const Vector4<S>& f) {
+        this->touch();
         factors = f;
         affine_valid = false;
     }
 
-    Vector4r& modifyFactors() {
+    Vector4<S>& modifyFactors() {
+        this->touch();
         affine_valid = false;
         return factors;
     }
@@ -197,17 +235,27 @@ public:
         }
     }
 
+    virtual const Matrix4<S>& getAffine() const {
+        const_cast<ScaleT*>(this)->check_affine();
+        return this->affine;
+    }
+
     virtual int size() const { 
-        const_cast<Scale*>(this)->check_affine();
-        return Transform::size(); 
+        const_cast<ScaleT*>(this)->check_affine();
+        return TransformT<S>::size(); 
     }
 
-    virtual const Surface& operator[](int ix) const {
-        const_cast<Scale*>(this)->check_affine();
-        return Transform::operator[](ix);
+    virtual const SurfaceT<S>& operator[](int ix) const {
+        const_cast<ScaleT*>(this)->check_affine();
+        return TransformT<S>::operator[](ix);
     }
 };
 
+using Transform = TransformT<real>;
+using Rotate = RotateT<real>;
+using Translate = TranslateT<real>;
+using Scale = ScaleT<real>;
+
 } // namespace theocad
 
 #endif
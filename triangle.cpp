@@ -1,254 +1,247 @@
 
 #include "geometry.hpp"
+#include "bvh.hpp"
+#include "threadpool.hpp"
+#include <algorithm>
 #include <iostream>
 
 namespace theocad {
 
+// Signs of the three points relative to a plane, tallied
+struct VertexSigns {
+    Sign s[3];
+    int positive = 0, negative = 0;
 
-bool cutTriangleByPlane(const Triangle& p, LineIntersection *p_plane_intersections, std::vector<Triangle>& result) {
-    // Check for plane_intersection being parallel to sides of p
-    for (int i=0; i<3; i++) {
-        int j = (i+2)%3;
-        // End of one edge and start of the second edge after
-        if (p_plane_intersections[i].exists && p_plane_intersections[j].exists && p_plane_intersections[i].t[0] == 1 && p_plane_intersections[j].t[0] == 0) return false;
-    }
-    
-    // Now that we have all the interesections of plane_intersection with p, we can cut up p into pieces
-    
-    // Look for cases where the line cuts through a corner and also the opposite side
-    for (int i=0; i<3; i++) {
-        int j = (i+1)%3;
-        int k = (i+2)%3;
-        // Check to see if we're at the end of line i and the start of the next line (j) and also that the third side (k) is cut
-        if (p_plane_intersections[i].exists && p_plane_intersections[j].exists && p_plane_intersections[k].exists && p_plane_intersections[i].t[0] == 1 && p_plane_intersections[j].t[0] == 0 && p_plane_intersections[k].inside_line[0]) {
-            // Get the intersection point of the third side (k)
-            Vector4r extra = p_plane_intersections[k].point[0];
-            Triangle t1(p[j], p[k], extra);
-            Triangle t2(extra, p[i], p[j]);
-            if (t1.isValid()) result.push_back(t1);
-            if (t2.isValid()) result.push_back(t2);
-            return true;
+    template <typename S>
+    VertexSigns(const PlaneT<S>& plane, const TriangleT<S>& t) {
+        for (int i=0; i<3; i++) {
+            s[i] = plane.side(t[i]);
+            if (s[i] == Sign::POSITIVE) positive++;
+            if (s[i] == Sign::NEGATIVE) negative++;
         }
     }
-    
-    // At this point, the interesection line must cut through two of the triangle edges    
-    for (int i=0; i<3; i++) {
-        int j = (i+1)%3;
-        //int k = (i+2)%3;
-        if (p_plane_intersections[i].exists && p_plane_intersections[j].exists && p_plane_intersections[i].inside_line[0] && p_plane_intersections[j].inside_line[0]) {
-            std::cout << "Cuts two i=" << i << " j=" << j << "\n";
-            Triangle t1(p_plane_intersections[i].point[0], p[1], p_plane_intersections[j].point[0]);
-            Triangle t2(p[0], p_plane_intersections[i].point[0], p_plane_intersections[j].point[0]);
-            Triangle t3(p[0], p_plane_intersections[j].point[0], p[2]);
-            if (t1.isValid()) result.push_back(t1);
-            if (t2.isValid()) result.push_back(t2);
-            if (t3.isValid()) result.push_back(t3);
-            return true;
-        }
-    }
-    
-    // Shouldn't get here
-    // throw std::runtime_error("cut fail");
-    std::cout << "All triangle cut cases failed\n";
-    return false;
+
+    // True if there are points strictly on both sides
+    bool straddles() const { return positive && negative; }
+};
+
+// Where the edge from u to v crosses the plane, given that u and v are strictly on opposite sides of it
+template <typename S>
+static Vector4<S> edgePlaneCrossing(const PlaneT<S>& plane, const Vector4<S>& u, const Vector4<S>& v) {
+    S du = plane.signedDistanceNumerator(u);
+    S dv = plane.signedDistanceNumerator(v);
+    return u + (du / (du - dv)) * (v - u);
 }
 
-bool sliceTriangleByEdge(const Triangle& p, const Line& q_edge, std::vector<Triangle>& result) {
-    
-    std::cout << "Cutting " << p << " with " << q_edge << std::endl;
-    
-    // Look for places where p it interesected by an edge of q
-    LineIntersection p_plane_intersections[3];
-    bool plane_intersects_p = false;
-    for (int i=0; i<3; i++) {
-        Line p_edge = p.getEdge(i);
-        LineIntersection& inter(p_plane_intersections[i]);
-        inter = lineIntersection(p_edge, q_edge);
-        // TODO add sanity check
-        if (inter.exists && inter.inside_line[0]) plane_intersects_p = true;
-    }
-    if (!plane_intersects_p) {
-        // Add p to result
-        return false;
+/*
+A triangle is sliced as a convex polygon, its corners in order, which is
+only cut into triangles once every cutter has had its turn. Every edge of a
+piece then lies on an edge of the original triangle or on a cutting plane,
+so every corner is where p's plane meets two of those planes. The size of
+an exact corner depends only on the planes it's on, however many cuts came
+before it. Cutting triangles instead would put diagonals between the
+corners, and corners made on those would grow with every cut.
+*/
+template <typename S>
+using PolygonT = std::vector<Vector4<S>>;
+
+// Signs of a polygon's corners relative to a plane, tallied
+struct CornerSigns {
+    std::vector<Sign> s;
+    int positive = 0, negative = 0;
+
+    template <typename S>
+    void classify(const PlaneT<S>& plane, const PolygonT<S>& corners) {
+        s.resize(corners.size());
+        positive = negative = 0;
+        for (size_t i=0; i<corners.size(); i++) {
+            s[i] = plane.side(corners[i]);
+            if (s[i] == Sign::POSITIVE) positive++;
+            if (s[i] == Sign::NEGATIVE) negative++;
+        }
     }
 
-    // Check for plane_intersection being parallel to sides of p
-    for (int i=0; i<3; i++) {
-        int j = (i+2)%3;
-        // End of one edge and start of the second edge after
-        if (p_plane_intersections[i].exists && p_plane_intersections[j].exists && p_plane_intersections[i].t[0] == 1 && p_plane_intersections[j].t[0] == 0) return false;
+    // True if there are corners strictly on both sides
+    bool straddles() const { return positive && negative; }
+};
+
+// Split a polygon in two where it crosses the plane, given the signs of its
+// corners relative to it, which have to straddle it. Corners on the plane go
+// to both halves.
+template <typename S>
+static void splitPolygonByPlane(const PolygonT<S>& p, const CornerSigns& p_signs, const PlaneT<S>& plane, std::vector<PolygonT<S>>& result) {
+    PolygonT<S> above, below;
+    size_t n = p.size();
+    for (size_t i=0; i<n; i++) {
+        size_t j = (i+1) % n;
+        Sign si = p_signs.s[i], sj = p_signs.s[j];
+        if (si != Sign::NEGATIVE) above.push_back(p[i]);
+        if (si != Sign::POSITIVE) below.push_back(p[i]);
+        if ((si == Sign::POSITIVE && sj == Sign::NEGATIVE) || (si == Sign::NEGATIVE && sj == Sign::POSITIVE)) {
+            Vector4<S> c = edgePlaneCrossing(plane, p[i], p[j]);
+            above.push_back(c);
+            below.push_back(c);
+        }
     }
-    
-    return cutTriangleByPlane(p, p_plane_intersections, result);
+    result.push_back(std::move(above));
+    result.push_back(std::move(below));
 }
 
-// Cut a triangle with a coplanar triangle. We treat all three edges of the cutting triangle as cutting planes.
-bool sliceTriangleCoplanar(const Triangle& p, const Triangle& q, std::vector<Triangle>& result) {
-    // Check if any point of p is in q or any point of q is inside p. If not, then return p.
-    if (!p.overlaps(q)) {
-        return false;
-        // result.push_back(p);
-        // return;
-    }
-    
-    // If p is entirely contained in q, then nothing to do to p.
-    // This will also catch cases where p and q are identical.
-    // p will cause q to get cut up later.
-    if (q.contains(p)) {
-        return false;
-        // result.push_back(p);
-        // return;
-    }
-    
-    // At this point, p and q overlap and some of p is outside of q.
-    // We're going to slice up p according to all sides of q.
-    
-    std::vector<Triangle> src[2];
-    bool which_source = 0;
-    src[0].push_back(p);
-    for (int i=0; i<3; i++) {
-        src[!which_source].clear();
-        // Get an edge of q by which to cut all triangles of p
-        Line q_edge = q.getEdge(i);
-        // Iterate over all triangles of p
-        for (const auto& pt : src[which_source]) {
-            bool ok = sliceTriangleByEdge(pt, q_edge, src[!which_source]);
-            if (!ok) src[!which_source].push_back(pt);
+// Cut every piece that straddles the plane, moving the pieces from src to dst
+template <typename S>
+static void splitPiecesByPlane(std::vector<PolygonT<S>>& src, const PlaneT<S>& plane, CornerSigns& signs, std::vector<PolygonT<S>>& dst) {
+    for (PolygonT<S>& piece : src) {
+        signs.classify(plane, piece);
+        if (signs.straddles()) {
+            splitPolygonByPlane(piece, signs, plane, dst);
+        } else {
+            dst.push_back(std::move(piece));
         }
-        which_source = !which_source;
     }
-    
-    result.insert(result.end(), src[which_source].begin(), src[which_source].end());
-    return true;
+    src.clear();
 }
 
-// Slice a triangle with the plane of another triangle. There will be at most one cutting plane.
-bool sliceTriangleNoncoplanar(const Triangle& p, const Triangle& q, std::vector<Triangle>& result) {
-    // Compute line of intersection between p and q
-    std::cout << "Triangle p: " << p << std::endl;
-    std::cout << "Triangle q: " << q << std::endl;
-    const Plane& plane_p = p.getPlane();
-    const Plane& plane_q = q.getPlane();
-    Line plane_intersection = planeIntersection(plane_p, plane_q);
-    
-    std::cout << "Intersecting line: " << plane_intersection << std::endl;
-    
-    // First check to be sure this line touches q. Since q is the slicer, if the slicing line is outside of q, then q 
-    // isn't cutting p.
-    LineIntersection q_plane_intersections[3];
-    bool plane_intersects_q = false;
-    for (int i=0; i<3; i++) {
-        // Get an edge and intersect with the plane intersection
-        Line q_edge = q.getEdge(i);
-        LineIntersection& inter(q_plane_intersections[i]);
-        inter = lineIntersection(q_edge, plane_intersection);
-        // TODO add sanity check
-        
-        std::cout << "Q Edge=" << q_edge << " inter=" << inter << std::endl;
-        
-        // The edge of q is line 0, so we check to see if the cutting plane cuts that edge
-        if (inter.exists && inter.inside_line[0]) plane_intersects_q = true;
-    }
-    // If the cutting plane doesn't touch p, keep all of p.
-    if (!plane_intersects_q) {
-        // Add p to result
-        return false;
-    }
-    
-    // Check for plane_intersection being parallel to sides of q.
-    // The cutting plane is coincident to a side if it goes through end points of the other lines
-    for (int i=0; i<3; i++) {
-        // 'i' is a side of the triangle, and we want to check its end point
-        // 'j' the side after the nest, and we want to check its start point.
-        int j = (i+2)%3;
-        // End of one edge and start of the second edge after
-        if (q_plane_intersections[i].exists && q_plane_intersections[j].exists && q_plane_intersections[i].t[0] == 1 && q_plane_intersections[j].t[0] == 0) return false;
+// Whether a convex polygon in the plane contains the point, by the triangles of a fan
+template <typename S>
+static bool polygonContainsPoint(const PolygonT<S>& p, const PlaneT<S>& plane_p, const Vector4<S>& point) {
+    for (size_t i=1; i+1<p.size(); i++) {
+        if (TriangleT<S>(p[0], p[i], p[i+1], plane_p).containsPoint(point)) return true;
     }
-    
-    // Similarly, check to make sure that the interesection line cuts p
-    LineIntersection p_plane_intersections[3];
-    bool plane_intersects_p = false;
-    for (int i=0; i<3; i++) {
-        Line p_edge = p.getEdge(i);
-        LineIntersection& inter(p_plane_intersections[i]);
-        inter = lineIntersection(p_edge, plane_intersection);
-        std::cout << "P Edge=" << p_edge << " inter=" << inter << std::endl;
+    return false;
+}
+
+// Cut the pieces of p by a coplanar triangle. We treat all three edges of
+// the cutting triangle as cutting planes, square to p.
+template <typename S>
+static void slicePiecesCoplanar(std::vector<PolygonT<S>>& pieces, const PlaneT<S>& plane_p, const TriangleT<S>& q, CornerSigns& signs, std::vector<PolygonT<S>>& result) {
+    std::vector<PolygonT<S>> src[2];
+    for (PolygonT<S>& piece : pieces) {
+        // A piece that misses q, or that q covers, is left alone. Identical
+        // pieces are kept whole, and will be cut by the other side.
+        bool overlaps = false, covered = true;
+        for (const Vector4<S>& c : piece) {
+            if (q.containsPoint(c)) {
+                overlaps = true;
+            } else {
+                covered = false;
+            }
+        }
+        for (int i=0; i<3 && !overlaps; i++) overlaps = polygonContainsPoint(piece, plane_p, q[i]);
+        if (!overlaps || covered) {
+            result.push_back(std::move(piece));
+            continue;
+        }
         
-        // TODO add sanity check
-        if (inter.exists && inter.inside_line[0]) plane_intersects_p = true;
-    }
-    if (!plane_intersects_p) {
-        // Add p to result
-        return false;
+        THEOCAD_TRACE(SLICE, VERBOSE, "Cutting a piece with the edges of " << q);
+        int which = 0;
+        src[which].clear();
+        src[which].push_back(std::move(piece));
+        for (int i=0; i<3; i++) {
+            LineT<S> q_edge = q.getEdge(i);
+            Vector4<S> normal = cross(q_edge.direction(), plane_p.getNormal());
+            PlaneT<S> plane(normal, -dot(normal, q_edge[0]));
+            src[!which].clear();
+            splitPiecesByPlane(src[which], plane, signs, src[!which]);
+            which = !which;
+        }
+        for (PolygonT<S>& p : src[which]) result.push_back(std::move(p));
     }
-    
-    return cutTriangleByPlane(p, p_plane_intersections, result);
+    pieces.clear();
 }
-    
-
 
-void sliceTriangle(const Triangle& p, const Triangle& q, std::vector<Triangle>& result) {
-    std::cout << "Slicing " << p << " by " << q << std::endl;
-    std::cout << "Pnormal=" << p.getNormal() << " Qnormal=" << q.getNormal() << std::endl;
-    if (p.parallelTo(q)) {
-        std::cout << "Parallel\n";
-        if (p.coplanar(q)) {
-            std::cout << "Coplanar\n";
-            if (!sliceTriangleCoplanar(p, q, result)) result.push_back(p);
+template <typename S>
+void sliceTriangleBy(const TriangleT<S>& p_init, const std::vector<const TriangleT<S>*>& cutters, std::vector<TriangleT<S>>& result) {
+    const PlaneT<S>& plane_p = p_init.getPlane();
+    int src = 0;
+    std::vector<PolygonT<S>> p[2];
+    CornerSigns signs;
+    // Start off with just the one triangle
+    p[src].push_back(PolygonT<S>{p_init[0], p_init[1], p_init[2]});
+    bool cut = false;
+    // Iterate over all the cutters
+    for (const TriangleT<S> *q : cutters) {
+        checkCancelled();
+        THEOCAD_TRACE(SLICE, DEBUG, "Slicing " << p_init << " by " << *q);
+        if (p_init.parallelTo(*q)) {
+            if (!p_init.coplanar(*q)) continue;
+            THEOCAD_TRACE(SLICE, VERBOSE, "Coplanar");
+            p[!src].clear();
+            slicePiecesCoplanar(p[src], plane_p, *q, signs, p[!src]);
         } else {
-            std::cout << "Just parallel\n";
-            result.push_back(p);
+            // q has to cross p's plane, or the line where they meet misses
+            // q. q is the slicer, and it cuts with its whole plane.
+            VertexSigns q_signs(plane_p, *q);
+            if (!q_signs.straddles()) continue;
+            THEOCAD_TRACE(SLICE, VERBOSE, "Noncoplanar");
+            p[!src].clear();
+            splitPiecesByPlane(p[src], q->getPlane(), signs, p[!src]);
         }
-    } else {
-        std::cout << "Noncoplanar\n";
-        if (!sliceTriangleNoncoplanar(p, q, result)) result.push_back(p);
+        src = !src;
+        cut = cut || p[src].size() > 1;
     }
-    std::cout << "Result:";
-    for (const auto& i : result) {
-        std::cout << " " << i;
+    
+    if (!cut) {
+        result.push_back(p_init);
+        return;
     }
-    std::cout << std::endl;
-}
-
-void sliceTriangles(const std::vector<Triangle>& A, const std::vector<Triangle>& B, std::vector<Triangle>& result) {    
-    // Iterate over all triangles in A.
-    int i = 0, j;
-    for (const Triangle& p_init : A) {
-        int src = 0;
-        std::vector<Triangle> p[2];
-        // Start off with just one triangle from A
-        p[src].push_back(p_init);
-        // Iterate over all triangles in B
-        j = 0;
-        for (const Triangle& q : B) {
-            std::cout << " p" << i << " q" << j << std::endl;
-            p[!src].clear();
-            // Slice each triangle in our temp list against q
-            for (const Triangle& r : p[src]) {
-                // Slice r by q, putting pieces into p
-                sliceTriangle(r, q, p[!src]);
+    
+    // Fan each piece out from its least corner, so that equal pieces from
+    // either side of a Boolean make equal triangles
+    auto less = [](const Vector4<S>& a, const Vector4<S>& b) {
+        for (int i=0; i<3; i++) {
+            if (a[i] != b[i]) return a[i] < b[i];
+        }
+        return false;
+    };
+    for (const PolygonT<S>& piece : p[src]) {
+        size_t n = piece.size();
+        size_t first = std::min_element(piece.begin(), piece.end(), less) - piece.begin();
+        for (size_t i=1; i+1<n; i++) {
+            TriangleT<S> t(piece[first], piece[(first + i) % n], piece[(first + i + 1) % n], plane_p);
+            if constexpr (!ScalarTraits<S>::exact) {
+                // Rounding can leave a sliver
+                if (!t.isValid()) continue;
             }
-            // Swap lists
-            src = !src;
-            j++;
+            result.push_back(t);
         }
-        // The sliced p should be in p[src]
-        result.insert(result.end(), p[src].begin(), p[src].end());
-        i++;
     }
+    THEOCAD_TRACE(SLICE, VERBOSE, "Result:" << result);
+}
+
+template <typename S>
+void sliceTriangles(const std::vector<TriangleT<S>>& A, const std::vector<TriangleT<S>>& B, std::vector<TriangleT<S>>& result) {    
+    AABBTreeT<S> tree;
+    tree.build(B);
+    
+    // Each triangle of A is sliced independently, so fan them out and
+    // gather the pieces in A's order afterwards
+    std::vector<std::vector<TriangleT<S>>> pieces(A.size());
+    parallelFor(A.size(), [&](int i) {
+        const TriangleT<S>& p_init = A[i];
+        // Pieces of p never leave p's box, so only triangles of B that
+        // overlap it can cut them. Keep B's order so that the result doesn't
+        // depend on the shape of the tree.
+        std::vector<int> candidates;
+        tree.query(boundingBox(p_init), candidates);
+        std::sort(candidates.begin(), candidates.end());
+        std::vector<const TriangleT<S>*> cutters;
+        for (int j : candidates) cutters.push_back(&B[j]);
+        sliceTriangleBy(p_init, cutters, pieces[i]);
+    });
+    for (const auto& p : pieces) result.insert(result.end(), p.begin(), p.end());
     
 #if 0
     // Iterate over all triangles in B.
-    for (const Triangle& p_init : B) {
+    for (const TriangleT<S>& p_init : B) {
         int src = 0;
-        std::vector<Triangle> p[2];
+        std::vector<TriangleT<S>> p[2];
         // Start off with just one triangle from B
         p[src].push_back(p_init);
         // Iterate over all triangles in A
-        for (const Triangle& q : A) {
+        for (const TriangleT<S>& q : A) {
             p[!src].clear();
             // Slice each triangle in our temp list against q
-            for (const Triangle& r : p[src]) {
+            for (const TriangleT<S>& r : p[src]) {
                 // Slice r by q, putting pieces into p
                 sliceTriangle(r, q, p[!src]);
             }
@@ -263,4 +256,9 @@ void sliceTriangles(const std::vector<Triangle>& A, const std::vector<Triangle>&
     // Boolean will have to find and deal with identical triangles
 }
 
+#define THEOCAD_INSTANTIATE_SLICE(S) \
+    template void sliceTriangleBy<S>(const TriangleT<S>&, const std::vector<const TriangleT<S>*>&, std::vector<TriangleT<S>>&); \
+    template void sliceTriangles<S>(const std::vector<TriangleT<S>>&, const std::vector<TriangleT<S>>&, std::vector<TriangleT<S>>&);
+THEOCAD_FOR_EACH_SCALAR(THEOCAD_INSTANTIATE_SLICE)
+
 } // namespace theocad
@@ -0,0 +1,9 @@
+#ifndef INCLUDED_VERSION_HPP
+#define INCLUDED_VERSION_HPP
+
+// The library's version. Results cached on disk are only trusted by the
+// version that wrote them, so bump this with any change that could alter
+// the surfaces the kernel produces.
+#define THEOCAD_VERSION "0.2.0"
+
+#endif